@@ -0,0 +1,287 @@
+// libsqlitec のベンチマーク(make bench)。結果を JSON で標準出力に書く
+//
+// 件数ごとに次の負荷を測る。どれも固定の種から作るので、同じ件数なら毎回同じ操作になる
+//   insert_sequential: id の昇順に execute_insert する
+//   insert_random:     id をシャッフルした順に execute_insert する
+//   insert_split:      最長の username と email の行をシャッフルした順に入れる。葉が十数行で分割される
+//   find:              開き直したデータベースで、ランダムな id を table_find で探す
+//   scan:              select で全ての行を読む。1行を1操作として数える
+//   find_email:        email の索引を作ってから、ランダムな行を select where email = ? で探す
+//
+// 挿入は BENCH_BATCH_ROWS 行ごとにコミットする。ops_per_sec はコミットの時間を含み、
+// 遅延(1操作ごとの時間)は含まない
+// 内部の関数を直接呼ぶため、sqlitec.c をそのまま取り込む
+#include "sqlitec.c"
+#include <time.h>
+
+#define BENCH_FILENAME "bench.db"
+#define BENCH_SEED 0x5eed5eedULL
+#define BENCH_BATCH_ROWS 1000
+#define BENCH_MAX_SIZES 16
+
+typedef struct {
+	uint64_t* latencies;
+	uint64_t num_ops;
+	uint64_t start_ns;
+	uint64_t pages_read;
+	uint64_t pages_written;
+} BenchRun;
+
+static uint64_t bench_seed = BENCH_SEED;
+static bool bench_first_result = true;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t bench_random(void) {
+	bench_seed ^= bench_seed >> 12;
+	bench_seed ^= bench_seed << 25;
+	bench_seed ^= bench_seed >> 27;
+	return bench_seed * 0x2545F4914F6CDD1DULL;
+}
+
+// 1..n を並べ替えた配列
+static uint32_t* shuffled_keys(uint32_t n) {
+	uint32_t* keys = malloc(n * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		keys[i] = i + 1;
+	}
+	for (uint32_t i = n - 1; i > 0; i--) {
+		uint32_t j = bench_random() % (i + 1);
+		uint32_t key = keys[i];
+		keys[i] = keys[j];
+		keys[j] = key;
+	}
+	return keys;
+}
+
+static Table* bench_open(PagerOptions* options, bool fresh) {
+	if (fresh) {
+		unlink(BENCH_FILENAME);
+		unlink(BENCH_FILENAME WAL_FILENAME_SUFFIX);
+	}
+	return db_open(BENCH_FILENAME, options);
+}
+
+static void bench_start(BenchRun* run, Table* table, uint64_t capacity) {
+	run->latencies = malloc(capacity * sizeof(uint64_t));
+	run->num_ops = 0;
+	run->pages_read = __atomic_load_n(&table->pager->stats.pages_read, __ATOMIC_RELAXED);
+	run->pages_written = table->pager->wal->pages_written;
+	run->start_ns = now_ns();
+}
+
+static int compare_latencies(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// 小さい方から q の割合の位置にある遅延(nearest rank)
+static uint64_t percentile(uint64_t* sorted, uint64_t n, double q) {
+	// 空のテーブルの scan のように、測った回数が 0 のこともある
+	if (n == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(q * n + 0.999999);
+	if (rank == 0) {
+		rank = 1;
+	}
+	return sorted[(rank > n ? n : rank) - 1];
+}
+
+static void bench_finish(BenchRun* run, Table* table, const char* name, uint32_t rows) {
+	double seconds = (now_ns() - run->start_ns) / 1e9;
+	uint64_t pages_read = __atomic_load_n(&table->pager->stats.pages_read, __ATOMIC_RELAXED) - run->pages_read;
+	uint64_t pages_written = table->pager->wal->pages_written - run->pages_written;
+	qsort(run->latencies, run->num_ops, sizeof(uint64_t), compare_latencies);
+	// WALのページをファイルに戻してから大きさを測る。--compress では圧縮した大きさ
+	pager_checkpoint(table->pager);
+	struct stat file_stat;
+	fstat(table->pager->file_descriptor, &file_stat);
+
+	printf("%s\n    {\"workload\": \"%s\", \"rows\": %u, \"ops\": %lu, \"seconds\": %.6f, "
+	       "\"ops_per_sec\": %.0f, \"latency_ns\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu}, "
+	       "\"pages_read\": %lu, \"pages_written\": %lu, \"file_pages\": %u, \"file_bytes\": %ld}",
+	       bench_first_result ? "" : ",", name, rows, run->num_ops, seconds,
+	       seconds > 0 ? run->num_ops / seconds : 0.0, percentile(run->latencies, run->num_ops, 0.50),
+	       percentile(run->latencies, run->num_ops, 0.99), percentile(run->latencies, run->num_ops, 0.999),
+	       pages_read, pages_written, table->pager->num_pages, (long)file_stat.st_size);
+	bench_first_result = false;
+	free(run->latencies);
+}
+
+static void fill_row(Row* row, uint32_t id, bool long_row) {
+	row->id = id;
+	if (long_row) {
+		memset(row->username, 'u', COLUMN_USERNAME_SIZE);
+		row->username[COLUMN_USERNAME_SIZE] = '\0';
+		memset(row->email, 'e', COLUMN_EMAIL_SIZE);
+		row->email[COLUMN_EMAIL_SIZE] = '\0';
+	} else {
+		snprintf(row->username, sizeof(row->username), "user%u", id);
+		snprintf(row->email, sizeof(row->email), "user%u@example.com", id);
+	}
+}
+
+// keys の順に挿入する。keys が NULL なら 1..n の昇順
+static void bench_insert(Table* table, const char* name, uint32_t n, const uint32_t* keys, bool long_rows) {
+	Statement* statement;
+	prepare_statement(table, "insert 0 a b", &statement);
+	BenchRun run;
+	bench_start(&run, table, n);
+	execute_begin(table, NULL);
+	for (uint32_t i = 0; i < n; i++) {
+		fill_row(&statement->row_to_insert, keys == NULL ? i + 1 : keys[i], long_rows);
+		uint64_t start = now_ns();
+		ExecuteResult result = execute_insert(statement, table);
+		run.latencies[run.num_ops++] = now_ns() - start;
+		if (result != EXECUTE_SUCCESS) {
+			printf("Error: %s: %s\n", name, execute_result_message(result));
+			exit(EXIT_FAILURE);
+		}
+		if ((i + 1) % BENCH_BATCH_ROWS == 0) {
+			execute_commit(table);
+			execute_begin(table, NULL);
+		}
+	}
+	execute_commit(table);
+	bench_finish(&run, table, name, n);
+	statement_finalize(statement);
+}
+
+static void bench_find(Table* table, uint32_t n) {
+	BenchRun run;
+	bench_start(&run, table, n);
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t key = bench_random() % n + 1;
+		uint64_t start = now_ns();
+		Cursor* cursor = table_find(table, key);
+		bool found = cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+		             *leaf_node_key(cursor->node, cursor->cell_num) == key;
+		cursor_close(cursor);
+		run.latencies[run.num_ops++] = now_ns() - start;
+		if (!found) {
+			printf("Error: find: key %u not found\n", key);
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_finish(&run, table, "find", n);
+}
+
+static void bench_scan(Table* table, uint32_t n) {
+	Statement* statement;
+	prepare_statement(table, "select", &statement);
+	BenchRun run;
+	bench_start(&run, table, n + 1);
+	while (true) {
+		uint64_t start = now_ns();
+		ExecuteResult result = execute_select(statement, table);
+		run.latencies[run.num_ops] = now_ns() - start;
+		if (result != EXECUTE_ROW) {
+			break;
+		}
+		run.num_ops++;
+	}
+	if (run.num_ops != n) {
+		printf("Error: scan: read %lu rows, expected %u\n", run.num_ops, n);
+		exit(EXIT_FAILURE);
+	}
+	bench_finish(&run, table, "scan", n);
+	statement_finalize(statement);
+}
+
+static void bench_find_email(Table* table, uint32_t n) {
+	Statement* statement;
+	prepare_statement(table, "create index on email", &statement);
+	statement_step(statement);
+	statement_finalize(statement);
+
+	prepare_statement(table, "select where email = ?", &statement);
+	BenchRun run;
+	bench_start(&run, table, n);
+	char email[COLUMN_EMAIL_SIZE + 1];
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t key = bench_random() % n + 1;
+		snprintf(email, sizeof(email), "user%u@example.com", key);
+		uint64_t start = now_ns();
+		statement_bind_text(statement, 1, email);
+		bool found = statement_step(statement) == EXECUTE_ROW && statement_row(statement)->id == key;
+		statement_reset(statement);
+		run.latencies[run.num_ops++] = now_ns() - start;
+		if (!found) {
+			printf("Error: find_email: %s not found\n", email);
+			exit(EXIT_FAILURE);
+		}
+	}
+	bench_finish(&run, table, "find_email", n);
+	statement_finalize(statement);
+}
+
+static void bench_size(PagerOptions* options, uint32_t n) {
+	Table* table = bench_open(options, true);
+	bench_insert(table, "insert_sequential", n, NULL, false);
+	db_close(table);
+
+	uint32_t* keys = shuffled_keys(n);
+	table = bench_open(options, true);
+	bench_insert(table, "insert_random", n, keys, false);
+	db_close(table);
+
+	// 読み込みはキャッシュが空の状態から測る
+	table = bench_open(options, false);
+	bench_find(table, n);
+	bench_scan(table, n);
+	bench_find_email(table, n);
+	db_close(table);
+
+	table = bench_open(options, true);
+	bench_insert(table, "insert_split", n, keys, true);
+	db_close(table);
+	free(keys);
+}
+
+int main(int argc, char* argv[]) {
+	PagerOptions options = {PAGER_DEFAULT_NUM_FRAMES, false, PAGE_CODEC_NONE};
+	uint32_t sizes[BENCH_MAX_SIZES];
+	uint32_t num_sizes = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+			options.num_frames = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--mmap") == 0) {
+			options.use_mmap = true;
+		} else if (strcmp(argv[i], "--compress") == 0) {
+			options.codec = PAGE_CODEC_LZ;
+		} else {
+			char* end;
+			unsigned long size = strtoul(argv[i], &end, 10);
+			if (*end != '\0' || size == 0 || size > UINT32_MAX - 1 || num_sizes == BENCH_MAX_SIZES) {
+				printf("Usage: %s [--cache-pages N] [--mmap] [--compress] [rows ...]\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			sizes[num_sizes++] = size;
+		}
+	}
+	if (num_sizes == 0) {
+		sizes[num_sizes++] = 1000;
+		sizes[num_sizes++] = 10000;
+		sizes[num_sizes++] = 100000;
+	}
+
+	printf("{\n  \"page_size\": %u, \"cache_pages\": %u, \"mmap\": %s, \"codec\": \"%s\", \"seed\": %llu, "
+	       "\"batch_rows\": %u,\n  \"results\": [",
+	       PAGE_SIZE, options.use_mmap ? 0 : options.num_frames, options.use_mmap ? "true" : "false",
+	       options.codec == PAGE_CODEC_LZ ? "lz" : "none", (unsigned long long)BENCH_SEED, BENCH_BATCH_ROWS);
+	for (uint32_t i = 0; i < num_sizes; i++) {
+		bench_size(&options, sizes[i]);
+	}
+	printf("\n  ]\n}\n");
+
+	unlink(BENCH_FILENAME);
+	unlink(BENCH_FILENAME WAL_FILENAME_SUFFIX);
+	return 0;
+}
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "client.h"
+#include "protocol.h"
+
+// 溜めた要求がこれを超えたら、client_next を待たずに送る
+#define CLIENT_SEND_BUFFER_SIZE (64 * 1024)
+#define CLIENT_RECEIVE_BUFFER_SIZE (128 * 1024)
+#define CLIENT_MESSAGE_SIZE 256
+#define CLIENT_VARINT_MAX_SIZE 5
+
+struct Client {
+	int socket;
+	// 送っていない要求
+	uint8_t* output;
+	uint32_t output_used;
+	uint32_t output_capacity;
+	// 受け取ってまだ読んでいない応答は input[input_start, input_used)
+	uint8_t* input;
+	uint32_t input_start;
+	uint32_t input_used;
+	uint32_t input_capacity;
+	// 読んでいる途中の RESPONSE_ROWS の残りのバイト数。input_start から始まる
+	uint32_t rows_remaining;
+	char message[CLIENT_MESSAGE_SIZE];
+};
+
+static bool client_flush(Client* client);
+static bool client_receive(Client* client, int flags);
+static uint8_t* client_reserve(Client* client, uint32_t size);
+static uint32_t client_write_varint(uint32_t value, uint8_t* destination);
+static bool client_read_varint(const uint8_t** p, const uint8_t* end, uint32_t* value);
+
+Client* client_connect(const char* address) {
+	char host[INET_ADDRSTRLEN];
+	const char* colon = strrchr(address, ':');
+	if (colon == NULL || colon == address || (size_t)(colon - address) >= sizeof(host)) {
+		return NULL;
+	}
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+	char* end;
+	long port = strtol(colon + 1, &end, 10);
+	struct sockaddr_in socket_address;
+	memset(&socket_address, 0, sizeof(socket_address));
+	socket_address.sin_family = AF_INET;
+	socket_address.sin_port = htons(port);
+	if (*end != '\0' || port <= 0 || port > 65535 ||
+	    inet_pton(AF_INET, host, &socket_address.sin_addr) != 1) {
+		return NULL;
+	}
+
+	int client_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client_socket == -1) {
+		return NULL;
+	}
+	if (connect(client_socket, (struct sockaddr*)&socket_address, sizeof(socket_address)) == -1) {
+		close(client_socket);
+		return NULL;
+	}
+	int no_delay = 1;
+	setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+	Client* client = calloc(1, sizeof(Client));
+	client->socket = client_socket;
+	client->output_capacity = CLIENT_SEND_BUFFER_SIZE + sizeof(uint32_t) + PROTOCOL_MAX_REQUEST_SIZE;
+	client->output = malloc(client->output_capacity);
+	client->input_capacity = CLIENT_RECEIVE_BUFFER_SIZE;
+	client->input = malloc(client->input_capacity);
+	return client;
+}
+
+bool client_send(Client* client, const char* sql, const ClientValue* params, uint32_t num_params) {
+	if (num_params > UINT8_MAX) {
+		return false;
+	}
+	uint32_t sql_length = strlen(sql);
+	uint32_t length = 2 + sql_length;
+	for (uint32_t i = 0; i < num_params; i++) {
+		if (params[i].type == CLIENT_VALUE_INT) {
+			length += 1 + sizeof(int64_t);
+		} else {
+			length += 1 + CLIENT_VARINT_MAX_SIZE + strlen(params[i].text);
+		}
+	}
+	if (length > PROTOCOL_MAX_REQUEST_SIZE) {
+		return false;
+	}
+
+	// 長さは varint の大きさが決まってから書く
+	uint8_t* frame = client->output + client->output_used;
+	uint8_t* p = frame + sizeof(uint32_t);
+	*p++ = REQUEST_QUERY;
+	*p++ = num_params;
+	for (uint32_t i = 0; i < num_params; i++) {
+		if (params[i].type == CLIENT_VALUE_INT) {
+			*p++ = PARAM_INT;
+			memcpy(p, &params[i].integer, sizeof(int64_t));
+			p += sizeof(int64_t);
+		} else {
+			uint32_t text_length = strlen(params[i].text);
+			*p++ = PARAM_TEXT;
+			p += client_write_varint(text_length, p);
+			memcpy(p, params[i].text, text_length);
+			p += text_length;
+		}
+	}
+	memcpy(p, sql, sql_length);
+	p += sql_length;
+	uint32_t frame_length = p - frame - sizeof(uint32_t);
+	memcpy(frame, &frame_length, sizeof(frame_length));
+	client->output_used += p - frame;
+
+	if (client->output_used >= CLIENT_SEND_BUFFER_SIZE) {
+		return client_flush(client);
+	}
+	return true;
+}
+
+ClientResult client_next(Client* client, ClientRow* row) {
+	if (!client_flush(client)) {
+		return CLIENT_DISCONNECTED;
+	}
+	while (true) {
+		if (client->rows_remaining > 0) {
+			const uint8_t* p = client->input + client->input_start;
+			const uint8_t* end = p + client->rows_remaining;
+			if (end - p < (long)sizeof(uint32_t)) {
+				return CLIENT_DISCONNECTED;
+			}
+			memcpy(&row->id, p, sizeof(uint32_t));
+			p += sizeof(uint32_t);
+			if (!client_read_varint(&p, end, &row->username_length) ||
+			    (uint32_t)(end - p) < row->username_length) {
+				return CLIENT_DISCONNECTED;
+			}
+			row->username = (const char*)p;
+			p += row->username_length;
+			if (!client_read_varint(&p, end, &row->email_length) ||
+			    (uint32_t)(end - p) < row->email_length) {
+				return CLIENT_DISCONNECTED;
+			}
+			row->email = (const char*)p;
+			p += row->email_length;
+			uint32_t consumed = p - (client->input + client->input_start);
+			client->input_start += consumed;
+			client->rows_remaining -= consumed;
+			return CLIENT_ROW;
+		}
+
+		// フレームが全部届くまで待つ
+		uint32_t length;
+		while (true) {
+			uint32_t available = client->input_used - client->input_start;
+			if (available >= PROTOCOL_FRAME_HEADER_SIZE) {
+				memcpy(&length, client->input + client->input_start, sizeof(length));
+				if (length == 0) {
+					return CLIENT_DISCONNECTED;
+				}
+				if (available - sizeof(uint32_t) >= length) {
+					break;
+				}
+			}
+			if (!client_receive(client, 0)) {
+				return CLIENT_DISCONNECTED;
+			}
+		}
+		uint8_t* body = client->input + client->input_start + PROTOCOL_FRAME_HEADER_SIZE;
+		uint32_t body_length = length - 1;
+		uint8_t type = body[-1];
+		client->input_start += PROTOCOL_FRAME_HEADER_SIZE;
+		if (type == RESPONSE_ROWS) {
+			client->rows_remaining = body_length;
+			continue;
+		}
+		if (type != RESPONSE_DONE || body_length < 1) {
+			return CLIENT_DISCONNECTED;
+		}
+		client->input_start += body_length;
+		if (body[0] == RESPONSE_STATUS_OK) {
+			return CLIENT_DONE;
+		}
+		uint32_t message_length = body_length - 1;
+		if (message_length >= CLIENT_MESSAGE_SIZE) {
+			message_length = CLIENT_MESSAGE_SIZE - 1;
+		}
+		memcpy(client->message, body + 1, message_length);
+		client->message[message_length] = '\0';
+		return CLIENT_ERROR;
+	}
+}
+
+const char* client_error_message(Client* client) { return client->message; }
+
+void client_close(Client* client) {
+	close(client->socket);
+	free(client->output);
+	free(client->input);
+	free(client);
+}
+
+// 溜めた要求を全て送る
+// サーバは応答を送れない間は要求を読まないので、送りながら届いた応答も受け取っておく
+static bool client_flush(Client* client) {
+	uint32_t sent = 0;
+	while (sent < client->output_used) {
+		struct pollfd poll_fd = {.fd = client->socket, .events = POLLIN | POLLOUT};
+		if (poll(&poll_fd, 1, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if ((poll_fd.revents & POLLIN) && !client_receive(client, MSG_DONTWAIT)) {
+			return false;
+		}
+		if (poll_fd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+			ssize_t written = send(client->socket, client->output + sent, client->output_used - sent,
+			                       MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (written > 0) {
+				sent += written;
+			} else if (written == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				return false;
+			}
+		}
+	}
+	client->output_used = 0;
+	return true;
+}
+
+// 受け取った応答を input に足す。接続が切れていれば false
+static bool client_receive(Client* client, int flags) {
+	uint8_t* space = client_reserve(client, PROTOCOL_MAX_REQUEST_SIZE);
+	while (true) {
+		ssize_t received = recv(client->socket, space, client->input_capacity - client->input_used, flags);
+		if (received > 0) {
+			client->input_used += received;
+			return true;
+		}
+		if (received == -1 && errno == EINTR) {
+			continue;
+		}
+		return received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+}
+
+// input の後ろに size バイト以上の空きを作る。読み終えた分を詰め、足りなければ広げる
+static uint8_t* client_reserve(Client* client, uint32_t size) {
+	if (client->input_used + size > client->input_capacity) {
+		memmove(client->input, client->input + client->input_start, client->input_used - client->input_start);
+		client->input_used -= client->input_start;
+		client->input_start = 0;
+		while (client->input_used + size > client->input_capacity) {
+			client->input_capacity *= 2;
+		}
+		client->input = realloc(client->input, client->input_capacity);
+	}
+	return client->input + client->input_used;
+}
+
+static uint32_t client_write_varint(uint32_t value, uint8_t* destination) {
+	uint32_t size = 0;
+	while (value >= 0x80) {
+		destination[size++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	destination[size++] = value;
+	return size;
+}
+
+static bool client_read_varint(const uint8_t** p, const uint8_t* end, uint32_t* value) {
+	*value = 0;
+	for (uint32_t shift = 0; shift < 7 * CLIENT_VARINT_MAX_SIZE && *p < end; shift += 7) {
+		uint8_t byte = *(*p)++;
+		*value |= (uint32_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
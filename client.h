@@ -0,0 +1,64 @@
+// ./db --listen で動いているサーバに接続するクライアント
+//
+//   Client* client = client_connect("127.0.0.1:5432");
+//   ClientValue params[] = {{CLIENT_VALUE_INT, 1, NULL}, {CLIENT_VALUE_TEXT, 0, "alice"},
+//                           {CLIENT_VALUE_TEXT, 0, "alice@example.com"}};
+//   client_send(client, "insert ? ? ?", params, 3);
+//   client_send(client, "select", NULL, 0);
+//   ClientRow row;
+//   ClientResult result;
+//   while ((result = client_next(client, &row)) == CLIENT_ROW) { ... }
+//
+// client_send は応答を待たずに要求を溜めて送るので、続けて呼べば1往復で何文でも実行できる
+// 応答は送った順に client_next で読む。文ごとに0個以上の CLIENT_ROW と、
+// CLIENT_DONE か CLIENT_ERROR が1つ返る
+// 1つの Client は1つのスレッドで使う
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Client Client;
+
+typedef enum { CLIENT_VALUE_INT, CLIENT_VALUE_TEXT } ClientValueType;
+
+// SQL の ? に bind する値
+typedef struct {
+	ClientValueType type;
+	int64_t integer;
+	const char* text;
+} ClientValue;
+
+// 受け取った行。文字列は終端されていない
+// 次に client_next か client_send を呼ぶまで有効
+typedef struct {
+	uint32_t id;
+	const char* username;
+	uint32_t username_length;
+	const char* email;
+	uint32_t email_length;
+} ClientRow;
+
+typedef enum {
+	// row に select の行を入れた
+	CLIENT_ROW,
+	// 文が成功した(select は全ての行を返し終えた)
+	CLIENT_DONE,
+	// 文が失敗した。理由は client_error_message で読む
+	CLIENT_ERROR,
+	// 接続が切れたか、応答が壊れていた
+	CLIENT_DISCONNECTED
+} ClientResult;
+
+// host:port に接続する。接続できなければ NULL
+Client* client_connect(const char* address);
+// 文を1つ送る。接続が切れていたり要求が大きすぎれば false
+bool client_send(Client* client, const char* sql, const ClientValue* params, uint32_t num_params);
+// 送っていない要求を送り、次の応答を読む
+ClientResult client_next(Client* client, ClientRow* row);
+// 最後に CLIENT_ERROR を返した文のエラーメッセージ
+const char* client_error_message(Client* client);
+void client_close(Client* client);
+
+#endif
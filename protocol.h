@@ -0,0 +1,44 @@
+// サーバ(./db --listen)とクライアントの間のバイナリプロトコル
+//
+// 要求も応答もフレームで送る。フレームは4バイトの長さ(これに続くバイト数)、
+// 1バイトの種類、本体の順。整数はデータベースファイルと同じくリトルエンディアン
+//
+// クライアントは応答を待たずに要求を続けて送ってよい
+// サーバは要求を届いた順に実行し、要求ごとに0個以上の RESPONSE_ROWS と1つの RESPONSE_DONE を返す
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// 長さと種類
+#define PROTOCOL_FRAME_HEADER_SIZE 5
+// 要求フレームの長さの上限。超えるとサーバは接続を切る
+#define PROTOCOL_MAX_REQUEST_SIZE (64 * 1024)
+
+typedef enum {
+	// 文を1つ実行する
+	// 本体はパラメータの数(1バイト)、パラメータ、SQL(終端の0はなし)
+	// SQL の i 番目の ? に i 番目のパラメータを bind する
+	REQUEST_QUERY = 1
+} RequestType;
+
+typedef enum {
+	// 8バイトの符号付き整数
+	PARAM_INT = 1,
+	// varint の長さと文字列
+	PARAM_TEXT = 2
+} ParamType;
+
+typedef enum {
+	// select の行を並べたもの。行の形式は .mode binary と同じで、
+	// 4バイトのidと、varint の長さが前に付いた username と email
+	// 大きな結果は複数のフレームに分けて、できた分から送る
+	RESPONSE_ROWS = 1,
+	// 文が終わった。本体は状態(1バイト)と、エラーならメッセージ
+	RESPONSE_DONE = 2
+} ResponseType;
+
+typedef enum {
+	RESPONSE_STATUS_OK = 0,
+	RESPONSE_STATUS_ERROR = 1
+} ResponseStatus;
+
+#endif
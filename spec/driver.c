@@ -0,0 +1,385 @@
+// spec から libsqlitec の API を直接呼んで確かめるためのプログラム(make spec/driver)
+//
+//   spec/driver bind <db>   ? に値を bind して insert と select を実行し、返った行を表示する
+//   spec/driver row <db>    select の行を statement_row でコピーして表示する
+//   spec/driver readers <db> 1つの書き手が行を入れている間に、複数の読み手が select を繰り返す
+//   spec/driver snapshot <db> トランザクションの途中で別のスレッドの select が何を見るかを表示する
+//   spec/driver commits <db> 複数のスレッドが1行ずつコミットし、コミットと fdatasync の数を比べる
+//
+// 結果は1行ずつ標準出力に書き、spec がそれを読んで比べる
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "sqlitec.h"
+
+// readers: 書き手は READERS_BATCH_ROWS 行ずつのトランザクションで READERS_NUM_ROWS 行を入れる
+#define READERS_NUM_THREADS 4
+#define READERS_NUM_ROWS 20000
+#define READERS_BATCH_ROWS 100
+// commits: 各スレッドが COMMITS_PER_THREAD 回、1行の insert をコミットする
+#define COMMITS_NUM_THREADS 8
+#define COMMITS_PER_THREAD 50
+
+typedef struct {
+	Table* table;
+	// 書き手が終わった
+	int writer_done;
+	// 読み手が見つけたおかしな結果の数
+	int num_errors;
+	int num_scans;
+} ReadersTest;
+
+static const char* bind_result_names[] = {"BIND_SUCCESS", "BIND_OUT_OF_RANGE", "BIND_TYPE_MISMATCH",
+                                          "BIND_STRING_TOO_LONG", "BIND_NEGATIVE_ID"};
+
+static Statement* prepare(Table* table, const char* sql) {
+	Statement* statement;
+	PrepareResult result = prepare_statement(table, sql, &statement);
+	if (result != PREPARE_SUCCESS) {
+		printf("Error: %s: %s\n", sql, prepare_result_message(result));
+		exit(EXIT_FAILURE);
+	}
+	return statement;
+}
+
+static void step(Statement* statement) {
+	ExecuteResult result = statement_step(statement);
+	if (result != EXECUTE_SUCCESS) {
+		printf("Error: %s\n", execute_result_message(result));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// 行を返さない文を1回だけ実行する
+static void execute(Table* table, const char* sql) {
+	Statement* statement = prepare(table, sql);
+	step(statement);
+	statement_finalize(statement);
+}
+
+// select の残りの行を全て表示する
+static void print_rows(Statement* statement) {
+	RowView row;
+	while (statement_step(statement) == EXECUTE_ROW) {
+		statement_row_view(statement, &row);
+		printf("(%u, %.*s, %.*s)\n", row.id, (int)row.username_length, row.username, (int)row.email_length,
+		       row.email);
+	}
+}
+
+// 同じ文に bind し直して2回実行し、bind した値がそのまま行になって返ることを確かめる
+static void run_bind(Table* table) {
+	Statement* insert = prepare(table, "insert ? ? ?");
+	statement_bind_int(insert, 1, 7);
+	statement_bind_text(insert, 2, "alice");
+	statement_bind_text(insert, 3, "alice@example.com");
+	step(insert);
+	statement_bind_int(insert, 1, 8);
+	statement_bind_text(insert, 2, "bob");
+	statement_bind_text(insert, 3, "bob@example.com");
+	step(insert);
+
+	// 間違った bind は文を変えない
+	printf("bind 4: %s\n", bind_result_names[statement_bind_int(insert, 4, 1)]);
+	printf("bind text to id: %s\n", bind_result_names[statement_bind_text(insert, 1, "x")]);
+	printf("bind int to username: %s\n", bind_result_names[statement_bind_int(insert, 2, 1)]);
+	printf("bind negative id: %s\n", bind_result_names[statement_bind_int(insert, 1, -1)]);
+	printf("bind id above UINT32_MAX: %s\n", bind_result_names[statement_bind_int(insert, 1, 4294967296LL)]);
+	statement_finalize(insert);
+
+	Statement* select = prepare(table, "select where id between ? and ?");
+	statement_bind_int(select, 1, 7);
+	statement_bind_int(select, 2, 8);
+	print_rows(select);
+	statement_bind_int(select, 1, 8);
+	print_rows(select);
+	statement_finalize(select);
+}
+
+// statement_row の行はコピーなので、文を reset して葉のコピーを捨てた後も読める
+static void run_row(Table* table) {
+	Statement* select = prepare(table, "select");
+	if (statement_step(select) != EXECUTE_ROW) {
+		printf("Error: no rows\n");
+		exit(EXIT_FAILURE);
+	}
+	Row* first = statement_row(select);
+	statement_reset(select);
+	printf("first: (%u, %s, %s)\n", first->id, first->username, first->email);
+	while (statement_step(select) == EXECUTE_ROW) {
+		Row* row = statement_row(select);
+		printf("(%u, %s, %s)\n", row->id, row->username, row->email);
+	}
+	statement_finalize(select);
+}
+
+// 素数との積で 1..READERS_NUM_ROWS を並べ替えた順に入れる。葉の途中への挿入と分割が起きる
+static void* readers_writer(void* argument) {
+	ReadersTest* test = argument;
+	Statement* begin = prepare(test->table, "begin");
+	Statement* commit = prepare(test->table, "commit");
+	Statement* insert = prepare(test->table, "insert ? ? ?");
+	char text[64];
+	for (uint32_t i = 0; i < READERS_NUM_ROWS; i++) {
+		if (i % READERS_BATCH_ROWS == 0) {
+			step(begin);
+		}
+		uint32_t id = (uint64_t)i * 7919 % READERS_NUM_ROWS + 1;
+		statement_bind_int(insert, 1, id);
+		snprintf(text, sizeof(text), "user%u", id);
+		statement_bind_text(insert, 2, text);
+		snprintf(text, sizeof(text), "person%u@example.com", id);
+		statement_bind_text(insert, 3, text);
+		step(insert);
+		if (i % READERS_BATCH_ROWS == READERS_BATCH_ROWS - 1) {
+			step(commit);
+		}
+	}
+	statement_finalize(begin);
+	statement_finalize(commit);
+	statement_finalize(insert);
+	__atomic_store_n(&test->writer_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// 1回の select で、id が昇順に並び、username が id と合っている行の数を数える。合わなければ -1
+static int readers_scan(Statement* select) {
+	int count = 0;
+	uint32_t last_id = 0;
+	char username[64];
+	RowView row;
+	ExecuteResult result;
+	while ((result = statement_step(select)) == EXECUTE_ROW) {
+		statement_row_view(select, &row);
+		snprintf(username, sizeof(username), "user%u", row.id);
+		if (row.id <= last_id || row.username_length != strlen(username) ||
+		    memcmp(row.username, username, row.username_length) != 0) {
+			statement_reset(select);
+			return -1;
+		}
+		last_id = row.id;
+		count += 1;
+	}
+	return result == EXECUTE_SUCCESS ? count : -1;
+}
+
+// 書き手が終わるまで全体の select と id での select を繰り返す
+// 行は消さないので、同じ読み手が見る行数は減らない
+static void* readers_reader(void* argument) {
+	ReadersTest* test = argument;
+	Statement* select = prepare(test->table, "select");
+	Statement* find = prepare(test->table, "select where id = ?");
+	int last_count = 0;
+	uint32_t probe = 1;
+	while (true) {
+		int done = __atomic_load_n(&test->writer_done, __ATOMIC_ACQUIRE);
+		int count = readers_scan(select);
+		if (count < last_count) {
+			__atomic_fetch_add(&test->num_errors, 1, __ATOMIC_RELAXED);
+		}
+		last_count = count;
+		for (uint32_t i = 0; i < 100; i++) {
+			probe = probe * 1103515245 + 12345;
+			statement_bind_int(find, 1, probe % READERS_NUM_ROWS + 1);
+			if (readers_scan(find) < 0) {
+				__atomic_fetch_add(&test->num_errors, 1, __ATOMIC_RELAXED);
+			}
+		}
+		__atomic_fetch_add(&test->num_scans, 1, __ATOMIC_RELAXED);
+		// 書き手が終わってから始めた select は全ての行を見る
+		if (done) {
+			if (count != READERS_NUM_ROWS) {
+				__atomic_fetch_add(&test->num_errors, 1, __ATOMIC_RELAXED);
+			}
+			break;
+		}
+	}
+	statement_finalize(select);
+	statement_finalize(find);
+	return NULL;
+}
+
+static void run_readers(Table* table) {
+	ReadersTest test = {table, 0, 0, 0};
+	pthread_t writer;
+	pthread_t readers[READERS_NUM_THREADS];
+	pthread_create(&writer, NULL, readers_writer, &test);
+	for (uint32_t i = 0; i < READERS_NUM_THREADS; i++) {
+		pthread_create(&readers[i], NULL, readers_reader, &test);
+	}
+	pthread_join(writer, NULL);
+	for (uint32_t i = 0; i < READERS_NUM_THREADS; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	printf("readers: %d, errors: %d, scans: %s\n", READERS_NUM_THREADS, test.num_errors,
+	       test.num_scans >= READERS_NUM_THREADS ? "ok" : "too few");
+}
+
+// snapshot: 読み手のスレッドに渡すもの
+typedef struct {
+	Table* table;
+	const char* label;
+	// NULL でなければ、1行読んだ所と読み終える前に待ち合わせる
+	pthread_barrier_t* barrier;
+} SnapshotReader;
+
+// select で全ての行を読み、行数と id 5 の username、id 6 があるかを表示する
+static void snapshot_summary(Table* table, const char* label, pthread_barrier_t* barrier) {
+	Statement* select = prepare(table, "select");
+	int count = 0;
+	char username[64] = "-";
+	int has_6 = 0;
+	RowView row;
+	while (statement_step(select) == EXECUTE_ROW) {
+		statement_row_view(select, &row);
+		if (count == 0 && barrier != NULL) {
+			// 書き手がコミットする間、読みかけのまま待つ
+			pthread_barrier_wait(barrier);
+			pthread_barrier_wait(barrier);
+		}
+		count += 1;
+		if (row.id == 5) {
+			snprintf(username, sizeof(username), "%.*s", (int)row.username_length, row.username);
+		}
+		has_6 |= row.id == 6;
+	}
+	statement_finalize(select);
+	printf("%s: %d rows, id 5 is %s, id 6 %s\n", label, count, username, has_6 ? "found" : "missing");
+}
+
+static void* snapshot_reader(void* argument) {
+	SnapshotReader* reader = argument;
+	snapshot_summary(reader->table, reader->label, reader->barrier);
+	return NULL;
+}
+
+// 別のスレッドで snapshot_summary を実行して終わるのを待つ
+static void snapshot_read(Table* table, const char* label) {
+	SnapshotReader reader = {table, label, NULL};
+	pthread_t thread;
+	pthread_create(&thread, NULL, snapshot_reader, &reader);
+	pthread_join(thread, NULL);
+}
+
+// 100行を入れて id 5 を更新し id 6 を消すトランザクションを開き、コミットせずに戻る
+// 長い行で葉を分割させ、書き換える前のページの版を読み手が読むようにする
+static void snapshot_change(Table* table) {
+	execute(table, "begin");
+	Statement* insert = prepare(table, "insert ? ? ?");
+	char email[256];
+	memset(email, 'x', 200);
+	for (uint32_t id = 11; id <= 110; id++) {
+		statement_bind_int(insert, 1, id);
+		statement_bind_text(insert, 2, "new");
+		snprintf(email + 200, sizeof(email) - 200, "%u@example.com", id);
+		statement_bind_text(insert, 3, email);
+		step(insert);
+	}
+	statement_finalize(insert);
+	execute(table, "update 5 changed changed@example.com");
+	execute(table, "delete 6");
+}
+
+static void run_snapshot(Table* table) {
+	Statement* insert = prepare(table, "insert ? ? ?");
+	for (uint32_t id = 1; id <= 10; id++) {
+		statement_bind_int(insert, 1, id);
+		statement_bind_text(insert, 2, "old");
+		statement_bind_text(insert, 3, "old@example.com");
+		step(insert);
+	}
+	statement_finalize(insert);
+
+	snapshot_change(table);
+	snapshot_read(table, "during");
+	snapshot_summary(table, "own", NULL);
+	execute(table, "rollback");
+	snapshot_read(table, "after rollback");
+
+	// コミットより前に始めた select は、読み終えるまでコミット前の内容を見る
+	snapshot_change(table);
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, 2);
+	SnapshotReader reader = {table, "across commit", &barrier};
+	pthread_t thread;
+	pthread_create(&thread, NULL, snapshot_reader, &reader);
+	pthread_barrier_wait(&barrier);
+	execute(table, "commit");
+	pthread_barrier_wait(&barrier);
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&barrier);
+	snapshot_read(table, "after commit");
+}
+
+// commits: スレッドごとに別の id の範囲を入れる
+typedef struct {
+	Table* table;
+	uint32_t first_id;
+} CommitsWriter;
+
+static void* commits_writer(void* argument) {
+	CommitsWriter* writer = argument;
+	Statement* insert = prepare(writer->table, "insert ? a b");
+	for (uint32_t i = 0; i < COMMITS_PER_THREAD; i++) {
+		statement_bind_int(insert, 1, writer->first_id + i);
+		step(insert);
+	}
+	statement_finalize(insert);
+	return NULL;
+}
+
+// 書き手は同期の前に write_mutex を放すので、同期している間に他の書き手が追記して同じ同期を待てる
+// 全ての行がコミットされ、fdatasync がコミットより少なければグループコミットが効いている
+static void run_commits(Table* table) {
+	pthread_t threads[COMMITS_NUM_THREADS];
+	CommitsWriter writers[COMMITS_NUM_THREADS];
+	DbStats before;
+	db_stats(table, &before);
+	for (uint32_t i = 0; i < COMMITS_NUM_THREADS; i++) {
+		writers[i].table = table;
+		writers[i].first_id = i * COMMITS_PER_THREAD + 1;
+		pthread_create(&threads[i], NULL, commits_writer, &writers[i]);
+	}
+	for (uint32_t i = 0; i < COMMITS_NUM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	DbStats after;
+	db_stats(table, &after);
+
+	Statement* select = prepare(table, "select");
+	int count = 0;
+	while (statement_step(select) == EXECUTE_ROW) {
+		count++;
+	}
+	statement_finalize(select);
+	uint64_t commits = after.commits - before.commits;
+	uint64_t syncs = after.wal_syncs - before.wal_syncs;
+	printf("rows: %d, commits: %lu, syncs: %s\n", count, commits,
+	       syncs < commits ? "fewer than commits" : "one per commit");
+}
+
+int main(int argc, char* argv[]) {
+	if (argc != 3) {
+		printf("Usage: %s bind|row|readers|snapshot|commits <db>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	PagerOptions options = {PAGER_DEFAULT_NUM_FRAMES, false, PAGE_CODEC_NONE};
+	Table* table = db_open(argv[2], &options);
+	if (strcmp(argv[1], "bind") == 0) {
+		run_bind(table);
+	} else if (strcmp(argv[1], "row") == 0) {
+		run_row(table);
+	} else if (strcmp(argv[1], "readers") == 0) {
+		run_readers(table);
+	} else if (strcmp(argv[1], "snapshot") == 0) {
+		run_snapshot(table);
+	} else if (strcmp(argv[1], "commits") == 0) {
+		run_commits(table);
+	} else {
+		printf("Unknown mode '%s'\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
+	db_close(table);
+	return 0;
+}
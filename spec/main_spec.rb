@@ -1,19 +1,63 @@
+require 'socket'
+require 'json'
+
 describe 'database' do
-  def run_script(commands)
+  before do
+    `rm -rf test.db test.db-wal`
+  end
+
+  def run_script(commands, options = "")
     raw_output = nil
-    IO.popen("./db", "r+") do |pipe|
+    IO.popen("./db #{options} test.db", "r+") do |pipe|
+      # Read entire output while writing so long scripts cannot fill both pipes
+      reader = Thread.new { pipe.gets(nil) }
       commands.each do |command|
         pipe.puts command
       end
 
       pipe.close_write
 
-      # Read entire output
-      raw_output = pipe.gets(nil)
+      raw_output = reader.value
     end
     raw_output.split("\n")
   end
 
+  # length, type, then the parameter count, parameters and sql of a query
+  def query_frame(sql, params = [])
+    body = [1, params.size].pack("CC")
+    params.each do |param|
+      if param.is_a?(Integer)
+        body << [1, param].pack("Cq<")
+      else
+        body << [2, param.bytesize].pack("CC") << param
+      end
+    end
+    body << sql
+    [body.bytesize].pack("L<") + body
+  end
+
+  # reads the rows and errors of the next count statements
+  def read_responses(socket, count)
+    ids = []
+    errors = []
+    while count > 0
+      length, type = socket.read(5).unpack("L<C")
+      body = socket.read(length - 1)
+      if type == 1
+        until body.empty?
+          ids << body.unpack1("L<")
+          username_length = body.getbyte(4)
+          email_length = body.getbyte(5 + username_length)
+          body = body[6 + username_length + email_length..]
+        end
+      else
+        errors << body[1..] if body.getbyte(0) == 1
+        count -= 1
+      end
+    end
+    [ids, errors]
+  end
+
   it 'prints constants' do
     script = [
       ".constants",
@@ -23,13 +67,571 @@ describe 'database' do
   
     expect(result).to match_array([
       "db > Constants:",
-      "ROW_SIZE: 293",
-      "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 10",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4086",
-      "LEAF_NODE_MAX_CELLS: 13",
+      "ROW_MAX_SIZE: 301",
+      "COMMON_NODE_HEADER_SIZE: 10",
+      "LEAF_NODE_HEADER_SIZE: 22",
+      "LEAF_NODE_CELL_POINTER_SIZE: 2",
+      "LEAF_NODE_MAX_CELL_SIZE: 304",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4074",
+      "db > ",
+    ])
+  end
+
+  it 'keeps data after closing connection with a small buffer pool' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--cache-pages 16")
+
+    result = run_script(["select", ".exit"], "--cache-pages 16")
+    expect(result.first).to eq("db > (1, user1, person1@example.com)")
+    expect(result.last(3)).to eq([
+      "(14, user14, person14@example.com)",
+      "Executed.",
       "db > ",
     ])
   end
+
+  it 'scans ranges and looks up rows with a buffer pool smaller than the table' do
+    # about 14 rows per leaf: 5000 rows span several hundred leaves but only 16 frames
+    script = (1..5000).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    script = ["select where id between 1200 and 3800", "select where id = 17", "select where id = 4999", "select",
+              ".stats json", ".exit"]
+    result = run_script(script, "--cache-pages 16")
+    rows = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(rows).to eq((1200..3800).to_a + [17, 4999] + (1..5000).to_a)
+    stats = JSON.parse(result.grep(/\{/).first.sub("db > ", ""))
+    expect(stats["page_misses"]).to be_between(300, 5000)
+  end
+
+  it 'allows the tree to grow past two levels' do
+    # long emails keep about 14 rows per leaf so the root has to split
+    ids = (1..8000).to_a.shuffle(random: Random.new(42))
+    script = ids.map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script, "--cache-pages 16")
+
+    rows = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(rows).to eq((1..8000).to_a)
+    expect(result).not_to include("Error: Duplicate key.")
+  end
+
+  it 'finds every key through internal nodes with many keys' do
+    # long emails keep the leaves small, so internal nodes fill up with separator keys
+    ids = (1..3000).map { |i| i * 2 }.shuffle(random: Random.new(7))
+    script = ids.map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    # even ids are stored; their odd neighbours fall between two separator keys
+    probes = (1..6001).step(37).flat_map { |i| [i, i + 1] } + [1, 2, 5999, 6000, 6001, 6002]
+    script += probes.map { |i| "select where id = #{i}" }
+    script << ".exit"
+    result = run_script(script)
+
+    found = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(found).to eq(probes.select { |i| i.even? && i <= 6000 })
+  end
+
+  it 'reads and writes the same file format with the mmap pager' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--mmap")
+
+    result = run_script(["select", ".exit"])
+    expect(result.grep(/\(\d+, /).size).to eq(1000)
+    expect(File.size("test.db") % 4096).to eq(0)
+
+    result = run_script(["insert 1001 a b", "select", ".exit"], "--mmap")
+    expect(result.grep(/\(\d+, /).size).to eq(1001)
+  end
+
+  it 'compresses pages in a file created with --compress lz' do
+    script = (1..2000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    raw_size = File.size("test.db")
+
+    `rm -rf test.db test.db-wal`
+    run_script(script, "--compress lz")
+    expect(File.size("test.db")).to be_between(1, raw_size / 2)
+
+    # the codec is kept in the file, so it is reopened without the option
+    result = run_script(["insert 2001 a b", "select where id > 1998", ".check", ".exit"])
+    expect(result).to include("db > (1999, user1999, person1999@example.com)")
+    expect(result).to include("(2001, a, b)")
+    expect(result.grep(/checked \d+ pages and 2001 rows with \d+ threads: ok$/).size).to eq(1)
+    expect(File.size("test.db")).to be_between(1, raw_size / 2)
+  end
+
+  it 'recovers committed rows from the WAL when the process dies without .exit' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    # no .exit: the REPL stops on end of input without closing the table
+    run_script(script)
+    expect(File.exist?("test.db-wal")).to eq(true)
+
+    result = run_script(["select", ".exit"])
+    expect(result.grep(/\(\d+, /).size).to eq(50)
+    expect(File.exist?("test.db-wal")).to eq(false)
+  end
+
+  it 'bulk loads rows from a file into a packed tree' do
+    ids = (1..2000).to_a.shuffle(random: Random.new(7))
+    File.write("test.load", ids.map { |i| "#{i},user#{i},person#{i}@example.com\n" }.join)
+    result = run_script([".load test.load", "select", ".exit"])
+    File.delete("test.load")
+
+    expect(result).to include("db > Loaded 2000 rows.")
+    rows = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(rows).to eq((1..2000).to_a)
+    # full leaves: about 107 of these rows fit in a leaf
+    expect(File.size("test.db") / 4096).to be_between(20, 23)
+
+    result = run_script(["insert 2001 a b", "insert 5 a b", "select", ".exit"])
+    expect(result).to include("db > Error: Duplicate key.")
+    expect(result.grep(/\(\d+, /).size).to eq(2001)
+  end
+
+  it 'frees the pages of a bulk load that fails' do
+    # large enough that the load commits part of the tree before it finds the repeated id
+    lines = (1..100000).map { |i| "#{i},user#{i},person#{i}@example.com\n" }
+    File.write("test.load", lines.join + "100000,again,again@example.com\n")
+    result = run_script([".load test.load", ".check", ".exit"])
+    expect(result).to include("db > Error: Duplicate key in 'test.load'.")
+    expect(result.grep(/checked \d+ pages and 0 rows with \d+ threads: ok$/).size).to eq(1)
+
+    File.write("test.load", lines.first(3000).shuffle(random: Random.new(5)).join + "7,x,y\n")
+    result = run_script([".load test.load", ".check", ".exit"])
+    expect(result).to include("db > Error: Duplicate key in 'test.load'.")
+    expect(result.grep(/checked \d+ pages and 0 rows with \d+ threads: ok$/).size).to eq(1)
+
+    File.write("test.load", lines.first(3000).join)
+    result = run_script([".load test.load", ".check", "select", ".exit"])
+    File.delete("test.load")
+    expect(result).to include("db > Loaded 3000 rows.")
+    expect(result.grep(/checked \d+ pages and 3000 rows with \d+ threads: ok$/).size).to eq(1)
+    expect(result.grep(/\(\d+, /).size).to eq(3000)
+  end
+
+  it 'keeps leaves full when ids are inserted in increasing order' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "insert 500 a b"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result).to include("db > Error: Duplicate key.")
+    rows = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(rows).to eq((1..1000).to_a)
+    # 10 full leaves plus the root; splitting 50/50 would need about 19 pages
+    expect(File.size("test.db") / 4096).to be_between(10, 12)
+  end
+
+  it 'reuses cached statements and rejects unbound parameters' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "insert ? a b"
+    script << "select"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result).to include("db > Error: Unbound parameter.")
+    expect(result.grep(/\(\d+, /).size).to eq(200)
+    expect(result.grep(/\(100, /)).to eq(["(100, user100, person100@example.com)"] * 2)
+  end
+
+  it 'binds values to ? and returns them in rows' do
+    result = `./spec/driver bind test.db`.split("\n")
+    expect(result).to eq([
+      "bind 4: BIND_OUT_OF_RANGE",
+      "bind text to id: BIND_TYPE_MISMATCH",
+      "bind int to username: BIND_TYPE_MISMATCH",
+      "bind negative id: BIND_NEGATIVE_ID",
+      "bind id above UINT32_MAX: BIND_OUT_OF_RANGE",
+      "(7, alice, alice@example.com)",
+      "(8, bob, bob@example.com)",
+      "(8, bob, bob@example.com)",
+    ])
+
+    result = run_script(["select", ".exit"])
+    expect(result).to include("db > (7, alice, alice@example.com)")
+  end
+
+  it 'copies rows out of the page with statement_row' do
+    run_script(["insert 1 a a@x", "insert 2 #{"b" * 32} #{"e" * 255}", "insert 3 c c@x", ".exit"])
+    result = `./spec/driver row test.db`.split("\n")
+    expect(result).to eq([
+      "first: (1, a, a@x)",
+      "(1, a, a@x)",
+      "(2, #{"b" * 32}, #{"e" * 255})",
+      "(3, c, c@x)",
+    ])
+  end
+
+  it 'streams select output as csv and tsv' do
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      "insert 2 a,b say\"hi\"",
+      ".mode csv",
+      "select",
+      ".mode tsv",
+      "select",
+      ".exit",
+    ])
+
+    expect(result).to include("db > db > 1,user1,person1@example.com")
+    expect(result).to include("2,\"a,b\",\"say\"\"hi\"\"\"")
+    expect(result).to include("db > db > 1\tuser1\tperson1@example.com")
+    expect(result).to include("2\ta,b\tsay\"hi\"")
+  end
+
+  it 'accepts ids from 0 to 4294967295 in every statement' do
+    script = [
+      "insert 4294967295 max max@example.com",
+      "insert 0 zero zero@example.com",
+      "insert 4294967296 a b",
+      "insert 99999999999999999999 a b",
+      "insert 12x a b",
+      "insert abc a b",
+      "insert -1 a b",
+      "update 4294967296 a b",
+      "delete 4294967296",
+      "select where id = 4294967296",
+      "select limit 4294967296",
+      "select where id > 4294967294",
+      "select",
+      ".exit",
+    ]
+    result = run_script(script)
+    expect(result.count("db > Number is out of range.")).to eq(6)
+    expect(result.count("db > Syntax error, could not parse statement.")).to eq(2)
+    expect(result).to include("db > ID must be positive.")
+    expect(result.grep(/\(\d+, /)).to eq([
+      "db > (4294967295, max, max@example.com)",
+      "db > (0, zero, zero@example.com)",
+      "(4294967295, max, max@example.com)",
+    ])
+  end
+
+  it 'selects rows by id, by range and with a limit' do
+    script = (1..500).map do |i|
+      "insert #{i * 2} user#{i} person#{i}@example.com"
+    end
+    script += [
+      "select where id = 10",
+      "select where id = 11",
+      "select where id between 101 and 107",
+      "select where id > 994",
+      "select where id < 5",
+      "select where id >= 600 limit 2",
+      "select where name = 1",
+      ".exit",
+    ]
+    result = run_script(script)
+    ids = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+
+    expect(ids).to eq([10, 102, 104, 106, 996, 998, 1000, 2, 4, 600, 602])
+    expect(result).to include("db > Syntax error, could not parse statement.")
+  end
+
+  it 'frees the old root page once when deletes make the tree shorter' do
+    ids = (1..1000).to_a.shuffle(random: Random.new(11))
+    script = ids.map { |i| "insert #{i} user#{i} #{"x" * 200}#{i}@example.com" }
+    script += (1..990).map { |i| "delete #{i}" }
+    script << ".check"
+    script += (2001..3000).map { |i| "insert #{i} user#{i} #{"x" * 200}#{i}@example.com" }
+    script += [".check", "select", ".exit"]
+    result = run_script(script)
+
+    expect(result.grep(/checked \d+ pages and 10 rows with \d+ threads: ok$/).size).to eq(1)
+    expect(result.grep(/checked \d+ pages and 1010 rows with \d+ threads: ok$/).size).to eq(1)
+    ids = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(ids).to eq((991..1000).to_a + (2001..3000).to_a)
+  end
+
+  it 'deletes and updates rows and reuses freed pages' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script += (1..900).map { |i| "delete #{i}" }
+    script += [
+      "delete 5",
+      "update 950 renamed renamed@example.com",
+      "update 5 a b",
+      "select where id between 949 and 951",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result.count("db > Error: Key not found.")).to eq(2)
+    expect(result).to include("(950, renamed, renamed@example.com)")
+    expect(result.grep(/\(9(49|51), /).size).to eq(2)
+    size = File.size("test.db")
+
+    # the leaves merged away by the deletes are taken from the freelist
+    script = (2001..2900).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    rows = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(rows).to eq((901..1000).to_a + (2001..2900).to_a)
+    expect(File.size("test.db")).to be_between(size - 4096, size + 4096 * 8)
+  end
+
+  it 'shrinks the file with .vacuum' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script += (1..1000).select { |i| i % 10 != 0 }.map { |i| "delete #{i}" }
+    script << ".exit"
+    run_script(script)
+    size = File.size("test.db")
+
+    # a few tail pages at a time, then the rest in one pass
+    result = run_script([".vacuum 5", ".vacuum", "select", ".exit"])
+    expect(result.first).to eq("db > Vacuumed to 56 pages, 44 free pages left.")
+    expect(result).to include("db > Vacuumed to 12 pages.")
+    rows = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(rows).to eq((10..1000).step(10).to_a)
+    expect(File.size("test.db")).to eq(12 * 4096)
+    expect(size).to be_between(12 * 4096 * 4, 12 * 4096 * 6)
+  end
+
+  it 'commits or rolls back a batch of statements' do
+    rows = (1..300).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    # the small cache writes some uncommitted pages to the WAL before the rollback
+    script = ["commit", "begin"] + rows + ["rollback", "select where id = 5"]
+    script += ["begin", "begin"] + rows + ["commit"]
+    # no commit and no .exit: the last transaction is lost
+    script += ["begin", "insert 301 a b", "delete 5"]
+    result = run_script(script, "--cache-pages 16")
+
+    expect(result.first).to eq("db > Error: No transaction is active.")
+    expect(result).to include("db > Error: Already in a transaction.")
+    expect(result.grep(/\(\d+, /)).to eq([])
+
+    result = run_script(["select", ".exit"], "--cache-pages 16")
+    ids = result.grep(/\(\d+, /).map { |line| line[/\((\d+),/, 1].to_i }
+    expect(ids).to eq((1..300).to_a)
+  end
+
+  it 'reports counters and latencies with .stats' do
+    script = (1..300).to_a.shuffle(random: Random.new(7)).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script += ["select where id = 5", ".stats", ".stats json", ".exit"]
+    result = run_script(script)
+
+    expect(result.grep(/^insert: 300 in \d+ us/).size).to eq(1)
+    expect(result.grep(/^select: 1 in \d+ us/).size).to eq(1)
+    stats = JSON.parse(result.find { |line| line.include?('{"page_hits"') }.sub("db > ", ""))
+    expect(stats["finds"]).to be_between(2, 301)
+    expect(stats["find_depths"][2]).to be_between(1, 301)
+    expect(stats["leaf_splits"]).to be_between(15, 300)
+    expect(stats["internal_inserts"]).to eq(stats["leaf_splits"] - 1)
+    expect(stats["flushes"]).to be_between(300, 2000)
+    expect(stats["flush_bytes"]).to eq(stats["flushes"] * (4096 + 24))
+    expect(stats["statements"]["insert"]["buckets"].sum).to eq(300)
+  end
+
+  it 'checks the tree and detects corrupted pages with .check' do
+    script = (1..1000).to_a.shuffle(random: Random.new(3)).map do |i|
+      "insert #{i} user#{i} #{"x" * 200}#{i}@example.com"
+    end
+    script += (1..1000).step(3).map { |i| "delete #{i}" }
+    script += [".check", ".exit"]
+    result = run_script(script)
+    expect(result.grep(/checked \d+ pages and 666 rows with \d+ threads: ok$/).size).to eq(1)
+
+    # flip one bit in the cells of a leaf
+    File.open("test.db", "r+b") do |file|
+      file.seek(3 * 4096 + 3000)
+      byte = file.read(1).ord
+      file.seek(3 * 4096 + 3000)
+      file.write((byte ^ 1).chr)
+    end
+    result = run_script([".check", ".exit"])
+    expect(result.first).to eq("db > Error: page 3: checksum mismatch")
+    expect(result.grep(/: 1 errors$/).size).to eq(1)
+
+    result = run_script(["select"])
+    expect(result.last).to eq("db > Error: page 3 is corrupt (checksum mismatch)")
+  end
+
+  it 'finds rows by username and email through an index' do
+    script = (1..600).to_a.shuffle(random: Random.new(5)).map do |i|
+      "insert #{i} user#{i % 50} #{"abc"[i % 3]}#{i}@#{"x" * 150}"
+    end
+    script += [
+      "select where username = user8 limit 2",
+      "create index on username",
+      "create index on email",
+      "create index on email",
+      "select where username = user8 limit 2",
+      "select where email like b1%",
+      "update 8 alice a8@example.com",
+      "delete 58",
+      "select where username = user8 limit 2",
+      "select where email = a8@example.com",
+      "select where email like b1% limit 3",
+      ".vacuum",
+      ".check",
+      ".exit",
+    ]
+    result = run_script(script).map { |line| line.sub(/@x+\)$/, "@)") }
+    expect(result).to include("db > Error: Index already exists.")
+    # the same rows with and without the index
+    expect(result.grep(/^db > \(8, user8, c8@\)$/).size).to eq(2)
+    expect(result.grep(/^\(58, user8, b58@\)$/).size).to eq(2)
+    # index entries come in email order: "b100@" sorts before "b10@"
+    expect(result.grep(/^(db > )?\(1\d*, user\d+, b1\d*@\)$/).size).to eq(39 + 3)
+    expect(result).to include("db > (100, user0, b100@)")
+    expect(result).to include("(1, user1, b1@)")
+    expect(result).to include("db > (108, user8, a108@)")
+    expect(result).to include("(158, user8, c158@)")
+    expect(result).to include("db > (8, alice, a8@example.com)")
+    expect(result.grep(/checked \d+ pages and 599 rows with \d+ threads: ok$/).size).to eq(1)
+  end
+
+  it 'stores index keys with a shared prefix once per page' do
+    script = (1..1000).map { |i| "insert #{i} user#{i} #{"x" * 200}#{i}@example.com" }
+    script += [".vacuum", "create index on email", ".vacuum", ".check"]
+    script << "select where email = #{"x" * 200}512@example.com"
+    script << ".exit"
+    result = run_script(script)
+    table_pages, indexed_pages = result.grep(/Vacuumed to (\d+) pages/).map { |line| line[/\d+/].to_i }
+    # without the prefix each entry would take about 220 bytes, 18 to a page
+    expect(indexed_pages - table_pages).to be_between(1, 10)
+    expect(result.grep(/checked \d+ pages and 1000 rows with \d+ threads: ok$/).size).to eq(1)
+    expect(result).to include("db > (512, user512, #{"x" * 200}512@example.com)")
+  end
+
+  it 'runs selects from several threads while one thread inserts' do
+    result = `./spec/driver readers test.db`.split("\n")
+    expect(result).to eq(["readers: 4, errors: 0, scans: ok"])
+
+    result = run_script([".check", ".exit"])
+    expect(result.grep(/checked \d+ pages and 20000 rows with \d+ threads: ok$/).size).to eq(1)
+  end
+
+  it 'hides uncommitted and rolled back rows from other threads' do
+    result = `./spec/driver snapshot test.db`.split("\n")
+    expect(result).to eq([
+      "during: 10 rows, id 5 is old, id 6 found",
+      "own: 109 rows, id 5 is changed, id 6 missing",
+      "after rollback: 10 rows, id 5 is old, id 6 found",
+      "across commit: 10 rows, id 5 is old, id 6 found",
+      "after commit: 109 rows, id 5 is changed, id 6 missing",
+    ])
+
+    result = run_script([".check", ".exit"])
+    expect(result.grep(/checked \d+ pages and 109 rows with \d+ threads: ok$/).size).to eq(1)
+  end
+
+  it 'runs every benchmark workload and removes its database' do
+    result = JSON.parse(`./db_bench 300`)
+    expect(result["results"].map { |r| r["workload"] }).to eq(
+      ["insert_sequential", "insert_random", "find", "scan", "find_email", "insert_split"])
+    result["results"].each do |r|
+      expect([r["rows"], r["ops"]]).to eq([300, 300])
+      expect(r["file_bytes"]).to eq(r["file_pages"] * 4096)
+    end
+    expect(Dir.glob("bench.db*")).to eq([])
+  end
+
+  it 'shares one fdatasync between threads that commit together' do
+    result = `./spec/driver commits test.db`
+    expect(result).to eq("rows: 400, commits: 400, syncs: fewer than commits\n")
+
+    result = run_script([".check", ".exit"])
+    expect(result.grep(/checked \d+ pages and 400 rows with \d+ threads: ok$/).size).to eq(1)
+  end
+
+  it 'streams a large select to a slow reader over a socket' do
+    File.write("test.load", (1..30000).map { |i| "#{i},user#{i},person#{i}@example.com\n" }.join)
+    run_script([".load test.load", ".exit"])
+    File.delete("test.load")
+
+    # a small send buffer makes the server's sends partial while it keeps adding rows
+    server = IO.popen("./db --listen 127.0.0.1:0 --send-buffer 8192 test.db")
+    begin
+      port = server.gets[/:(\d+)$/, 1].to_i
+      reader = Socket.new(:INET, :STREAM)
+      reader.setsockopt(:SOCKET, :RCVBUF, 4096)
+      reader.connect(Socket.sockaddr_in(port, "127.0.0.1"))
+      reader.write(query_frame("select") + query_frame("select where id > 29990"))
+      slow_reader = Object.new
+      slow_reader.define_singleton_method(:read) do |length|
+        sleep 0.02
+        reader.read(length)
+      end
+      expect(read_responses(slow_reader, 2)).to eq([(1..30000).to_a + (29991..30000).to_a, []])
+      reader.close
+    ensure
+      Process.kill("TERM", server.pid)
+      server.close
+    end
+  end
+
+  it 'serves pipelined statements over a socket' do
+    server = IO.popen("./db --listen 127.0.0.1:0 test.db")
+    begin
+      port = server.gets[/:(\d+)$/, 1].to_i
+      writer = TCPSocket.new("127.0.0.1", port)
+      reader = TCPSocket.new("127.0.0.1", port)
+
+      requests = (1..500).map { |i| query_frame("insert ? ? ?", [i, "user#{i}", "person#{i}@example.com"]) }
+      requests << query_frame("select where id > 495")
+      requests << query_frame("insert ? a b")
+      writer.write(requests.join)
+      ids, errors = read_responses(writer, 502)
+      expect(ids).to eq((496..500).to_a)
+      expect(errors).to eq(["Error: Unbound parameter."])
+
+      # the reader's select runs on the last commit during the writer's transaction, its insert waits
+      writer.write(query_frame("begin") + query_frame("insert 501 a b"))
+      read_responses(writer, 2)
+      reader.write(query_frame("select where id > 499"))
+      expect(read_responses(reader, 1)).to eq([[500], []])
+      reader.write(query_frame("insert 502 c d"))
+      expect(IO.select([reader], nil, nil, 0.2)).to eq(nil)
+      writer.write(query_frame("rollback"))
+      read_responses(writer, 1)
+      expect(read_responses(reader, 1)).to eq([[], []])
+      reader.write(query_frame("select where id > 499"))
+      expect(read_responses(reader, 1)).to eq([[500, 502], []])
+
+      writer.close
+      reader.close
+    ensure
+      Process.kill("TERM", server.pid)
+      server.close
+    end
+
+    result = run_script(["select", ".exit"])
+    expect(result.grep(/\(\d+, /).size).to eq(501)
+  end
 end
@@ -0,0 +1,7814 @@
+// pthread_rwlockattr_setkind_np を使う
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#include "sqlitec.h"
+#include "protocol.h"
+
+// safely measure the size of a structure's attributes
+#define size_of_attrubutes(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+// layout of a searialized row
+// 文字列は長さ(varint)の後に実際の長さだけ書く
+/*
+ 	| column          | size   | offset |
+	-----------------------------------
+	| id	          |   4    |    0   |
+	-----------------------------------
+	| username length | varint |    4   |
+	-----------------------------------
+	| username        | 0-32   |        |
+	-----------------------------------
+	| email length    | varint |        |
+	-----------------------------------
+	| email	          | 0-255  |        |
+	-----------------------------------
+	| total	          | 6-294  |        |
+*/
+
+// uint32_t の varint は最大5バイト
+#define VARINT_MAX_SIZE 5
+
+static const uint32_t ID_SIZE = size_of_attrubutes(Row, id);
+static const uint32_t ID_OFFSET = 0;
+static const uint32_t ROW_MAX_SIZE = ID_SIZE + VARINT_MAX_SIZE + COLUMN_USERNAME_SIZE + VARINT_MAX_SIZE + COLUMN_EMAIL_SIZE;
+
+/* define the table layout */
+static const uint32_t PAGE_SIZE = 4096; // 4k bytes
+
+/* Buffer Pool Layout */
+// フレーム数は起動時に --cache-pages で変更できる
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME_NUM UINT32_MAX
+// CLOCKの使用回数の上限。何度も参照される内部ノードほど追い出されにくくなる
+#define FRAME_MAX_USAGE_COUNT 5
+
+/* Memory-Mapped Pager */
+// 起動時に --mmap を指定すると、バッファプールの代わりにファイルをmmapしてページを直接返す
+// 変更はプライベートなコピーに書かれ、コミット時にWALへ追記される
+// ファイルが伸びてもページのアドレスが変わらないように、最初に大きな仮想アドレス領域を確保しておく
+#define PAGER_MMAP_RESERVE_SIZE (1ULL << 36) // 64GB
+// ファイルはこのページ数単位でftruncateして伸ばし、閉じる時に実際のサイズへ戻す
+#define PAGER_MMAP_GROW_PAGES 256
+// 開いた時に先読みを依頼する上限
+#define PAGER_MMAP_WILLNEED_SIZE (64ULL << 20) // 64MB
+// 走査中に先読みする葉の数。葉を移るたびに倍にし、上限で止める
+#define PAGER_READAHEAD_MIN_WINDOW 4
+#define PAGER_READAHEAD_MAX_WINDOW 64
+
+/* Compressed Pager */
+// 新しいファイルを --compress lz で作ると、チェックポイントでページを圧縮してファイルに書き、
+// get_page で読む時に展開してバッファプールに置く。WALには圧縮せずに書く
+// ファイルは PAGE_MAP_GRANULE_SIZE バイトの区画に分け、圧縮したページは連続した区画に置く
+// ページ番号から置き場所を引く表(ページマップ)もファイルの中に置き、先頭の2区画のヘッダが交互にそれを指す
+// 書き換えたページと表は空いている区画に書き、新しいヘッダを書き終えるまで古い区画は使わない
+#define PAGE_MAP_GRANULE_SIZE 256
+#define PAGE_MAP_HEADER_GRANULES 2
+#define PAGE_MAP_MAGIC 0x50414d5a434c5153ULL // "SQLCZMAP"
+#define PAGE_MAP_VERSION 1
+// LZ4 のブロック形式。4バイト以上の一致を、直前の64KB以内から探す
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+// 一致はブロックの終わりから LZ_MATCH_LIMIT バイトより前で始め、LZ_LAST_LITERALS バイトより前で終える(LZ4 と同じ決まり)
+#define LZ_MATCH_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+/* Concurrency */
+// 読み手は何スレッドでも、書き手は1度に1スレッドだけ動ける
+// select はスナップショットを取り、その時点でコミットされていた内容だけを読む(MVCC)
+// 書き手はページを初めて変更する前に変更前の内容を版として残し、
+// 読み手はスナップショットより後に置き換えられたページを版から読む。読み手と書き手は互いを待たない
+// 版の一覧はページ番号の下位ビットで選んだラッチごとに持ち、ラッチで守る
+// 離れたページが同じラッチを共有することがある
+#define PAGER_NUM_LATCHES 4096
+// 版がまだコミットされていない
+#define VERSION_PENDING UINT64_MAX
+// トランザクションの中の select が使うスナップショット。コミット前の自分の変更も含めて今の内容を読む
+#define SNAPSHOT_UNCOMMITTED UINT64_MAX
+// 1つのラッチが1つのキャッシュラインを占めるようにする
+#define CACHE_LINE_SIZE 64
+
+/* Node Header Format */
+// NODE_INDEX_* は索引の木のノード
+typedef enum { NODE_INTERNAL, NODE_LEAF, NODE_INDEX_INTERNAL, NODE_INDEX_LEAF } NodeType;
+
+/* Page Checksum */
+// どのページも先頭4バイトに、残りのバイトの CRC32C を持つ(木のノードでは共通ヘッダの先頭)
+// ページをWALに書く時に付け、WALかファイルから読んだ時に確かめる
+// 全てゼロのページは、まだ一度も書かれていないページとして確かめない
+static const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);
+static const uint32_t PAGE_CHECKSUM_OFFSET = 0;
+
+/* Common Node Header Layout */
+static const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
+static const uint32_t NODE_TYPE_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+static const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
+static const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
+static const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+static const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+static const uint32_t COMMON_NODE_HEADER_SIZE = PAGE_CHECKSUM_SIZE + NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+
+/* Leaf Node Header Layout */
+static const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
+static const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+static const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+static const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+// セル領域の先頭。セルはページの末尾から前に向かって詰める
+static const uint32_t LEAF_NODE_CELL_CONTENT_SIZE = sizeof(uint16_t);
+static const uint32_t LEAF_NODE_CELL_CONTENT_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+// セル領域の中で使われていない(断片化した)バイト数
+static const uint32_t LEAF_NODE_FRAGMENTED_BYTES_SIZE = sizeof(uint16_t);
+static const uint32_t LEAF_NODE_FRAGMENTED_BYTES_OFFSET = LEAF_NODE_CELL_CONTENT_OFFSET + LEAF_NODE_CELL_CONTENT_SIZE;
+static const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE +
+                                       LEAF_NODE_CELL_CONTENT_SIZE + LEAF_NODE_FRAGMENTED_BYTES_SIZE;
+
+/* Leaf Node Body Layout */
+// ヘッダーの直後にキー順のセルポインタ(ページ内のオフセット)の配列が続き、
+// セル本体はページの末尾側に置く。セルはシリアライズした行そのもので、先頭のidがキーになる
+/*
+	| header | cell pointers -> |   free   | <- cells |
+*/
+static const uint32_t LEAF_NODE_CELL_POINTER_SIZE = sizeof(uint16_t);
+static const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+static const uint32_t LEAF_NODE_KEY_OFFSET = 0;
+// キーを揃えて読めるように、セルの大きさは4バイト単位に切り上げる
+static const uint32_t LEAF_NODE_CELL_ALIGNMENT = 4;
+static const uint32_t LEAF_NODE_MAX_CELL_SIZE = (ROW_MAX_SIZE + LEAF_NODE_CELL_ALIGNMENT - 1) & ~(LEAF_NODE_CELL_ALIGNMENT - 1);
+static const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+
+/* Internal Node Header Layout */
+static const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+static const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+static const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+static const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+static const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                           INTERNAL_NODE_NUM_KEYS_SIZE +
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+
+/* Internal Node Body Layout */
+// 通常は (子, キー) のセルを並べる。
+// INTERNAL_NODE_SEPARATE_KEYS を定義してビルドすると、キーの配列と子の配列を分けて格納し、
+// キー探索で一度に8個のキーを比較できるようにする(ファイル形式は互換性がない)。
+static const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
+static const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+static const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+static const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+static const uint32_t INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+#ifdef INTERNAL_NODE_SEPARATE_KEYS
+// キー配列上で隣り合うキーの間隔(uint32_t単位)
+#define INTERNAL_NODE_KEY_STRIDE 1
+static const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
+static const uint32_t INTERNAL_NODE_CHILDREN_OFFSET =
+    INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
+#else
+#define INTERNAL_NODE_KEY_STRIDE 2
+#endif
+
+/* Index Node Layout */
+// 索引は列の値から id を引く B+木で、行の木と同じファイルに置き、根のページ番号をヘッダに持つ
+// キーは (値, 0, id のビッグエンディアン4バイト) のバイト列で、memcmp の順が (値, id) の順になる
+// (値に 0 は入らないので、短い値が先に来る)
+// ノードのヘッダとセルの置き方は葉と同じ(セルポインタの配列と、セル領域の末尾から詰めるセル)
+// ノードの全てのキーに共通する先頭(プレフィックス)はページの末尾に1つだけ置き、セルには残りだけを置く
+/*
+	| header | cell pointers -> |   free   | <- cells | prefix | prefix length (u16) |
+*/
+// 葉のセルは (残りの長さ(varint), 残り)。内部ノードのセルはその後ろに子のページ番号を持つ
+// 内部ノードの i 番目のキーより小さいキーは i 番目の子に、最後のキー以上のキーは右端の子にある
+// 右端の子は葉の兄弟ポインタの位置に置く
+// 葉を分割して親に上げるキーは、左の最大のキーより大きく右の最小のキー以下の最も短いバイト列にする
+// 索引の葉は削除で空になっても併合しない。空いた分は次の .vacuum で作り直す時に詰まる
+typedef enum { INDEX_USERNAME, INDEX_EMAIL } IndexColumn;
+#define INDEX_NUM_COLUMNS 2
+#define INDEX_ID_SIZE 4
+// 値の後ろの 0 と id
+#define INDEX_KEY_SUFFIX_SIZE (1 + INDEX_ID_SIZE)
+#define INDEX_MAX_KEY_SIZE (COLUMN_EMAIL_SIZE + INDEX_KEY_SUFFIX_SIZE)
+static const uint32_t INDEX_CHILD_SIZE = sizeof(uint32_t);
+static const uint32_t INDEX_MAX_CELL_SIZE =
+    (VARINT_MAX_SIZE + INDEX_MAX_KEY_SIZE + INDEX_CHILD_SIZE + LEAF_NODE_CELL_ALIGNMENT - 1) &
+    ~(LEAF_NODE_CELL_ALIGNMENT - 1);
+static const uint32_t INDEX_NODE_PREFIX_LENGTH_SIZE = sizeof(uint16_t);
+static const uint32_t INDEX_NODE_PREFIX_LENGTH_OFFSET = PAGE_SIZE - sizeof(uint16_t);
+
+/* Node Underflow */
+// 削除の後、使用量がこれを下回ったノードは兄弟と併合するか、兄弟とセルを分け直す
+static const uint32_t LEAF_NODE_MIN_USED_SPACE = LEAF_NODE_SPACE_FOR_CELLS / 2;
+static const uint32_t INTERNAL_NODE_MIN_KEYS = INTERNAL_NODE_MAX_CELLS / 2;
+
+/* Database Header Layout */
+// ページ0はファイル全体のヘッダ。木のルートはページ1から始まる
+#define DB_HEADER_PAGE_NUM 0
+#define DB_HEADER_MAGIC 0x43515344 // "DSQC"
+#define DB_HEADER_VERSION 5
+static const uint32_t DB_HEADER_MAGIC_SIZE = sizeof(uint32_t);
+static const uint32_t DB_HEADER_MAGIC_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+static const uint32_t DB_HEADER_VERSION_SIZE = sizeof(uint32_t);
+static const uint32_t DB_HEADER_VERSION_OFFSET = DB_HEADER_MAGIC_OFFSET + DB_HEADER_MAGIC_SIZE;
+static const uint32_t DB_HEADER_ROOT_PAGE_SIZE = sizeof(uint32_t);
+static const uint32_t DB_HEADER_ROOT_PAGE_OFFSET = DB_HEADER_VERSION_OFFSET + DB_HEADER_VERSION_SIZE;
+// 最初のトランクページ(0なら空)と、トランクページも含めた空きページの数
+static const uint32_t DB_HEADER_FREELIST_HEAD_SIZE = sizeof(uint32_t);
+static const uint32_t DB_HEADER_FREELIST_HEAD_OFFSET = DB_HEADER_ROOT_PAGE_OFFSET + DB_HEADER_ROOT_PAGE_SIZE;
+static const uint32_t DB_HEADER_FREELIST_COUNT_SIZE = sizeof(uint32_t);
+static const uint32_t DB_HEADER_FREELIST_COUNT_OFFSET = DB_HEADER_FREELIST_HEAD_OFFSET + DB_HEADER_FREELIST_HEAD_SIZE;
+// データベースのページ数。ファイルがこれより長ければ、後ろは使われていない
+static const uint32_t DB_HEADER_PAGE_COUNT_SIZE = sizeof(uint32_t);
+static const uint32_t DB_HEADER_PAGE_COUNT_OFFSET = DB_HEADER_FREELIST_COUNT_OFFSET + DB_HEADER_FREELIST_COUNT_SIZE;
+// 列ごとの索引の根のページ。0なら索引はない
+static const uint32_t DB_HEADER_INDEX_ROOTS_SIZE = INDEX_NUM_COLUMNS * sizeof(uint32_t);
+static const uint32_t DB_HEADER_INDEX_ROOTS_OFFSET = DB_HEADER_PAGE_COUNT_OFFSET + DB_HEADER_PAGE_COUNT_SIZE;
+
+/* Freelist Trunk Page Layout */
+// 空きページのリストはトランクページの連結リスト
+// トランクページは次のトランクページの番号と、空いている葉ページの番号の配列を持つ
+// 空いている葉ページには何も書かないので、ページを解放してもそのページは変更されない
+static const uint32_t FREELIST_TRUNK_NEXT_SIZE = sizeof(uint32_t);
+static const uint32_t FREELIST_TRUNK_NEXT_OFFSET = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+static const uint32_t FREELIST_TRUNK_NUM_LEAVES_SIZE = sizeof(uint32_t);
+static const uint32_t FREELIST_TRUNK_NUM_LEAVES_OFFSET = FREELIST_TRUNK_NEXT_OFFSET + FREELIST_TRUNK_NEXT_SIZE;
+static const uint32_t FREELIST_TRUNK_HEADER_SIZE =
+    PAGE_CHECKSUM_SIZE + FREELIST_TRUNK_NEXT_SIZE + FREELIST_TRUNK_NUM_LEAVES_SIZE;
+static const uint32_t FREELIST_TRUNK_MAX_LEAVES = (PAGE_SIZE - FREELIST_TRUNK_HEADER_SIZE) / sizeof(uint32_t);
+
+/* Internal Node Key Search */
+// 残りのキー数がこの数以下になったら、二分探索をやめてまとめて比較する
+#define KEY_SEARCH_LINEAR_THRESHOLD 16
+
+// バッファプールの1フレーム分のメタデータ
+typedef struct {
+	uint32_t page_num;
+	// ピンされている間は追い出されない
+	uint32_t pin_count;
+	uint32_t usage_count;
+	// 変更されたフレームだけを追い出し時に書き戻す
+	bool dirty;
+	// ページテーブルの同じバケット内の次のフレーム
+	uint32_t next_in_bucket;
+	// ファイルから読み込んでいる間は立てておき、同じページを取りに来たスレッドを待たせる
+	bool loading;
+} Frame;
+
+// 書き手が置き換えたページの、変更前の内容
+typedef struct PageVersion {
+	uint32_t page_num;
+	// この版を置き換えたトランザクションのコミット番号。これより前のスナップショットが読む
+	// コミットするまでは VERSION_PENDING
+	uint64_t end_seq;
+	// 同じラッチの版を新しい順につなぐ
+	struct PageVersion* next;
+	// 今のトランザクションで作った版、または解放を待っている版の一覧での次
+	struct PageVersion* next_in_list;
+	uint8_t data[];
+} PageVersion;
+
+typedef struct {
+	pthread_rwlock_t lock;
+	PageVersion* versions;
+} __attribute__((aligned(CACHE_LINE_SIZE))) PageLatch;
+
+// 読み手が見ている時点。seq までのコミットが見える
+typedef struct Snapshot {
+	uint64_t seq;
+	struct Snapshot* prev;
+	struct Snapshot* next;
+} Snapshot;
+
+/* Write-Ahead Log Layout */
+// 変更されたページはコミット時に <db>-wal に追記され、チェックポイントでデータベースファイルへ戻る
+#define WAL_FILENAME_SUFFIX "-wal"
+#define WAL_MAGIC 0x314c4157 // "WAL1"
+#define WAL_VERSION 1
+#define WAL_INDEX_INITIAL_CAPACITY 64
+// WALのページレコードがこの数を超えたら、コミットの後にチェックポイントする
+#define WAL_AUTOCHECKPOINT_PAGES 1000
+
+typedef enum { WAL_RECORD_PAGE = 1, WAL_RECORD_COMMIT = 2 } WalRecordType;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t salt;
+	uint32_t checksum[2];
+} WalHeader;
+
+// ページレコードはこのヘッダの後ろにページ本体が続く。コミットレコードはヘッダのみ
+typedef struct {
+	uint32_t type;
+	uint32_t page_num;
+	// コミット時点のページ数
+	uint32_t num_pages;
+	// WALをリセットするたびに変わる。古いレコードの読み違いを防ぐ
+	uint32_t salt;
+	// 先頭からこのレコードまでの累積チェックサム
+	uint32_t checksum[2];
+} WalRecordHeader;
+
+// page_num -> WAL上の最新のページ本体の位置
+typedef struct {
+	uint32_t page_num;
+	off_t offset;
+	// 最後にコミットされた内容の位置
+	off_t committed_offset;
+} WalIndexEntry;
+
+typedef struct {
+	WalIndexEntry* entries;
+	uint32_t capacity;
+	uint32_t count;
+} WalIndex;
+
+typedef struct {
+	char* filename;
+	int file_descriptor;
+	uint32_t salt;
+	uint32_t checksum[2];
+	off_t write_offset;
+	off_t commit_offset;
+	// commit_offset までのレコードの累積チェックサム。ロールバックでここまで戻す
+	uint32_t commit_checksum[2];
+	uint32_t num_page_records;
+	WalIndex index;
+	// グループコミット用。位置はWALをリセットしても戻らない通し番号で数え、
+	// reset_position が今のWALの先頭、synced_position までのレコードは永続化済み
+	pthread_mutex_t mutex;
+	pthread_cond_t synced;
+	uint64_t reset_position;
+	uint64_t synced_position;
+	bool sync_in_progress;
+	// 追記したコミットレコードと、それを永続化した fdatasync の数(.stats)。mutex で守る
+	uint64_t commits;
+	uint64_t syncs;
+	// 書いたページの累計(WALへの追記とチェックポイントでの書き戻し)。mutex で守る
+	uint64_t pages_written;
+	// チェックサムを付けて書くためのページのコピー。mutex で守る
+	void* page_buffer;
+} Wal;
+
+// ページマップのヘッダ。区画0と区画1に交互に書く
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t codec;
+	uint32_t num_pages;
+	// 書くたびに1つ増やす。開く時はチェックサムが正しい方のうち大きい方を使う
+	uint64_t sequence;
+	// ページマップを置いた区画とバイト数、その CRC32C
+	uint32_t map_granule;
+	uint32_t map_size;
+	uint32_t map_checksum;
+	uint32_t checksum;
+} PageMapHeader;
+
+// ページの置き場所。size が0なら書かれていない(ゼロのページ)。PAGE_SIZE なら圧縮せずに置いている
+typedef struct {
+	uint32_t granule;
+	uint32_t size;
+} PageExtent;
+
+// 圧縮したデータベースファイルのページの置き場所
+// 書き換えるのはチェックポイント(io_lock を排他で持つ)と、開く時と閉じる時だけ
+typedef struct {
+	int file_descriptor;
+	PageCodec codec;
+	uint64_t sequence;
+	// ページ番号 -> 置き場所。ファイルにはこの配列をそのまま書く
+	PageExtent* extents;
+	uint32_t num_pages;
+	uint32_t extents_capacity;
+	// 今のヘッダが指しているページマップ
+	PageExtent map_extent;
+	// 使っている区画のビットマップ。num_granules より後ろはファイルの外
+	uint8_t* used;
+	uint32_t used_capacity;
+	uint32_t num_granules;
+	// これより前の区画は全て使っている
+	uint32_t first_free;
+	// 置き換えたが、次のヘッダを書くまでは古いヘッダから指されている置き場所
+	PageExtent* released;
+	uint32_t num_released;
+	uint32_t released_capacity;
+	// 圧縮したページ
+	uint8_t* buffer;
+} PageMap;
+
+typedef struct {
+	int file_descriptor;
+	// 圧縮モードでは論理的なページ数 * PAGE_SIZE
+	off_t file_length;
+	uint32_t num_pages;
+	// 最後のコミット時点のページ数。ロールバックでここまで切り詰める
+	uint32_t committed_num_pages;
+	// mmapモードではマップした領域の先頭。バッファプールは使わない
+	bool use_mmap;
+	void* map;
+	size_t map_size;
+	// mmapモードで変更されたページのビットマップ
+	uint8_t* map_dirty;
+	size_t map_dirty_size;
+	// 圧縮モードでだけ使う。それ以外は NULL
+	PageMap* page_map;
+	Wal* wal;
+	// 現在のトランザクションで変更されたページ
+	uint32_t* dirty_pages;
+	uint32_t num_dirty_pages;
+	uint32_t dirty_pages_capacity;
+	uint32_t num_frames;
+	// num_frames * PAGE_SIZE の連続領域
+	void* frame_data;
+	Frame* frames;
+	uint32_t clock_hand;
+	// page_num -> frame のハッシュテーブル(チェイン法)
+	uint32_t* buckets;
+	uint32_t num_buckets;
+	// ページテーブルとフレームのメタデータを守る。ページの読み込み中は放す
+	pthread_mutex_t mutex;
+	pthread_cond_t loaded;
+	// チェックポイントは排他で、WALかファイルからページを読み込む間は共有で持つ
+	pthread_rwlock_t io_lock;
+	PageLatch* latches;
+	// 永続化を終えて、新しいスナップショットに見せている最後のトランザクションの番号
+	// snapshot_mutex で守る。書き手は同期を待つ間にロックを放すので、コミットの順にはならない
+	uint64_t commit_seq;
+	// 版に付けた最後のトランザクションの番号。書き手だけが触る
+	uint64_t assigned_seq;
+	// 動いているスナップショット。古いものが先頭。snapshot_mutex で守る
+	Snapshot* snapshots_head;
+	Snapshot* snapshots_tail;
+	pthread_mutex_t snapshot_mutex;
+	// 今のトランザクションで作った版と、コミット済みで解放を待っている版(コミット順)
+	// どちらも書き手だけが触る
+	PageVersion* pending_versions;
+	PageVersion* committed_versions_head;
+	PageVersion* committed_versions_tail;
+	// 読み手がいないことが分かっているので、版を作らずに書き換える(.load, .vacuum など)
+	bool exclusive;
+	// .stats の統計。pages_written, commits, wal_syncs 以外はここで数える
+	// どのスレッドからも relaxed のアトミック加算で足すだけなので、ロックは取らない
+	DbStats stats;
+} Pager;
+
+// WALに追記したが、永続化を待っているコミット
+typedef struct {
+	// wal_sync に渡す位置。0なら書いたページがない
+	uint64_t wal_position;
+	uint64_t seq;
+} PagerCommit;
+
+// 文のキャッシュ(SQLの文字列 -> 解析済みの文)。最近使われていないものから捨てる
+#define STATEMENT_CACHE_SIZE 64
+#define STATEMENT_CACHE_BUCKETS 128
+
+typedef struct {
+	Statement* buckets[STATEMENT_CACHE_BUCKETS];
+	// 先頭が最近使われたもの
+	Statement* lru_head;
+	Statement* lru_tail;
+	uint32_t count;
+} StatementCache;
+
+struct Table {
+	// 全体の行数を保持
+	uint32_t num_rows;
+	Pager* pager;
+	uint32_t root_page_num;
+	// 最後に見た右端の葉。昇順の挿入では根からたどらずにここへ追記する
+	// 根までの経路は親ポインタでたどれるので、葉だけを覚えておけばよい
+	uint32_t rightmost_leaf_page_num;
+	// 文のキャッシュとそこから返る文は、1つのスレッドで使う
+	// 他のスレッドは prepare_statement で自分の文を作る
+	StatementCache statement_cache;
+	// select はスナップショットを持っている間、共有で持つ
+	// 版を作らずに木全体を書き換える操作(.load, .vacuum など)は排他で持ち、読み手がいない時に行う
+	// 書き手を優先するので、1つのスレッドで2つの select を同時に進めないこと
+	pthread_rwlock_t tree_latch;
+	// 書き手を1つにする。rightmost_leaf_page_num と in_transaction もこれで守る
+	// begin したスレッドは commit か rollback まで持ち続け、その間の文でも取るので再帰的に取れる
+	pthread_mutex_t write_mutex;
+	// begin から commit か rollback までの間。文ごとにはコミットしない
+	bool in_transaction;
+	// begin した文の session。同じ session の select だけがコミットしていない変更を読む
+	const void* transaction_session;
+};
+
+// テーブル内の場所を表すオブジェクト
+struct Cursor {
+	Table* table;
+	uint32_t page_num;
+	uint32_t cell_num;
+	// 書き手のカーソルではピンしている葉
+	// 読み手のカーソルではスナップショットから読んだ葉のコピーで、ピンもラッチも持たない
+	void* node;
+	Snapshot* snapshot;
+	// table_scan で開いたカーソルは、スナップショットと木のラッチを自分で持つ
+	bool owns_snapshot;
+	// 次に行を挿入したい場所。最後の要素の1つ後ろの位置を示す
+	bool end_of_table;
+	// 先読みを出した親ノードと、その中で先読みを出し終えた子の位置
+	// prefetch_node は読み手のカーソルが持つ親のコピー
+	void* prefetch_node;
+	uint32_t prefetch_parent;
+	uint32_t prefetch_end;
+	uint32_t prefetch_window;
+	// 前の先読みで、次に来ると予想した葉
+	uint32_t prefetch_expected;
+};
+
+typedef enum {
+	STATEMENT_INSERT,
+	STATEMENT_SELECT,
+	STATEMENT_UPDATE,
+	STATEMENT_DELETE,
+	STATEMENT_BEGIN,
+	STATEMENT_COMMIT,
+	STATEMENT_ROLLBACK,
+	STATEMENT_CREATE_INDEX
+} StatementType;
+
+// パラメータ(?)が値を与える先
+typedef enum {
+	STATEMENT_FIELD_ID,
+	STATEMENT_FIELD_USERNAME,
+	STATEMENT_FIELD_EMAIL,
+	// select の where id = ? (下限と上限の両方)
+	STATEMENT_FIELD_KEY,
+	STATEMENT_FIELD_LOW,
+	STATEMENT_FIELD_HIGH,
+	STATEMENT_FIELD_LIMIT,
+	// select の where username か where email の値
+	STATEMENT_FIELD_VALUE
+} StatementField;
+
+// 索引のキー、またはその先頭の部分
+typedef struct {
+	const uint8_t* data;
+	uint32_t length;
+} IndexKey;
+
+// 書き直すノードに置くキーと、内部ノードではその子
+typedef struct {
+	IndexKey key;
+	uint32_t child_page_num;
+} IndexEntry;
+
+#define STATEMENT_MAX_PARAMS 8
+
+// 外部ソートで1度にメモリ上で並べ替える行数
+#define LOAD_SORT_BUFFER_ROWS (1 << 16)
+// 一括読み込みで組み上げる木の高さの上限(葉を除く)
+#define LOAD_MAX_LEVELS 16
+
+// 外部ソートの実行(ソート済みの一時ファイル)と、その先頭の行
+typedef struct {
+	FILE* file;
+	Row row;
+} LoadRun;
+
+// 一括読み込みの入力。キー順に行を返す
+typedef struct {
+	// 入力が既にキー順なら、ファイルから直接読む
+	FILE* input;
+	char* line;
+	size_t line_capacity;
+	// 全体がメモリに収まった場合のソート済みの行
+	Row* buffer;
+	uint32_t buffer_count;
+	uint32_t buffer_pos;
+	// 収まらなかった場合は、実行の先頭の行のヒープでマージする
+	LoadRun* runs;
+	uint32_t num_runs;
+	uint32_t* heap;
+	uint32_t heap_size;
+	uint32_t rows_returned;
+	uint32_t last_id;
+} LoadSource;
+
+// 作成中のノード。各レベルに1つだけ持つ
+typedef struct {
+	uint32_t page_num;
+	uint32_t count;
+	uint32_t max_key;
+	uint32_t num_nodes;
+} LoadLevel;
+
+// 受け取った要求を溜める大きさ。要求フレームの上限より大きくしておく
+#define SERVER_INPUT_BUFFER_SIZE (256 * 1024)
+// 送れていない応答がこれを超えたら、送り終えるまで次の行や要求を処理しない
+#define SERVER_OUTPUT_HIGH_WATER (256 * 1024)
+// select の行をこの大きさごとに RESPONSE_ROWS にして送る
+#define SERVER_ROWS_FRAME_SIZE (64 * 1024)
+#define SERVER_MAX_EVENTS 64
+
+// サーバの1つの接続
+typedef struct Connection {
+	int socket;
+	// 受け取ってまだ処理していない要求は input[0, input_used)
+	uint8_t* input;
+	uint32_t input_used;
+	// まだ送っていない応答は output[output_sent, output_used)
+	uint8_t* output;
+	uint32_t output_sent;
+	uint32_t output_used;
+	uint32_t output_capacity;
+	// 実行中の文。select は応答が溜まったら止め、送れてから続きの行を返す
+	Statement* statement;
+	// 接続ごとの文のキャッシュ。実行中の select を他の接続の要求が reset しないように分ける
+	StatementCache statement_cache;
+	// SQL を終端付きで置く場所
+	char* sql;
+	// 相手が書き込みを閉じた。残りの要求に答えてから切る
+	bool input_closed;
+	// epoll に登録しているイベント
+	uint32_t events;
+	struct Connection* prev;
+	struct Connection* next;
+} Connection;
+
+// 1つのスレッドで、epoll で全ての接続を順に処理する
+typedef struct {
+	Table* table;
+	int listen_socket;
+	int epoll;
+	Connection* connections;
+	// begin した接続。書き込みの mutex はサーバのスレッドが持ったままなので、
+	// 他の接続の書き込む文は commit か rollback まで処理せずに待たせる
+	Connection* transaction_owner;
+	// 0 でなければ、接続ごとのカーネルの送信バッファ(SO_SNDBUF)の大きさ
+	int send_buffer_size;
+} Server;
+
+/* Integrity Check */
+#define CHECK_MAX_THREADS 16
+// 木の上の方を展開して、スレッドあたりこの数くらいの部分木に分けてから配る
+#define CHECK_ITEMS_PER_THREAD 8
+#define CHECK_MAX_REPORTED_ERRORS 20
+// チェックサムを確かめる時に1回の pread で読むページ数
+#define CHECK_READ_PAGES 64
+
+// 調べるノードと、そのキーが入っていなければならない範囲 (low, high]
+typedef struct {
+	uint32_t page_num;
+	uint32_t parent_page_num;
+	// 根を1と数えた深さ
+	uint32_t depth;
+	bool has_low;
+	uint32_t low;
+	bool has_high;
+	uint32_t high;
+} CheckNode;
+
+// 1つのスレッドが調べる部分木
+// 部分木の中の葉の連鎖はスレッドが確かめ、部分木どうしのつながりは最後にまとめて確かめる
+typedef struct {
+	CheckNode node;
+	uint32_t first_leaf;
+	uint32_t last_leaf;
+	uint32_t last_next_leaf;
+	uint64_t num_rows;
+} CheckItem;
+
+typedef struct {
+	Table* table;
+	Snapshot snapshot;
+	// スナップショットの時点のページ数と、木か空きページのリストで見つけたページのビット
+	uint32_t num_pages;
+	uint8_t* seen;
+	CheckItem* items;
+	uint32_t num_items;
+	uint32_t next_item;
+	// 最初に見つけた葉の深さ。全ての葉が同じ深さでなければならない
+	uint32_t leaf_depth;
+	// チェックサムを確かめるファイル上のページ数と、次に読む位置
+	uint32_t file_pages;
+	uint32_t next_file_page;
+	uint64_t num_rows;
+	pthread_mutex_t mutex;
+	uint32_t num_errors;
+} Check;
+
+// 1つの索引をキーの順にたどる間の状態
+typedef struct {
+	IndexColumn column;
+	uint32_t leaf_depth;
+	uint32_t last_leaf;
+	uint32_t last_next_leaf;
+	uint64_t num_entries;
+	// 直前のエントリ
+	bool has_last;
+	IndexKey last;
+	uint8_t last_data[INDEX_MAX_KEY_SIZE];
+} CheckIndex;
+
+// 解析済みの文。一度だけ解析し、? に値を bind して何度でも statement_step で実行する
+struct Statement {
+	StatementType type;
+	Table* table;
+	// SQLに書かれた値と bind された値を持ったRowを格納
+	// update は同じidの行をこの行で置き換え、delete はidだけを使う
+	Row row_to_insert;
+	// i番目の ? が値を与える先(1から数える)
+	StatementField params[STATEMENT_MAX_PARAMS];
+	uint32_t num_params;
+	// bind 済みのパラメータのビット
+	uint32_t bound_params;
+	// select の where id の範囲と limit
+	bool has_low;
+	bool low_exclusive;
+	uint32_t low;
+	bool has_high;
+	bool high_exclusive;
+	uint32_t high;
+	uint32_t limit;
+	// select の where username か where email の値。create index では value_column だけを使う
+	// like で値の末尾が % なら、それを外した値で前方一致させる
+	bool has_value;
+	IndexColumn value_column;
+	bool value_like;
+	bool value_prefix;
+	char value[COLUMN_EMAIL_SIZE + 1];
+	uint32_t value_length;
+	// 索引を読んでいる select の、索引の葉のコピーと位置
+	void* index_node;
+	uint32_t index_cell;
+	// select の実行中の位置と、最後に返した行
+	// 行はカーソルが指しているので、statement_row が呼ばれた時だけコピーする
+	Cursor* cursor;
+	Snapshot snapshot;
+	bool started;
+	// 実行中の走査の上限(両端を含む)と、返した行数
+	uint32_t scan_high;
+	uint32_t rows_returned;
+	Row row;
+	// 実行中の select の最初の statement_step の時刻(.stats)
+	uint64_t start_ns;
+	// 文を実行する相手(サーバーでは接続)。ライブラリから使う時は NULL
+	// スレッドではなくこれでトランザクションの持ち主を見分ける
+	const void* session;
+	// 文のキャッシュで使う
+	char* sql;
+	uint32_t hash;
+	Statement* lru_prev;
+	Statement* lru_next;
+	Statement* next_in_bucket;
+};
+
+static PrepareResult prepare_insert(char* sql, Statement* statement);
+static PrepareResult prepare_select(char* sql, Statement* statement);
+static PrepareResult prepare_select_value(Statement* statement, char* token, StatementField field,
+                                          uint32_t* value);
+static PrepareResult prepare_delete(char* sql, Statement* statement);
+static PrepareResult parse_row(char* id_string, char* username, char* email, Row* row);
+static PrepareResult parse_number(const char* token, uint32_t* value);
+static PrepareResult statement_cache_prepare(StatementCache* cache, Table* table, const char* sql,
+                                             Statement** statement);
+static void statement_cache_clear(StatementCache* cache);
+static void row_view_from_cell(const void* cell, RowView* view);
+static ExecuteResult execute_insert(Statement* statement, Table* table);
+static ExecuteResult execute_select(Statement* statement, Table* table);
+static ExecuteResult execute_update(Statement* statement, Table* table);
+static ExecuteResult execute_delete(Statement* statement, Table* table);
+static ExecuteResult execute_begin(Table* table, const void* session);
+static ExecuteResult execute_commit(Table* table);
+static ExecuteResult execute_rollback(Table* table);
+static bool table_owns_transaction(Table* table, const void* session);
+static uint32_t serialize_row(Row* source, void* destination);
+static void deserialize_row(void* source, Row* destination);
+static uint32_t row_serialized_size(void* source);
+static uint32_t varint_encode(uint32_t value, uint8_t* destination);
+static uint32_t varint_decode(const uint8_t* source, uint32_t* value);
+static void* cursor_value(Cursor* cursor);
+static Pager* pager_open(const char* filename, PagerOptions* options);
+static void pager_map_file(Pager* pager);
+static void* pager_map_page(Pager* pager, uint32_t page_num);
+static void* get_page(Pager* pager, uint32_t page_num);
+static void unpin_page(Pager* pager, uint32_t page_num);
+static void mark_page_dirty(Pager* pager, uint32_t page_num);
+static void pager_flush(Pager* pager, uint32_t page_num);
+static void pager_commit(Pager* pager);
+static void pager_commit_append(Pager* pager, PagerCommit* commit);
+static void pager_commit_finish(Pager* pager, PagerCommit* commit);
+static void pager_rollback(Pager* pager);
+static void table_commit(Table* table, PagerCommit* commit);
+static ExecuteResult table_execute_write(Statement* statement,
+                                         ExecuteResult (*execute)(Statement* statement, Table* table));
+static bool table_lock_exclusive(Table* table);
+static void table_unlock_exclusive(Table* table);
+static bool wal_needs_checkpoint(Wal* wal);
+static void pager_save_version(Pager* pager, uint32_t page_num, const void* page);
+static uint64_t pager_commit_versions(Pager* pager);
+static void pager_free_version(Pager* pager, PageVersion* version);
+static void snapshot_acquire(Pager* pager, Snapshot* snapshot);
+static void snapshot_release(Pager* pager, Snapshot* snapshot);
+static void snapshot_read_page(Pager* pager, Snapshot* snapshot, uint32_t page_num, void* destination);
+static Cursor* snapshot_find(Table* table, Snapshot* snapshot, uint32_t key);
+static void pager_checkpoint(Pager* pager);
+static void pager_add_dirty_page(Pager* pager, uint32_t page_num);
+static Wal* wal_open(const char* db_filename, int db_file_descriptor, PageMap* page_map);
+static void wal_close(Wal* wal, int db_file_descriptor, PageMap* page_map);
+static void wal_recover(Wal* wal);
+static void wal_reset(Wal* wal);
+static off_t wal_lookup(Wal* wal, uint32_t page_num);
+static void wal_append_page(Wal* wal, uint32_t page_num, const void* page);
+static uint64_t wal_append_commit(Wal* wal, uint32_t num_pages, uint32_t* page_nums, uint32_t num_page_nums);
+static void wal_sync(Wal* wal, uint64_t position);
+static void wal_rollback(Wal* wal);
+static void wal_checkpoint(Wal* wal, int db_file_descriptor, PageMap* page_map);
+static PageMap* page_map_open(int file_descriptor, PageCodec codec);
+static void page_map_close(PageMap* map);
+static void page_map_compact(PageMap* map);
+static int compare_uint64_descending(const void* a, const void* b);
+static bool page_map_read(PageMap* map, uint32_t page_num, void* page);
+static void page_map_write(PageMap* map, uint32_t page_num, const void* page);
+static void page_map_truncate(PageMap* map, uint32_t num_pages);
+static void page_map_sync(PageMap* map);
+static bool page_map_granule_used(PageMap* map, uint32_t granule);
+static void page_map_mark(PageMap* map, PageExtent extent, bool used);
+static PageExtent page_map_allocate(PageMap* map, uint32_t size);
+static void page_map_release(PageMap* map, PageExtent extent);
+static uint32_t page_map_checksum(const void* data, size_t size);
+static uint32_t lz_hash(const uint8_t* p);
+static uint8_t* lz_write_length(uint8_t* p, uint32_t length);
+static bool lz_read_length(const uint8_t** p, const uint8_t* end, uint32_t* length);
+static uint32_t lz_compress(const uint8_t* source, uint32_t source_size, uint8_t* destination,
+                            uint32_t capacity);
+static bool lz_decompress(const uint8_t* source, uint32_t source_size, uint8_t* destination,
+                          uint32_t destination_size);
+static uint32_t page_bucket(Pager* pager, uint32_t page_num);
+static uint32_t page_checksum(const void* page);
+static void page_stamp_checksum(void* page);
+static bool page_checksum_valid(const void* page);
+static void stats_add(uint64_t* counter, uint64_t value);
+static uint64_t stats_now_ns(void);
+static void stats_record_latency(DbLatency* latency, uint64_t ns);
+static void stats_record_find(Pager* pager, uint32_t depth, uint32_t nodes_visited);
+static void stats_record_flush(Pager* pager);
+static void check_error(Check* check, const char* format, ...);
+static bool check_mark(Check* check, uint32_t page_num, uint32_t from_page_num);
+static void check_read_node(Check* check, uint32_t page_num, void* node);
+static bool check_node_header(Check* check, const CheckNode* position, void* node);
+static bool check_key_in_range(const CheckNode* position, uint32_t key);
+static void check_leaf(Check* check, const CheckNode* position, void* node, CheckItem* item);
+static uint32_t check_internal(Check* check, const CheckNode* position, void* node, CheckNode* children);
+static void check_visit(Check* check, const CheckNode* position, CheckItem* item);
+static void* check_pages_worker(void* argument);
+static void* check_tree_worker(void* argument);
+static void check_run(Check* check, uint32_t num_threads, void* (*worker)(void*));
+static void check_tree(Check* check, uint32_t root_page_num, uint32_t num_threads);
+static void check_freelist(Check* check);
+static void check_indexes(Check* check);
+static void check_index_visit(Check* check, CheckIndex* index, const CheckNode* position, const IndexKey* low,
+                              const IndexKey* high);
+static void check_index_entry(Check* check, CheckIndex* index, uint32_t page_num, const IndexKey* key);
+static uint32_t pager_lookup_frame(Pager* pager, uint32_t page_num);
+static void pager_remove_from_bucket(Pager* pager, uint32_t frame_num);
+static uint32_t pager_find_victim(Pager* pager);
+static void pager_write_frame(Pager* pager, uint32_t frame_num);
+static void* frame_page(Pager* pager, uint32_t frame_num);
+static Cursor* table_start(Table* table, Snapshot* snapshot);
+static void cursor_prefetch(Cursor* cursor, void* leaf);
+static void pager_prefetch(Pager* pager, const uint32_t* page_nums, uint32_t num_page_nums);
+static uint32_t* leaf_node_num_cells(void* node);
+static void* leaf_node_cell(void* node, uint32_t cell_num);
+static uint32_t* leaf_node_key(void* node, uint32_t cell_num);
+static void* leaf_node_value(void* node, uint32_t cell_num);
+static uint16_t* leaf_node_cell_pointer(void* node, uint32_t cell_num);
+static uint16_t* leaf_node_cell_content(void* node);
+static uint16_t* leaf_node_fragmented_bytes(void* node);
+static uint32_t leaf_node_cell_size(void* node, uint32_t cell_num);
+static uint32_t leaf_node_free_space(void* node);
+static void leaf_node_defragment(void* node);
+static void leaf_node_put_cell(void* node, uint32_t cell_num, const void* cell, uint32_t cell_size);
+static void leaf_node_remove_cell(void* node, uint32_t cell_num);
+static bool leaf_node_fits(void* node, uint32_t cell_size);
+static uint32_t leaf_node_used_space(void* node);
+static uint32_t leaf_cell_from_row(Row* row, void* cell);
+static void initialize_leaf_node(void* node);
+static void initialize_internal_node(void* node);
+static void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
+static Cursor* table_find(Table* table, uint32_t key);
+static Cursor* table_seek(Table* table, Snapshot* snapshot, uint32_t key);
+static Cursor* table_find_append(Table* table, uint32_t key);
+static bool internal_node_is_rightmost(Pager* pager, uint32_t page_num);
+static Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
+static uint32_t leaf_node_find_cell(void* node, uint32_t key);
+static NodeType get_node_type(void* node);
+static void set_node_type(void* node, NodeType type);
+static void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
+static uint32_t get_unused_page_num(Pager* pager);
+static void pager_free_page(Pager* pager, uint32_t page_num);
+static uint32_t* db_header_magic(void* header);
+static uint32_t* db_header_version(void* header);
+static uint32_t* db_header_root_page(void* header);
+static uint32_t* db_header_freelist_head(void* header);
+static uint32_t* db_header_freelist_count(void* header);
+static uint32_t* db_header_page_count(void* header);
+static uint32_t* freelist_trunk_next(void* page);
+static uint32_t* freelist_trunk_num_leaves(void* page);
+static uint32_t* freelist_trunk_leaf(void* page, uint32_t leaf_num);
+static bool freelist_remove(Pager* pager, uint32_t page_num);
+static void pager_truncate(Pager* pager, uint32_t num_pages);
+static uint32_t* db_header_index_root(void* header, IndexColumn column);
+static bool statement_set_value(Statement* statement, const char* value);
+static bool statement_value_matches(Statement* statement, const char* value, uint32_t length);
+static ExecuteResult execute_select_by_value(Statement* statement, Table* table);
+static ExecuteResult execute_create_index(Statement* statement, Table* table);
+static bool select_next_indexed(Statement* statement, Table* table);
+static bool select_next_matching(Statement* statement);
+static const char* row_view_column(RowView* view, IndexColumn column, uint32_t* length);
+static uint32_t index_key_encode(const char* value, uint32_t length, uint32_t id, uint8_t* destination);
+static uint32_t index_key_id(const IndexKey* key);
+static int index_key_compare(const IndexKey* a, const IndexKey* b);
+static void index_key_from_row(Row* row, IndexColumn column, uint8_t* buffer, IndexKey* key);
+static uint32_t index_common_prefix_length(const IndexKey* a, const IndexKey* b);
+static uint32_t index_node_prefix_length(void* node);
+static uint8_t* index_node_prefix(void* node);
+static uint32_t index_node_cells_end(uint32_t prefix_length);
+static const uint8_t* index_cell_suffix(const void* cell, uint32_t* length);
+static void index_cell_key(void* node, uint32_t cell_num, uint8_t* buffer, IndexKey* key);
+static uint32_t index_cell_size(void* node, const void* cell);
+static uint32_t index_cell_from_key(const IndexKey* key, uint32_t prefix_length, uint32_t child_page_num,
+                                    void* cell);
+static uint32_t index_node_child(void* node, uint32_t child_num);
+static void index_node_set_child(void* node, uint32_t child_num, uint32_t page_num);
+static uint32_t index_node_child_index(void* node, uint32_t child_page_num);
+static uint32_t index_node_find_cell(void* node, const IndexKey* key, bool upper);
+static void initialize_index_node(void* node, NodeType type, const IndexKey* prefix);
+static uint32_t index_node_size(NodeType type, const IndexEntry* entries, uint32_t count);
+static void index_node_write(void* node, NodeType type, const IndexEntry* entries, uint32_t count);
+static void index_node_adopt_children(Pager* pager, void* node, uint32_t page_num);
+static bool index_node_is_rightmost(Pager* pager, void* node);
+static uint32_t index_find_leaf(Pager* pager, uint32_t root_page_num, const IndexKey* key, uint32_t* cell_num);
+static uint32_t index_seek(Pager* pager, Snapshot* snapshot, uint32_t root_page_num, const IndexKey* key,
+                           void* node);
+static void index_insert(Table* table, uint32_t root_page_num, const IndexKey* key);
+static void index_node_insert(Table* table, uint32_t page_num, uint32_t cell_num, const IndexKey* key,
+                              uint32_t child_page_num);
+static void index_node_rewrite(Table* table, uint32_t page_num, uint32_t cell_num, const IndexKey* key,
+                               uint32_t child_page_num);
+static void index_delete(Table* table, uint32_t root_page_num, const IndexKey* key);
+static void index_update_row(Table* table, Row* old_row, Row* new_row);
+static void index_create(Table* table, IndexColumn column);
+static void index_build(Table* table, IndexColumn column, uint32_t root_page_num);
+static void index_free_children(Pager* pager, uint32_t page_num);
+static void index_rebuild_all(Table* table);
+static uint32_t index_leaf_prev_leaf(Pager* pager, uint32_t page_num);
+static void index_relocate_page(Table* table, uint32_t from_page_num, uint32_t to_page_num);
+static void table_vacuum(Table* table);
+static uint32_t table_vacuum_step(Table* table, uint32_t max_pages);
+static void btree_relocate_page(Table* table, uint32_t from_page_num, uint32_t to_page_num);
+static uint32_t leaf_node_prev_leaf(Pager* pager, uint32_t page_num);
+static void vacuum_remap_node(void* node, const uint32_t* new_page_nums);
+static void create_new_root(Table* table, uint32_t right_child_page_num);
+static uint32_t* internal_node_num_keys(void* node);
+static uint32_t* internal_node_right_child(void* node);
+#ifndef INTERNAL_NODE_SEPARATE_KEYS
+static uint32_t* internal_node_cell(void* node, uint32_t cell_num);
+#endif
+static uint32_t* internal_node_child(void* node, uint32_t child_num);
+static uint32_t* internal_node_key(void* node, uint32_t key_num);
+static uint32_t get_node_max_key(Pager* pager, void* node);
+static bool is_node_root(void* node);
+static void set_node_root(void* node, bool is_root);
+static void indent(uint32_t level);
+static void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+static Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key, uint32_t depth);
+static uint32_t internal_node_find_child(void* node, uint32_t key);
+static uint32_t count_keys_less_than(const uint32_t* keys, uint32_t num_keys, uint32_t key);
+static uint32_t* leaf_node_next_leaf(void* node);
+static uint32_t* node_parent(void* node);
+static void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
+static void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+static void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+static void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+static uint32_t internal_node_child_index(void* node, uint32_t child_page_num);
+static void internal_node_remove_cell(void* node, uint32_t cell_num);
+static void update_ancestor_max_key(Pager* pager, uint32_t page_num, uint32_t new_max);
+static bool node_is_underflowing(void* node);
+static void btree_rebalance(Table* table, uint32_t page_num);
+static bool btree_merge_or_redistribute(Table* table, uint32_t parent_page_num, uint32_t left_index);
+static void btree_collapse_root(Table* table);
+static void install_root(Table* table, uint32_t top_page_num);
+static LoadResult table_bulk_load(Table* table, const char* filename, double fill_factor,
+                                  uint32_t* num_loaded);
+static void server_handle_signal(int signal_number);
+static void server_open(Server* server, const char* address);
+static void server_accept(Server* server);
+static void server_close(Server* server);
+static bool connection_read(Connection* connection);
+static bool connection_service(Server* server, Connection* connection);
+static bool connection_run(Server* server, Connection* connection);
+static bool connection_runnable(Server* server, Connection* connection);
+static bool connection_has_request(Connection* connection);
+static bool connection_waits(Server* server, Connection* connection);
+static void connection_start_query(Server* server, Connection* connection, const uint8_t* body,
+                                   uint32_t length);
+static void connection_stream(Server* server, Connection* connection);
+static uint8_t* connection_reserve(Connection* connection, uint32_t size);
+static uint32_t connection_begin_frame(Connection* connection, ResponseType type);
+static void connection_end_frame(Connection* connection, uint32_t frame);
+static void connection_write_done(Connection* connection, ResponseStatus status, const char* message);
+static bool connection_flush(Connection* connection);
+static void connection_update_events(Server* server, Connection* connection);
+static void connection_close(Server* server, Connection* connection);
+static bool protocol_read_varint(const uint8_t** p, const uint8_t* end, uint32_t* value);
+
+// SQLを解析して文を作る。文は statement_finalize で解放する
+PrepareResult prepare_statement(Table* table, const char* sql, Statement** statement) {
+	Statement* new_statement = calloc(1, sizeof(Statement));
+	new_statement->table = table;
+	new_statement->sql = strdup(sql);
+
+	PrepareResult result = PREPARE_UNRECOGNIZED_STATEMENT;
+	if (strncmp(sql, "insert", 6) == 0) {
+		// strtok が書き換えるので、解析には複製を使う
+		char* tokens = strdup(sql);
+		result = prepare_insert(tokens, new_statement);
+		free(tokens);
+	} else if (strncmp(sql, "select", 6) == 0 && (sql[6] == '\0' || sql[6] == ' ')) {
+		char* tokens = strdup(sql);
+		result = prepare_select(tokens, new_statement);
+		free(tokens);
+	} else if (strncmp(sql, "update", 6) == 0) {
+		// 行の書き方は insert と同じ。同じidの行を置き換える
+		char* tokens = strdup(sql);
+		result = prepare_insert(tokens, new_statement);
+		new_statement->type = STATEMENT_UPDATE;
+		free(tokens);
+	} else if (strncmp(sql, "delete", 6) == 0) {
+		char* tokens = strdup(sql);
+		result = prepare_delete(tokens, new_statement);
+		free(tokens);
+	} else if (strcmp(sql, "begin") == 0) {
+		new_statement->type = STATEMENT_BEGIN;
+		result = PREPARE_SUCCESS;
+	} else if (strcmp(sql, "commit") == 0) {
+		new_statement->type = STATEMENT_COMMIT;
+		result = PREPARE_SUCCESS;
+	} else if (strcmp(sql, "rollback") == 0) {
+		new_statement->type = STATEMENT_ROLLBACK;
+		result = PREPARE_SUCCESS;
+	} else if (strcmp(sql, "create index on username") == 0 || strcmp(sql, "create index on email") == 0) {
+		new_statement->type = STATEMENT_CREATE_INDEX;
+		new_statement->value_column = sql[16] == 'u' ? INDEX_USERNAME : INDEX_EMAIL;
+		result = PREPARE_SUCCESS;
+	}
+
+	if (result != PREPARE_SUCCESS) {
+		statement_finalize(new_statement);
+		return result;
+	}
+	*statement = new_statement;
+	return PREPARE_SUCCESS;
+}
+
+// 値の代わりに ? と書いた列は、実行前に bind する
+static PrepareResult prepare_insert(char* sql, Statement* statement) {
+	statement->type = STATEMENT_INSERT;
+	
+	char* keyword = strtok(sql, " ");
+	char* id_string = strtok(NULL, " ");
+	char* username = strtok(NULL, " ");
+	char* email = strtok(NULL, " ");
+
+	if (id_string == NULL || username == NULL || email == NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	// ? の列は bind されるまで仮の値で検査しておく
+	char* values[] = {id_string, username, email};
+	StatementField fields[] = {STATEMENT_FIELD_ID, STATEMENT_FIELD_USERNAME, STATEMENT_FIELD_EMAIL};
+	for (uint32_t i = 0; i < 3; i++) {
+		if (strcmp(values[i], "?") == 0) {
+			statement->params[statement->num_params++] = fields[i];
+			values[i] = i == 0 ? "0" : "";
+		}
+	}
+
+	return parse_row(values[0], values[1], values[2], &statement->row_to_insert);
+}
+
+// delete <id>
+static PrepareResult prepare_delete(char* sql, Statement* statement) {
+	statement->type = STATEMENT_DELETE;
+
+	strtok(sql, " ");
+	char* id_string = strtok(NULL, " ");
+	if (id_string == NULL || strtok(NULL, " ") != NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	return prepare_select_value(statement, id_string, STATEMENT_FIELD_ID, &statement->row_to_insert.id);
+}
+
+// select の値を読む。? ならパラメータとして登録する
+static PrepareResult prepare_select_value(Statement* statement, char* token, StatementField field,
+                                          uint32_t* value) {
+	if (token == NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	if (strcmp(token, "?") == 0) {
+		if (statement->num_params == STATEMENT_MAX_PARAMS) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		statement->params[statement->num_params++] = field;
+		return PREPARE_SUCCESS;
+	}
+	return parse_number(token, value);
+}
+
+// SQLに書かれた id や limit を読む。bind と同じく 0 から UINT32_MAX まで
+static PrepareResult parse_number(const char* token, uint32_t* value) {
+	char* end;
+	errno = 0;
+	long long parsed = strtoll(token, &end, 10);
+	if (end == token || *end != '\0') {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	if (parsed < 0) {
+		return PREPARE_NEGATIVE_ID;
+	}
+	if (errno == ERANGE || parsed > UINT32_MAX) {
+		return PREPARE_NUMBER_OUT_OF_RANGE;
+	}
+	*value = parsed;
+	return PREPARE_SUCCESS;
+}
+
+// select [where id (= | > | >= | < | <=) v | where id between v and v |
+//         where (username | email) (= | like) s] [limit n]
+// like は s の末尾が % なら前方一致になる。v、s、n には ? も書ける
+static PrepareResult prepare_select(char* sql, Statement* statement) {
+	statement->type = STATEMENT_SELECT;
+	statement->limit = UINT32_MAX;
+
+	strtok(sql, " ");
+	char* token = strtok(NULL, " ");
+	PrepareResult result;
+	if (token != NULL && strcmp(token, "where") == 0) {
+		char* column = strtok(NULL, " ");
+		char* op = strtok(NULL, " ");
+		if (column == NULL || op == NULL) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+
+		char* value = strtok(NULL, " ");
+		if (strcmp(column, "username") == 0 || strcmp(column, "email") == 0) {
+			if ((strcmp(op, "=") != 0 && strcmp(op, "like") != 0) || value == NULL) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			statement->has_value = true;
+			statement->value_column = column[0] == 'u' ? INDEX_USERNAME : INDEX_EMAIL;
+			statement->value_like = op[0] == 'l';
+			if (strcmp(value, "?") == 0) {
+				if (statement->num_params == STATEMENT_MAX_PARAMS) {
+					return PREPARE_SYNTAX_ERROR;
+				}
+				statement->params[statement->num_params++] = STATEMENT_FIELD_VALUE;
+			} else if (!statement_set_value(statement, value)) {
+				return PREPARE_STRING_TOO_LONG;
+			}
+			result = PREPARE_SUCCESS;
+		} else if (strcmp(column, "id") != 0) {
+			return PREPARE_SYNTAX_ERROR;
+		} else if (strcmp(op, "=") == 0) {
+			statement->has_low = true;
+			statement->has_high = true;
+			result = prepare_select_value(statement, value, STATEMENT_FIELD_KEY, &statement->low);
+			statement->high = statement->low;
+		} else if (strcmp(op, ">") == 0 || strcmp(op, ">=") == 0) {
+			statement->has_low = true;
+			statement->low_exclusive = op[1] == '\0';
+			result = prepare_select_value(statement, value, STATEMENT_FIELD_LOW, &statement->low);
+		} else if (strcmp(op, "<") == 0 || strcmp(op, "<=") == 0) {
+			statement->has_high = true;
+			statement->high_exclusive = op[1] == '\0';
+			result = prepare_select_value(statement, value, STATEMENT_FIELD_HIGH, &statement->high);
+		} else if (strcmp(op, "between") == 0) {
+			statement->has_low = true;
+			statement->has_high = true;
+			result = prepare_select_value(statement, value, STATEMENT_FIELD_LOW, &statement->low);
+			char* and = strtok(NULL, " ");
+			if (result == PREPARE_SUCCESS && (and == NULL || strcmp(and, "and") != 0)) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			if (result == PREPARE_SUCCESS) {
+				result = prepare_select_value(statement, strtok(NULL, " "), STATEMENT_FIELD_HIGH,
+				                              &statement->high);
+			}
+		} else {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (result != PREPARE_SUCCESS) {
+			return result;
+		}
+		token = strtok(NULL, " ");
+	}
+
+	if (token != NULL && strcmp(token, "limit") == 0) {
+		result = prepare_select_value(statement, strtok(NULL, " "), STATEMENT_FIELD_LIMIT,
+		                              &statement->limit);
+		if (result != PREPARE_SUCCESS) {
+			return result;
+		}
+		token = strtok(NULL, " ");
+	}
+
+	return token == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+// insert 文と .load の両方で使う行の検査と変換
+static PrepareResult parse_row(char* id_string, char* username, char* email, Row* row) {
+	if (id_string == NULL || username == NULL || email == NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	uint32_t id;
+	PrepareResult result = parse_number(id_string, &id);
+	if (result != PREPARE_SUCCESS) {
+		return result;
+	}
+	if (strlen(username) > COLUMN_USERNAME_SIZE) {
+		return PREPARE_STRING_TOO_LONG;
+	}
+	if (strlen(email) > COLUMN_EMAIL_SIZE) {
+		return PREPARE_STRING_TOO_LONG;
+	}
+
+	row->id = id;
+	strcpy(row->username, username);
+	strcpy(row->email, email);
+
+	return PREPARE_SUCCESS;
+}
+
+// index 番目(1から)の ? に整数を与える
+BindResult statement_bind_int(Statement* statement, uint32_t index, int64_t value) {
+	if (index < 1 || index > statement->num_params) {
+		return BIND_OUT_OF_RANGE;
+	}
+	StatementField field = statement->params[index - 1];
+	if (field == STATEMENT_FIELD_USERNAME || field == STATEMENT_FIELD_EMAIL || field == STATEMENT_FIELD_VALUE) {
+		return BIND_TYPE_MISMATCH;
+	}
+	if (value < 0) {
+		return BIND_NEGATIVE_ID;
+	}
+	if (value > UINT32_MAX) {
+		return BIND_OUT_OF_RANGE;
+	}
+	switch (field) {
+		case (STATEMENT_FIELD_ID):
+			statement->row_to_insert.id = value;
+			break;
+		case (STATEMENT_FIELD_KEY):
+			statement->low = value;
+			statement->high = value;
+			break;
+		case (STATEMENT_FIELD_LOW):
+			statement->low = value;
+			break;
+		case (STATEMENT_FIELD_HIGH):
+			statement->high = value;
+			break;
+		case (STATEMENT_FIELD_LIMIT):
+			statement->limit = value;
+			break;
+		default:
+			return BIND_TYPE_MISMATCH;
+	}
+	statement->bound_params |= 1U << (index - 1);
+	return BIND_SUCCESS;
+}
+
+// index 番目(1から)の ? に文字列を与える。文字列は文にコピーされる
+BindResult statement_bind_text(Statement* statement, uint32_t index, const char* value) {
+	if (index < 1 || index > statement->num_params) {
+		return BIND_OUT_OF_RANGE;
+	}
+	switch (statement->params[index - 1]) {
+		case (STATEMENT_FIELD_USERNAME):
+			if (strlen(value) > COLUMN_USERNAME_SIZE) {
+				return BIND_STRING_TOO_LONG;
+			}
+			strcpy(statement->row_to_insert.username, value);
+			break;
+		case (STATEMENT_FIELD_EMAIL):
+			if (strlen(value) > COLUMN_EMAIL_SIZE) {
+				return BIND_STRING_TOO_LONG;
+			}
+			strcpy(statement->row_to_insert.email, value);
+			break;
+		case (STATEMENT_FIELD_VALUE):
+			if (!statement_set_value(statement, value)) {
+				return BIND_STRING_TOO_LONG;
+			}
+			break;
+		default:
+			return BIND_TYPE_MISMATCH;
+	}
+	statement->bound_params |= 1U << (index - 1);
+	return BIND_SUCCESS;
+}
+
+// where username か where email の値を置く。列に入らない長さなら false
+static bool statement_set_value(Statement* statement, const char* value) {
+	uint32_t length = strlen(value);
+	bool prefix = statement->value_like && length > 0 && value[length - 1] == '%';
+	if (prefix) {
+		length -= 1;
+	}
+	if (length > (statement->value_column == INDEX_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+		return false;
+	}
+	memcpy(statement->value, value, length);
+	statement->value_length = length;
+	statement->value_prefix = prefix;
+	return true;
+}
+
+static bool statement_value_matches(Statement* statement, const char* value, uint32_t length) {
+	if (statement->value_prefix ? length < statement->value_length : length != statement->value_length) {
+		return false;
+	}
+	return memcmp(value, statement->value, statement->value_length) == 0;
+}
+
+// 文を1段階実行する
+// select は1行ごとに EXECUTE_ROW を返し、最後まで読むと EXECUTE_SUCCESS を返す
+// 変更のある文は1つのトランザクションとして実行し、変更をWALにコミットする
+ExecuteResult statement_step(Statement* statement) {
+	Table* table = statement->table;
+	if (statement->bound_params != (1U << statement->num_params) - 1) {
+		return EXECUTE_UNBOUND_PARAMETER;
+	}
+
+	// select は行を返し終えるまでを1回として測る
+	uint64_t start_ns = statement->type == STATEMENT_SELECT && statement->started ? statement->start_ns
+	                                                                              : stats_now_ns();
+	ExecuteResult result;
+	switch (statement->type) {
+		case (STATEMENT_INSERT):
+			result = table_execute_write(statement, execute_insert);
+			break;
+		case (STATEMENT_UPDATE):
+			result = table_execute_write(statement, execute_update);
+			break;
+		case (STATEMENT_DELETE):
+			result = table_execute_write(statement, execute_delete);
+			break;
+		case (STATEMENT_SELECT):
+			if (statement->has_value) {
+				result = execute_select_by_value(statement, table);
+			} else {
+				result = execute_select(statement, table);
+			}
+			break;
+		case (STATEMENT_BEGIN):
+			result = execute_begin(table, statement->session);
+			break;
+		case (STATEMENT_COMMIT):
+			result = execute_commit(table);
+			break;
+		case (STATEMENT_ROLLBACK):
+			result = execute_rollback(table);
+			break;
+		case (STATEMENT_CREATE_INDEX):
+			result = table_execute_write(statement, execute_create_index);
+			break;
+		default:
+			// prepare_statement が作らない種類
+			printf("Unknown statement type %d\n", statement->type);
+			exit(EXIT_FAILURE);
+	}
+	if (result == EXECUTE_ROW) {
+		statement->start_ns = start_ns;
+	} else {
+		stats_record_latency(&table->pager->stats.statements[statement->type], stats_now_ns() - start_ns);
+	}
+	return result;
+}
+
+// statement_step が最後に返した行をコピーして返す
+Row* statement_row(Statement* statement) {
+	deserialize_row(cursor_value(statement->cursor), &statement->row);
+	return &statement->row;
+}
+
+// statement_step が最後に返した行を、コピーせずにページ上で参照する
+// 次に statement_step を呼ぶまで有効
+void statement_row_view(Statement* statement, RowView* view) {
+	row_view_from_cell(cursor_value(statement->cursor), view);
+}
+
+// 実行中の select を打ち切り、最初から実行できるようにする。bind した値は残る
+void statement_reset(Statement* statement) {
+	if (statement->cursor != NULL || statement->index_node != NULL) {
+		if (statement->cursor != NULL) {
+			cursor_close(statement->cursor);
+			statement->cursor = NULL;
+		}
+		free(statement->index_node);
+		statement->index_node = NULL;
+		if (statement->snapshot.seq != SNAPSHOT_UNCOMMITTED) {
+			snapshot_release(statement->table->pager, &statement->snapshot);
+		}
+		pthread_rwlock_unlock(&statement->table->tree_latch);
+	}
+	statement->started = false;
+}
+
+// 書き込む文を実行してコミットする
+// 読み手はスナップショットから読むので、分割や併合も読み手を待たずに行える
+// トランザクションの中では、commit まで変更をメモリに残してコミットしない
+// 他のスレッドのトランザクションが開いていれば、それが終わるまで待つ
+// 永続化は write_mutex を放してから待つので、同期の間に他の書き手が次のコミットを追記できる
+static ExecuteResult table_execute_write(Statement* statement,
+                                         ExecuteResult (*execute)(Statement* statement, Table* table)) {
+	Table* table = statement->table;
+	PagerCommit commit = {.wal_position = 0};
+	pthread_mutex_lock(&table->write_mutex);
+	ExecuteResult result = execute(statement, table);
+	if (!table->in_transaction) {
+		table_commit(table, &commit);
+	}
+	pthread_mutex_unlock(&table->write_mutex);
+	pager_commit_finish(table->pager, &commit);
+	return result;
+}
+
+// write_mutex を commit か rollback まで持ったままにする
+static ExecuteResult execute_begin(Table* table, const void* session) {
+	pthread_mutex_lock(&table->write_mutex);
+	if (table->in_transaction) {
+		pthread_mutex_unlock(&table->write_mutex);
+		return EXECUTE_TRANSACTION_ACTIVE;
+	}
+	table->in_transaction = true;
+	table->transaction_session = session;
+	return EXECUTE_SUCCESS;
+}
+
+// トランザクションで変更した全てのページを1つのコミットレコードで書き、1回だけ同期する
+static ExecuteResult execute_commit(Table* table) {
+	pthread_mutex_lock(&table->write_mutex);
+	if (!table->in_transaction) {
+		pthread_mutex_unlock(&table->write_mutex);
+		return EXECUTE_NO_TRANSACTION;
+	}
+	table->in_transaction = false;
+	PagerCommit commit;
+	table_commit(table, &commit);
+	// execute_begin で取った分も放す
+	pthread_mutex_unlock(&table->write_mutex);
+	pthread_mutex_unlock(&table->write_mutex);
+	pager_commit_finish(table->pager, &commit);
+	return EXECUTE_SUCCESS;
+}
+
+static ExecuteResult execute_rollback(Table* table) {
+	pthread_mutex_lock(&table->write_mutex);
+	if (!table->in_transaction) {
+		pthread_mutex_unlock(&table->write_mutex);
+		return EXECUTE_NO_TRANSACTION;
+	}
+	table->in_transaction = false;
+	pager_rollback(table->pager);
+	// 右端の葉は捨てたページかもしれない
+	table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+	pthread_mutex_unlock(&table->write_mutex);
+	pthread_mutex_unlock(&table->write_mutex);
+	return EXECUTE_SUCCESS;
+}
+
+// 呼び出したスレッドの session がトランザクションの中にいるか
+// 他のスレッドが書き込み中なら取れないので、その場合は自分のトランザクションではない
+// サーバーは1つのスレッドで全ての接続を動かすので、session で begin した接続か確かめる
+static bool table_owns_transaction(Table* table, const void* session) {
+	if (pthread_mutex_trylock(&table->write_mutex) != 0) {
+		return false;
+	}
+	bool owned = table->in_transaction && table->transaction_session == session;
+	pthread_mutex_unlock(&table->write_mutex);
+	return owned;
+}
+
+// 木全体を書き換える操作(.load, .vacuum など)の前後に呼ぶ。他の書き手と読み手が抜けるのを待つ
+// 読み手がいないので、変更するページの版は作らない
+// 版がないとロールバックできないので、トランザクションの中では何もせずに false を返す
+static bool table_lock_exclusive(Table* table) {
+	pthread_mutex_lock(&table->write_mutex);
+	if (table->in_transaction) {
+		pthread_mutex_unlock(&table->write_mutex);
+		return false;
+	}
+	pthread_rwlock_wrlock(&table->tree_latch);
+	table->pager->exclusive = true;
+	return true;
+}
+
+static void table_unlock_exclusive(Table* table) {
+	table->pager->exclusive = false;
+	pager_commit(table->pager);
+	if (wal_needs_checkpoint(table->pager->wal)) {
+		pager_checkpoint(table->pager);
+	}
+	pthread_rwlock_unlock(&table->tree_latch);
+	pthread_mutex_unlock(&table->write_mutex);
+}
+
+LoadResult db_load(Table* table, const char* filename, double fill_factor, uint32_t* num_loaded) {
+	if (!table_lock_exclusive(table)) {
+		return LOAD_TRANSACTION_ACTIVE;
+	}
+	LoadResult result = table_bulk_load(table, filename, fill_factor, num_loaded);
+	table_unlock_exclusive(table);
+	return result;
+}
+
+bool db_vacuum(Table* table, uint32_t max_pages, uint32_t* num_pages, uint32_t* free_count) {
+	if (!table_lock_exclusive(table)) {
+		return false;
+	}
+	if (max_pages == 0) {
+		// 索引は捨てて木だけを詰め、後ろに作り直す
+		Pager* pager = table->pager;
+		bool indexed[INDEX_NUM_COLUMNS];
+		void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+		mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+		for (IndexColumn column = 0; column < INDEX_NUM_COLUMNS; column++) {
+			indexed[column] = *db_header_index_root(header, column) != 0;
+			*db_header_index_root(header, column) = 0;
+		}
+		unpin_page(pager, DB_HEADER_PAGE_NUM);
+		table_vacuum(table);
+		for (IndexColumn column = 0; column < INDEX_NUM_COLUMNS; column++) {
+			if (indexed[column]) {
+				index_create(table, column);
+			}
+		}
+		pager_commit(pager);
+		*free_count = 0;
+	} else {
+		*free_count = table_vacuum_step(table, max_pages);
+	}
+	*num_pages = table->pager->num_pages;
+	table_unlock_exclusive(table);
+	return true;
+}
+
+bool db_print_tree(Table* table) {
+	if (!table_lock_exclusive(table)) {
+		return false;
+	}
+	printf("Tree:\n");
+	print_tree(table->pager, table->root_page_num, 0);
+	table_unlock_exclusive(table);
+	return true;
+}
+
+void statement_finalize(Statement* statement) {
+	statement_reset(statement);
+	free(statement->sql);
+	free(statement);
+}
+
+static uint32_t statement_cache_hash(const char* sql) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char* p = sql; *p != '\0'; p++) {
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	}
+	return hash;
+}
+
+static void statement_cache_unlink(StatementCache* cache, Statement* statement) {
+	if (statement->lru_prev != NULL) {
+		statement->lru_prev->lru_next = statement->lru_next;
+	} else {
+		cache->lru_head = statement->lru_next;
+	}
+	if (statement->lru_next != NULL) {
+		statement->lru_next->lru_prev = statement->lru_prev;
+	} else {
+		cache->lru_tail = statement->lru_prev;
+	}
+	statement->lru_prev = NULL;
+	statement->lru_next = NULL;
+}
+
+static void statement_cache_push_front(StatementCache* cache, Statement* statement) {
+	statement->lru_next = cache->lru_head;
+	if (cache->lru_head != NULL) {
+		cache->lru_head->lru_prev = statement;
+	}
+	cache->lru_head = statement;
+	if (cache->lru_tail == NULL) {
+		cache->lru_tail = statement;
+	}
+}
+
+// テーブルの文のキャッシュから文を得る
+PrepareResult table_prepare_cached(Table* table, const char* sql, Statement** statement) {
+	return statement_cache_prepare(&table->statement_cache, table, sql, statement);
+}
+
+// SQLの文字列で文のキャッシュを引き、なければ解析してキャッシュに入れる
+// 返す文はキャッシュが持っているので、呼び出し側は finalize しないこと
+// キャッシュから追い出されると解放されるので、次にこの関数を呼ぶまでに使い終えること
+static PrepareResult statement_cache_prepare(StatementCache* cache, Table* table, const char* sql,
+                                             Statement** statement) {
+	uint32_t hash = statement_cache_hash(sql);
+	Statement** bucket = &cache->buckets[hash % STATEMENT_CACHE_BUCKETS];
+	for (Statement* cached = *bucket; cached != NULL; cached = cached->next_in_bucket) {
+		if (cached->hash == hash && strcmp(cached->sql, sql) == 0) {
+			statement_reset(cached);
+			statement_cache_unlink(cache, cached);
+			statement_cache_push_front(cache, cached);
+			*statement = cached;
+			return PREPARE_SUCCESS;
+		}
+	}
+
+	Statement* new_statement;
+	PrepareResult result = prepare_statement(table, sql, &new_statement);
+	if (result != PREPARE_SUCCESS) {
+		return result;
+	}
+
+	if (cache->count == STATEMENT_CACHE_SIZE) {
+		Statement* victim = cache->lru_tail;
+		statement_cache_unlink(cache, victim);
+		Statement** link = &cache->buckets[victim->hash % STATEMENT_CACHE_BUCKETS];
+		while (*link != victim) {
+			link = &(*link)->next_in_bucket;
+		}
+		*link = victim->next_in_bucket;
+		statement_finalize(victim);
+		cache->count -= 1;
+	}
+
+	new_statement->hash = hash;
+	new_statement->next_in_bucket = *bucket;
+	*bucket = new_statement;
+	statement_cache_push_front(cache, new_statement);
+	cache->count += 1;
+	*statement = new_statement;
+	return PREPARE_SUCCESS;
+}
+
+static void statement_cache_clear(StatementCache* cache) {
+	Statement* statement = cache->lru_head;
+	while (statement != NULL) {
+		Statement* next = statement->lru_next;
+		statement_finalize(statement);
+		statement = next;
+	}
+	memset(cache, 0, sizeof(StatementCache));
+}
+
+// REPL とサーバが返す、文を解析できなかった理由
+const char* prepare_result_message(PrepareResult result) {
+	switch (result) {
+		case (PREPARE_SUCCESS):
+			break;
+		case (PREPARE_STRING_TOO_LONG):
+			return "String is too long.";
+		case (PREPARE_NEGATIVE_ID):
+			return "ID must be positive.";
+		case (PREPARE_NUMBER_OUT_OF_RANGE):
+			return "Number is out of range.";
+		case (PREPARE_SYNTAX_ERROR):
+			return "Syntax error, could not parse statement.";
+		case (PREPARE_UNRECOGNIZED_STATEMENT):
+			return "Unrecognized keyword at start of statement.";
+	}
+	return "";
+}
+
+// REPL とサーバが返す、文を実行した結果
+const char* execute_result_message(ExecuteResult result) {
+	switch (result) {
+		case (EXECUTE_SUCCESS):
+		case (EXECUTE_ROW):
+			return "Executed.";
+		case (EXECUTE_UNBOUND_PARAMETER):
+			return "Error: Unbound parameter.";
+		case (EXECUTE_DUPLICATE_KEY):
+			return "Error: Duplicate key.";
+		case (EXECUTE_KEY_NOT_FOUND):
+			return "Error: Key not found.";
+		case (EXECUTE_TABLE_FULL):
+			return "Error: Table full.";
+		case (EXECUTE_TRANSACTION_ACTIVE):
+			return "Error: Already in a transaction.";
+		case (EXECUTE_NO_TRANSACTION):
+			return "Error: No transaction is active.";
+		case (EXECUTE_INDEX_EXISTS):
+			return "Error: Index already exists.";
+	}
+	return "";
+}
+
+static ExecuteResult execute_insert(Statement* statement, Table* table) {
+	Row* row_to_insert = &(statement->row_to_insert);
+	uint32_t key_to_insert = row_to_insert->id;
+	Cursor* cursor = table_find_append(table, key_to_insert);
+	if (cursor == NULL) {
+		cursor = table_find(table, key_to_insert);
+		if (*leaf_node_next_leaf(cursor->node) == 0) {
+			table->rightmost_leaf_page_num = cursor->page_num;
+		}
+	}
+
+	void* node = cursor->node;
+	uint32_t num_cells = (*leaf_node_num_cells(node));
+	if (cursor->cell_num < num_cells) {
+		uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
+		if (key_at_index == key_to_insert) {
+			cursor_close(cursor);
+			return EXECUTE_DUPLICATE_KEY;
+		}
+	}
+	leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+
+	cursor_close(cursor);
+	index_update_row(table, NULL, row_to_insert);
+
+	return EXECUTE_SUCCESS;
+}
+
+// 同じidの行を置き換える。セルの大きさが変わらなければその場で書き換え、
+// 変わる場合は古いセルを外してから挿入し直す(入り切らなければ葉を分割する)
+static ExecuteResult execute_update(Statement* statement, Table* table) {
+	Pager* pager = table->pager;
+	Row* row = &(statement->row_to_insert);
+	Cursor* cursor = table_find(table, row->id);
+	void* node = cursor->node;
+	if (cursor->cell_num >= *leaf_node_num_cells(node) ||
+	    *leaf_node_key(node, cursor->cell_num) != row->id) {
+		cursor_close(cursor);
+		return EXECUTE_KEY_NOT_FOUND;
+	}
+
+	Row old_row;
+	deserialize_row(leaf_node_value(node, cursor->cell_num), &old_row);
+	uint32_t cell[LEAF_NODE_MAX_CELL_SIZE / sizeof(uint32_t)];
+	uint32_t cell_size = leaf_cell_from_row(row, cell);
+	mark_page_dirty(pager, cursor->page_num);
+	if (cell_size == leaf_node_cell_size(node, cursor->cell_num)) {
+		memcpy(leaf_node_cell(node, cursor->cell_num), cell, cell_size);
+	} else {
+		leaf_node_remove_cell(node, cursor->cell_num);
+		leaf_node_insert(cursor, row->id, row);
+	}
+	cursor_close(cursor);
+	index_update_row(table, &old_row, row);
+
+	return EXECUTE_SUCCESS;
+}
+
+// 行を葉から外し、葉が少なくなりすぎたら兄弟と併合するか兄弟から分けてもらう
+static ExecuteResult execute_delete(Statement* statement, Table* table) {
+	Pager* pager = table->pager;
+	uint32_t key = statement->row_to_insert.id;
+	Cursor* cursor = table_find(table, key);
+	uint32_t page_num = cursor->page_num;
+	void* node = cursor->node;
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	if (cursor->cell_num >= num_cells || *leaf_node_key(node, cursor->cell_num) != key) {
+		cursor_close(cursor);
+		return EXECUTE_KEY_NOT_FOUND;
+	}
+
+	Row old_row;
+	deserialize_row(leaf_node_value(node, cursor->cell_num), &old_row);
+	mark_page_dirty(pager, page_num);
+	leaf_node_remove_cell(node, cursor->cell_num);
+	// 最大キーを消した場合は、祖先が持っているこの葉のキーを新しい最大キーに直す
+	// 空になった葉は、この後の併合で取り除かれる
+	if (!is_node_root(node) && cursor->cell_num == num_cells - 1 && num_cells > 1) {
+		update_ancestor_max_key(pager, page_num, *leaf_node_key(node, num_cells - 2));
+	}
+	cursor_close(cursor);
+
+	btree_rebalance(table, page_num);
+	index_update_row(table, &old_row, NULL);
+	return EXECUTE_SUCCESS;
+}
+
+// where id の条件を両端を含む範囲 [low, high] にする。条件に合う行がなければ false
+static bool select_range(Statement* statement, uint32_t* low, uint32_t* high) {
+	*low = statement->has_low ? statement->low : 0;
+	*high = statement->has_high ? statement->high : UINT32_MAX;
+	if (statement->has_low && statement->low_exclusive) {
+		if (*low == UINT32_MAX) {
+			return false;
+		}
+		*low += 1;
+	}
+	if (statement->has_high && statement->high_exclusive) {
+		if (*high == 0) {
+			return false;
+		}
+		*high -= 1;
+	}
+	return *low <= *high;
+}
+
+// カーソルを次の行に進め、EXECUTE_ROW を返す
+// 返した行を読み終えるまで葉のコピーを保つため、カーソルは次の呼び出しで進める
+// 下限があれば table_seek で1度だけ根からたどり、後は葉の兄弟ポインタをたどって上限で止まる
+static ExecuteResult execute_select(Statement* statement, Table* table) {
+	if (!statement->started) {
+		statement->started = true;
+		statement->rows_returned = 0;
+		uint32_t low;
+		if (statement->limit > 0 && select_range(statement, &low, &statement->scan_high)) {
+			// 走査が終わるか statement_reset されるまで、この時点でコミットされていた内容を読む
+			// 木のラッチは、版を作らない .load や .vacuum を待たせるためだけに持つ
+			pthread_rwlock_rdlock(&table->tree_latch);
+			if (table_owns_transaction(table, statement->session)) {
+				statement->snapshot.seq = SNAPSHOT_UNCOMMITTED;
+			} else {
+				snapshot_acquire(table->pager, &statement->snapshot);
+			}
+			Snapshot* snapshot = &statement->snapshot;
+			statement->cursor = low > 0 ? table_seek(table, snapshot, low) : table_start(table, snapshot);
+		}
+	} else if (statement->cursor != NULL) {
+		cursor_advance(statement->cursor);
+	}
+
+	Cursor* cursor = statement->cursor;
+	bool done = cursor == NULL || cursor->end_of_table || statement->rows_returned == statement->limit;
+	if (!done) {
+		uint32_t key;
+		memcpy(&key, cursor_value(cursor) + ID_OFFSET, ID_SIZE);
+		done = key > statement->scan_high;
+	}
+	if (done) {
+		// 最後まで読んだ。次の statement_step は最初から実行する
+		statement_reset(statement);
+		return EXECUTE_SUCCESS;
+	}
+	statement->rows_returned += 1;
+	return EXECUTE_ROW;
+}
+
+// where username か where email の select
+// 索引があれば値が合う範囲のエントリだけを索引から読み、id で行の木を引く
+// なければ全ての行を読んで値を比べる。索引からは (値, id) の順に、全ての行からは id の順に返る
+static ExecuteResult execute_select_by_value(Statement* statement, Table* table) {
+	Pager* pager = table->pager;
+	if (!statement->started) {
+		statement->started = true;
+		statement->rows_returned = 0;
+		if (statement->limit == 0) {
+			statement_reset(statement);
+			return EXECUTE_SUCCESS;
+		}
+		pthread_rwlock_rdlock(&table->tree_latch);
+		if (table_owns_transaction(table, statement->session)) {
+			statement->snapshot.seq = SNAPSHOT_UNCOMMITTED;
+		} else {
+			snapshot_acquire(pager, &statement->snapshot);
+		}
+		// 索引を作ったトランザクションより前のスナップショットでは、索引はまだない
+		uint32_t header[PAGE_SIZE / sizeof(uint32_t)];
+		snapshot_read_page(pager, &statement->snapshot, DB_HEADER_PAGE_NUM, header);
+		uint32_t root_page_num = *db_header_index_root(header, statement->value_column);
+		if (root_page_num != 0) {
+			// 値だけのキーは、その値で始まるどのキーよりも前に来る
+			IndexKey key = {(const uint8_t*)statement->value, statement->value_length};
+			statement->index_node = malloc(PAGE_SIZE);
+			statement->index_cell =
+			    index_seek(pager, &statement->snapshot, root_page_num, &key, statement->index_node);
+		} else {
+			statement->cursor = table_start(table, &statement->snapshot);
+		}
+	} else if (statement->index_node != NULL) {
+		statement->index_cell += 1;
+	} else {
+		cursor_advance(statement->cursor);
+	}
+
+	bool found = statement->rows_returned < statement->limit &&
+	             (statement->index_node != NULL ? select_next_indexed(statement, table)
+	                                            : select_next_matching(statement));
+	if (!found) {
+		statement_reset(statement);
+		return EXECUTE_SUCCESS;
+	}
+	statement->rows_returned += 1;
+	return EXECUTE_ROW;
+}
+
+// 索引の今の位置から値が合うエントリを読み、その行を指すカーソルを statement->cursor に置く
+static bool select_next_indexed(Statement* statement, Table* table) {
+	void* node = statement->index_node;
+	while (true) {
+		// 削除で空になった葉は飛ばす
+		while (statement->index_cell >= *leaf_node_num_cells(node)) {
+			uint32_t next_page_num = *leaf_node_next_leaf(node);
+			if (next_page_num == 0) {
+				return false;
+			}
+			snapshot_read_page(table->pager, &statement->snapshot, next_page_num, node);
+			statement->index_cell = 0;
+		}
+		uint8_t buffer[INDEX_MAX_KEY_SIZE];
+		IndexKey key;
+		index_cell_key(node, statement->index_cell, buffer, &key);
+		if (!statement_value_matches(statement, (const char*)key.data, key.length - INDEX_KEY_SUFFIX_SIZE)) {
+			return false;
+		}
+		if (statement->cursor != NULL) {
+			cursor_close(statement->cursor);
+		}
+		uint32_t id = index_key_id(&key);
+		statement->cursor = snapshot_find(table, &statement->snapshot, id);
+		Cursor* cursor = statement->cursor;
+		if (cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+		    *leaf_node_key(cursor->node, cursor->cell_num) == id) {
+			return true;
+		}
+		// 索引と行の木は同じスナップショットから読むので、行がないのは壊れている時だけ
+		statement->index_cell += 1;
+	}
+}
+
+// 全ての行を id の順に読み、値が合う行でカーソルを止める
+static bool select_next_matching(Statement* statement) {
+	Cursor* cursor = statement->cursor;
+	while (!cursor->end_of_table) {
+		RowView view;
+		row_view_from_cell(cursor_value(cursor), &view);
+		uint32_t length;
+		const char* value = row_view_column(&view, statement->value_column, &length);
+		if (statement_value_matches(statement, value, length)) {
+			return true;
+		}
+		cursor_advance(cursor);
+	}
+	return false;
+}
+
+static const char* row_view_column(RowView* view, IndexColumn column, uint32_t* length) {
+	*length = column == INDEX_USERNAME ? view->username_length : view->email_length;
+	return column == INDEX_USERNAME ? view->username : view->email;
+}
+
+// 7ビットずつ下位から書き、続きがあるバイトは最上位ビットを立てる
+static uint32_t varint_encode(uint32_t value, uint8_t* destination) {
+	uint32_t size = 0;
+	while (value >= 0x80) {
+		destination[size++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	destination[size++] = value;
+	return size;
+}
+
+static uint32_t varint_decode(const uint8_t* source, uint32_t* value) {
+	uint32_t result = 0;
+	uint32_t size = 0;
+	uint32_t shift = 0;
+	uint8_t byte;
+	do {
+		byte = source[size++];
+		result |= (uint32_t)(byte & 0x7F) << shift;
+		shift += 7;
+	} while ((byte & 0x80) && size < VARINT_MAX_SIZE);
+	*value = result;
+	return size;
+}
+
+// copy the member value to the destination offset
+// 書いたバイト数を返す
+static uint32_t serialize_row(Row* source, void* destination) {
+	uint8_t* p = destination;
+	memcpy(p + ID_OFFSET, &(source->id), ID_SIZE);
+	uint32_t offset = ID_OFFSET + ID_SIZE;
+
+	uint32_t username_length = strlen(source->username);
+	offset += varint_encode(username_length, p + offset);
+	memcpy(p + offset, source->username, username_length);
+	offset += username_length;
+
+	uint32_t email_length = strlen(source->email);
+	offset += varint_encode(email_length, p + offset);
+	memcpy(p + offset, source->email, email_length);
+	offset += email_length;
+
+	return offset;
+}
+
+// copy the offset of the source to the offset of the member
+static void deserialize_row(void* source, Row* destination) {
+	const uint8_t* p = source;
+	memcpy(&(destination->id), p + ID_OFFSET, ID_SIZE);
+	uint32_t offset = ID_OFFSET + ID_SIZE;
+
+	uint32_t username_length;
+	offset += varint_decode(p + offset, &username_length);
+	memcpy(destination->username, p + offset, username_length);
+	destination->username[username_length] = '\0';
+	offset += username_length;
+
+	uint32_t email_length;
+	offset += varint_decode(p + offset, &email_length);
+	memcpy(destination->email, p + offset, email_length);
+	destination->email[email_length] = '\0';
+}
+
+// シリアライズされた行をコピーせずに読む
+static void row_view_from_cell(const void* cell, RowView* view) {
+	const uint8_t* p = cell;
+	memcpy(&view->id, p + ID_OFFSET, ID_SIZE);
+	uint32_t offset = ID_OFFSET + ID_SIZE;
+	offset += varint_decode(p + offset, &view->username_length);
+	view->username = (const char*)p + offset;
+	offset += view->username_length;
+	offset += varint_decode(p + offset, &view->email_length);
+	view->email = (const char*)p + offset;
+	view->data = cell;
+	view->size = offset + view->email_length;
+}
+
+// シリアライズされた行のバイト数
+static uint32_t row_serialized_size(void* source) {
+	const uint8_t* p = source;
+	uint32_t offset = ID_OFFSET + ID_SIZE;
+	uint32_t length;
+	offset += varint_decode(p + offset, &length);
+	offset += length;
+	offset += varint_decode(p + offset, &length);
+	return offset + length;
+}
+
+// カーソルで記述された位置へのポインタを返す
+// カーソルが移動するまで有効
+static void* cursor_value(Cursor* cursor) {
+	return leaf_node_value(cursor->node, cursor->cell_num);
+}
+
+Table* db_open(const char* filename, PagerOptions* options) {
+	Pager* pager = pager_open(filename, options);
+
+	Table* table = (Table*)malloc(sizeof(Table));
+	table->pager = pager;
+	table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+	memset(&table->statement_cache, 0, sizeof(StatementCache));
+	// 読み手が絶えず来ても、木の形を変える書き手が待たされ続けないようにする
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&table->tree_latch, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutexattr_t mutex_attr;
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&table->write_mutex, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	table->in_transaction = false;
+
+	// データベースファイルを新規作成する時、ページ0をヘッダ、ページ1をルートの葉として初期化する。
+	// 初期化をコミットする前に落ちた場合は、ページ0がゼロのまま残っている
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	if (*db_header_magic(header) == 0) {
+		uint32_t root_page_num = DB_HEADER_PAGE_NUM + 1;
+		void* root_node = get_page(pager, root_page_num);
+		mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+		mark_page_dirty(pager, root_page_num);
+		memset(header, 0, PAGE_SIZE);
+		*db_header_magic(header) = DB_HEADER_MAGIC;
+		*db_header_version(header) = DB_HEADER_VERSION;
+		*db_header_root_page(header) = root_page_num;
+		*db_header_page_count(header) = root_page_num + 1;
+		initialize_leaf_node(root_node);
+		set_node_root(root_node, true);
+		unpin_page(pager, root_page_num);
+	} else if (*db_header_magic(header) != DB_HEADER_MAGIC ||
+	           *db_header_version(header) != DB_HEADER_VERSION) {
+		printf("Not a database file or unsupported version.\n");
+		exit(EXIT_FAILURE);
+	}
+	table->root_page_num = *db_header_root_page(header);
+	// mmapモードで伸ばしたまま終了した場合などは、ファイルの後ろに使われていないページがある
+	uint32_t page_count = *db_header_page_count(header);
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+	if (page_count < pager->num_pages) {
+		pager_truncate(pager, page_count);
+	}
+	pager_commit(pager);
+
+	return table;
+}
+
+// 読み手のカーソルを次の行に進める
+void cursor_advance(Cursor* cursor) {
+	void* node = cursor->node;
+
+	cursor->cell_num += 1;
+	if (cursor->cell_num >= *(leaf_node_num_cells(node))) {
+		/* Advance to next leaf node */
+		uint32_t next_page_num = *leaf_node_next_leaf(node);
+		if (next_page_num == 0) {
+			/* This was rightmost leaf */
+			cursor->end_of_table = true;
+		} else {
+			// スナップショットの時点の次の葉を、今の葉のコピーに上書きする
+			snapshot_read_page(cursor->table->pager, cursor->snapshot, next_page_num, node);
+			cursor->page_num = next_page_num;
+			cursor->cell_num = 0;
+			cursor_prefetch(cursor, node);
+		}
+	}
+}
+
+// 走査が葉を移るたびに、同じ親の後に続く葉を先読みする
+// 次の葉の番号は今の葉を読むまで分からないので、兄弟の一覧を持っている親から取る
+// 親もスナップショットから読み、親が変わるまでコピーを使い回す
+// 予想した葉に来るたびに先読みする葉の数を倍にしていき、外れたら最小に戻す
+static void cursor_prefetch(Cursor* cursor, void* leaf) {
+	uint32_t num_cells = *leaf_node_num_cells(leaf);
+	if (is_node_root(leaf) || num_cells == 0) {
+		return;
+	}
+	if (cursor->prefetch_expected != INVALID_PAGE_NUM && cursor->page_num != cursor->prefetch_expected) {
+		cursor->prefetch_window = PAGER_READAHEAD_MIN_WINDOW;
+	}
+	Pager* pager = cursor->table->pager;
+	uint32_t parent_page_num = *node_parent(leaf);
+	void* parent = cursor->prefetch_node;
+	if (parent_page_num != cursor->prefetch_parent) {
+		snapshot_read_page(pager, cursor->snapshot, parent_page_num, parent);
+	}
+	uint32_t num_children = *internal_node_num_keys(parent) + 1;
+	uint32_t index = internal_node_find_child(parent, *leaf_node_key(leaf, num_cells - 1));
+	if (parent_page_num != cursor->prefetch_parent || cursor->prefetch_end < index + 1) {
+		cursor->prefetch_parent = parent_page_num;
+		cursor->prefetch_end = index + 1;
+	}
+
+	uint32_t end = index + 1 + cursor->prefetch_window;
+	if (end > num_children) {
+		end = num_children;
+	}
+	uint32_t page_nums[PAGER_READAHEAD_MAX_WINDOW];
+	uint32_t num_page_nums = 0;
+	for (uint32_t i = cursor->prefetch_end; i < end; i++) {
+		page_nums[num_page_nums++] = *internal_node_child(parent, i);
+	}
+	if (end > cursor->prefetch_end) {
+		cursor->prefetch_end = end;
+	}
+	// 親の最後の子なら、次の葉は別の親の下にあって予想できない
+	cursor->prefetch_expected = index + 1 < num_children ? *internal_node_child(parent, index + 1) : INVALID_PAGE_NUM;
+
+	pager_prefetch(pager, page_nums, num_page_nums);
+	if (cursor->prefetch_window < PAGER_READAHEAD_MAX_WINDOW) {
+		cursor->prefetch_window *= 2;
+	}
+}
+
+// 書き手のカーソルは葉のピンを外し、読み手のカーソルはコピーを捨てる
+void cursor_close(Cursor* cursor) {
+	if (cursor->snapshot != NULL) {
+		free(cursor->node);
+	} else {
+		unpin_page(cursor->table->pager, cursor->page_num);
+	}
+	if (cursor->owns_snapshot) {
+		Table* table = cursor->table;
+		if (cursor->snapshot->seq != SNAPSHOT_UNCOMMITTED) {
+			snapshot_release(table->pager, cursor->snapshot);
+		}
+		free(cursor->snapshot);
+		pthread_rwlock_unlock(&table->tree_latch);
+	}
+	free(cursor);
+}
+
+// select と同じように、木のラッチを共有で持ってスナップショットを取る
+// 自分のトランザクションの中では、コミットしていない変更も読む
+Cursor* table_scan(Table* table, uint32_t start_key) {
+	pthread_rwlock_rdlock(&table->tree_latch);
+	Snapshot* snapshot = malloc(sizeof(Snapshot));
+	if (table_owns_transaction(table, NULL)) {
+		snapshot->seq = SNAPSHOT_UNCOMMITTED;
+	} else {
+		snapshot_acquire(table->pager, snapshot);
+	}
+	Cursor* cursor = start_key > 0 ? table_seek(table, snapshot, start_key) : table_start(table, snapshot);
+	cursor->owns_snapshot = true;
+	return cursor;
+}
+
+bool cursor_at_end(Cursor* cursor) { return cursor->end_of_table; }
+
+void cursor_row_view(Cursor* cursor, RowView* view) { row_view_from_cell(cursor_value(cursor), view); }
+
+// ページキャッシュをディスクにフラッシュ
+// データベースファイルを閉じる
+// ページャとテーブルのデータ構造のためのメモリを解放
+//
+void db_close(Table* table) {
+	Pager* pager = table->pager;
+	// 文が持っているカーソルとスナップショットを手放す
+	statement_cache_clear(&table->statement_cache);
+	// 終わっていないトランザクションは捨てる
+	if (table->in_transaction) {
+		table->in_transaction = false;
+		pager_rollback(pager);
+		pthread_mutex_unlock(&table->write_mutex);
+	}
+
+	// 残っている変更をコミットし、WALの内容をデータベースファイルに戻す
+	pager_commit(pager);
+	wal_close(pager->wal, pager->file_descriptor, pager->page_map);
+
+	if (pager->use_mmap) {
+		munmap(pager->map, pager->map_size);
+		free(pager->map_dirty);
+	}
+	if (pager->page_map != NULL) {
+		// .vacuum で空いたページの置き場所を捨て、ファイルを最後に使っている区画までにする
+		if (pager->page_map->num_pages > pager->num_pages) {
+			page_map_truncate(pager->page_map, pager->num_pages);
+			page_map_sync(pager->page_map);
+		}
+		page_map_compact(pager->page_map);
+		page_map_close(pager->page_map);
+	} else if (ftruncate(pager->file_descriptor, (off_t)pager->num_pages * PAGE_SIZE) == -1) {
+		// mmapモードで伸ばしすぎた分や、.vacuum で空いた分を切り詰める
+		printf("Error truncating db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	// データベースファイルを閉じる
+	int result = close(pager->file_descriptor);
+	if (result == -1) {
+		printf("Error closing db file.\n");
+		exit(EXIT_FAILURE);
+	}
+	free(pager->frame_data);
+	free(pager->frames);
+	free(pager->buckets);
+	free(pager->dirty_pages);
+	// スナップショットはもうないので、残っている版は全て捨てる
+	for (uint32_t i = 0; i < PAGER_NUM_LATCHES; i++) {
+		PageVersion* version = pager->latches[i].versions;
+		while (version != NULL) {
+			PageVersion* next = version->next;
+			free(version);
+			version = next;
+		}
+		pthread_rwlock_destroy(&pager->latches[i].lock);
+	}
+	free(pager->latches);
+	pthread_mutex_destroy(&pager->mutex);
+	pthread_cond_destroy(&pager->loaded);
+	pthread_rwlock_destroy(&pager->io_lock);
+	pthread_mutex_destroy(&pager->snapshot_mutex);
+	free(pager);
+	pthread_rwlock_destroy(&table->tree_latch);
+	pthread_mutex_destroy(&table->write_mutex);
+	free(table);
+}
+
+// データベースのサイズを保存し、バッファプールを初期化する
+// mmapモードではバッファプールの代わりにファイルをマップする
+//
+static Pager* pager_open(const char* filename, PagerOptions* options) {
+	int fd = open(filename,
+				O_RDWR | O_CREAT,
+				S_IWUSR | S_IRUSR
+			);
+	if (fd == -1) {
+		printf("Unable to open file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// 圧縮したファイルか、空のファイルを圧縮モードで作る時はページマップを読む
+	PageMap* page_map = page_map_open(fd, options->codec);
+	if (page_map != NULL && options->use_mmap) {
+		printf("--mmap can't be used with a compressed database.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// 前回コミットされたままWALに残っている変更を先に戻しておく
+	Wal* wal = wal_open(filename, fd, page_map);
+
+	// fdの終わりまでポインタを移動する
+	off_t file_length = lseek(fd, 0, SEEK_END);
+	if (page_map != NULL) {
+		file_length = (off_t)page_map->num_pages * PAGE_SIZE;
+	}
+
+	Pager* pager = malloc(sizeof(Pager));
+	pager->file_descriptor = fd;
+	pager->page_map = page_map;
+	pager->wal = wal;
+	pager->num_dirty_pages = 0;
+	pager->dirty_pages_capacity = 64;
+	pager->dirty_pages = malloc(pager->dirty_pages_capacity * sizeof(uint32_t));
+	pager->file_length = file_length;
+	pager->num_pages = (file_length / PAGE_SIZE);
+	pager->committed_num_pages = pager->num_pages;
+
+	if (file_length % PAGE_SIZE != 0) {
+		printf("DB file is not a whole number of pages. Corrupt file. \n");
+		exit(EXIT_FAILURE);
+	}
+
+	pager->use_mmap = options->use_mmap;
+	pager->map = NULL;
+	pager->map_size = 0;
+	pager->map_dirty = NULL;
+	pager->map_dirty_size = 0;
+
+	uint32_t num_frames = options->num_frames;
+	if (pager->use_mmap) {
+		pager_map_file(pager);
+		num_frames = 0;
+	} else if (num_frames < PAGER_MIN_NUM_FRAMES) {
+		num_frames = PAGER_MIN_NUM_FRAMES;
+	}
+	pager->num_frames = num_frames;
+	pager->frame_data = malloc((size_t)num_frames * PAGE_SIZE);
+	pager->frames = malloc(num_frames * sizeof(Frame));
+	pager->clock_hand = 0;
+	for (uint32_t i = 0; i < num_frames; i++) {
+		pager->frames[i].page_num = INVALID_PAGE_NUM;
+		pager->frames[i].pin_count = 0;
+		pager->frames[i].usage_count = 0;
+		pager->frames[i].dirty = false;
+		pager->frames[i].next_in_bucket = INVALID_FRAME_NUM;
+		pager->frames[i].loading = false;
+	}
+	pthread_mutex_init(&pager->mutex, NULL);
+	pthread_cond_init(&pager->loaded, NULL);
+	pthread_rwlock_init(&pager->io_lock, NULL);
+	pager->latches = aligned_alloc(CACHE_LINE_SIZE, PAGER_NUM_LATCHES * sizeof(PageLatch));
+	for (uint32_t i = 0; i < PAGER_NUM_LATCHES; i++) {
+		pthread_rwlock_init(&pager->latches[i].lock, NULL);
+		pager->latches[i].versions = NULL;
+	}
+	pager->commit_seq = 0;
+	pager->assigned_seq = 0;
+	pager->snapshots_head = NULL;
+	pager->snapshots_tail = NULL;
+	pthread_mutex_init(&pager->snapshot_mutex, NULL);
+	pager->pending_versions = NULL;
+	pager->committed_versions_head = NULL;
+	pager->committed_versions_tail = NULL;
+	pager->exclusive = false;
+	memset(&pager->stats, 0, sizeof(DbStats));
+
+	// バケット数はフレーム数の2倍以上の2のべき乗
+	pager->num_buckets = 1;
+	while (pager->num_buckets < num_frames * 2) {
+		pager->num_buckets <<= 1;
+	}
+	pager->buckets = malloc(pager->num_buckets * sizeof(uint32_t));
+	for (uint32_t i = 0; i < pager->num_buckets; i++) {
+		pager->buckets[i] = INVALID_FRAME_NUM;
+	}
+
+	return pager;
+}
+
+// 予約した仮想アドレス領域全体にファイルをマップする
+// ファイルの終端より後ろは、ftruncateで伸ばすとそのままアクセスできるようになる
+static void pager_map_file(Pager* pager) {
+	pager->map_size = PAGER_MMAP_RESERVE_SIZE;
+	if ((size_t)pager->file_length * 2 > pager->map_size) {
+		pager->map_size = (size_t)pager->file_length * 2;
+	}
+	// 書き込みはWALを通してファイルに反映するので、マップ自体はプライベートにする
+	pager->map = mmap(NULL, pager->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE,
+	                  pager->file_descriptor, 0);
+	if (pager->map == MAP_FAILED) {
+		printf("Error mapping db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	// 木の探索はランダムアクセスなので、カーネルの先読みは止めて
+	// 代わりにファイルの先頭部分をまとめて読み込んでおく
+	madvise(pager->map, pager->map_size, MADV_RANDOM);
+	if (pager->file_length > 0) {
+		size_t willneed = pager->file_length;
+		if (willneed > PAGER_MMAP_WILLNEED_SIZE) {
+			willneed = PAGER_MMAP_WILLNEED_SIZE;
+		}
+		madvise(pager->map, willneed, MADV_WILLNEED);
+	}
+}
+
+// マップ領域内のページへのポインタを返す。ファイルが足りなければ伸ばす
+// 読み手は既にあるページしか読まないので、ファイルを伸ばす書き手だけがロックを取る
+static void* pager_map_page(Pager* pager, uint32_t page_num) {
+	if (page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)) {
+		return pager->map + (size_t)page_num * PAGE_SIZE;
+	}
+
+	pthread_mutex_lock(&pager->mutex);
+	off_t required_length = ((off_t)page_num + 1) * PAGE_SIZE;
+	if (required_length > (off_t)pager->map_size) {
+		printf("Tried to fetch page number beyond the mapped region. %d\n", page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	if (required_length > pager->file_length) {
+		off_t new_length = required_length + (off_t)(PAGER_MMAP_GROW_PAGES - 1) * PAGE_SIZE;
+		if (new_length > (off_t)pager->map_size) {
+			new_length = pager->map_size;
+		}
+		if (ftruncate(pager->file_descriptor, new_length) == -1) {
+			printf("Error extending db file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		pager->file_length = new_length;
+	}
+
+	if (page_num >= pager->num_pages) {
+		__atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pager->mutex);
+
+	return pager->map + (size_t)page_num * PAGE_SIZE;
+}
+
+static void* frame_page(Pager* pager, uint32_t frame_num) {
+	return pager->frame_data + (size_t)frame_num * PAGE_SIZE;
+}
+
+static uint32_t page_bucket(Pager* pager, uint32_t page_num) {
+	// Knuthの乗算ハッシュ
+	return (page_num * 2654435761u) & (pager->num_buckets - 1);
+}
+
+// ページがバッファプールに載っていればそのフレーム番号を返す
+static uint32_t pager_lookup_frame(Pager* pager, uint32_t page_num) {
+	uint32_t frame_num = pager->buckets[page_bucket(pager, page_num)];
+	while (frame_num != INVALID_FRAME_NUM) {
+		if (pager->frames[frame_num].page_num == page_num) {
+			return frame_num;
+		}
+		frame_num = pager->frames[frame_num].next_in_bucket;
+	}
+	return INVALID_FRAME_NUM;
+}
+
+static void pager_remove_from_bucket(Pager* pager, uint32_t frame_num) {
+	uint32_t* link = &pager->buckets[page_bucket(pager, pager->frames[frame_num].page_num)];
+	while (*link != frame_num) {
+		link = &pager->frames[*link].next_in_bucket;
+	}
+	*link = pager->frames[frame_num].next_in_bucket;
+	pager->frames[frame_num].next_in_bucket = INVALID_FRAME_NUM;
+}
+
+// CLOCK(GCLOCK)で追い出すフレームを選ぶ
+// ピンされていないフレームは針が通るたびに使用回数が1ずつ減り、0になったものが選ばれる
+static uint32_t pager_find_victim(Pager* pager) {
+	uint32_t max_steps = pager->num_frames * (FRAME_MAX_USAGE_COUNT + 1);
+	for (uint32_t step = 0; step < max_steps; step++) {
+		uint32_t frame_num = pager->clock_hand;
+		pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+		Frame* frame = &pager->frames[frame_num];
+		if (frame->pin_count > 0) {
+			continue;
+		}
+		if (frame->usage_count > 0) {
+			frame->usage_count -= 1;
+			continue;
+		}
+		return frame_num;
+	}
+
+	printf("Buffer pool exhausted: all %d frames are pinned.\n", pager->num_frames);
+	exit(EXIT_FAILURE);
+}
+
+// ページをピンして返す。呼び出し側は使い終わったら unpin_page する
+// ファイルやWALから読む間はページテーブルのロックを放し、他のスレッドのヒットを止めない
+static void* get_page(Pager* pager, uint32_t page_num) {
+	if (pager->use_mmap) {
+		return pager_map_page(pager, page_num);
+	}
+
+	pthread_mutex_lock(&pager->mutex);
+	uint32_t frame_num = pager_lookup_frame(pager, page_num);
+
+	// キャッシュミス対応。空いているフレームを確保する。
+	if (frame_num == INVALID_FRAME_NUM) {
+		stats_add(&pager->stats.page_misses, 1);
+		frame_num = pager_find_victim(pager);
+		Frame* victim = &pager->frames[frame_num];
+		if (victim->page_num != INVALID_PAGE_NUM) {
+			// 変更されていれば書き戻してから再利用する
+			pager_write_frame(pager, frame_num);
+			pager_remove_from_bucket(pager, frame_num);
+		}
+
+		// 先にページテーブルに載せておき、同じページを取りに来たスレッドは読み込みを待たせる
+		victim->page_num = page_num;
+		victim->pin_count = 1;
+		victim->usage_count = 1;
+		victim->dirty = false;
+		victim->loading = true;
+		uint32_t bucket = page_bucket(pager, page_num);
+		victim->next_in_bucket = pager->buckets[bucket];
+		pager->buckets[bucket] = frame_num;
+
+		if (page_num >= pager->num_pages) {
+			pager->num_pages = page_num + 1;
+		}
+		pthread_mutex_unlock(&pager->mutex);
+
+		// 読んでいる間にチェックポイントがWALを空にしないようにする
+		pthread_rwlock_rdlock(&pager->io_lock);
+		uint32_t num_pages = pager->file_length / PAGE_SIZE;
+
+		// PAGE_SIZEに収まり切らない時に、部分的にキャッシュを保存させる必要がある
+		if (pager->file_length % PAGE_SIZE) {
+			num_pages += 1;
+		}
+
+		// ページ*4096の位置から PAGE_SIZE 分読む
+		// チェックポイントされていない最新の内容はWALから読む
+		void* page = frame_page(pager, frame_num);
+		memset(page, 0, PAGE_SIZE);
+		off_t wal_offset = wal_lookup(pager->wal, page_num);
+		if (wal_offset != 0) {
+			if (pread(pager->wal->file_descriptor, page, PAGE_SIZE, wal_offset) != PAGE_SIZE) {
+				printf("Error reading WAL: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+		} else if (page_num < num_pages && pager->page_map != NULL) {
+			// 圧縮モードではページマップで置き場所を引いて展開する
+			if (!page_map_read(pager->page_map, page_num, page)) {
+				printf("Error reading page %d: bad compressed extent\n", page_num);
+				exit(EXIT_FAILURE);
+			}
+		} else if (page_num < num_pages) {
+			// ファイルの長さはページ単位なので、足りなければファイルが外から切り詰められている
+			ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
+			if (bytes_read == -1) {
+				printf("Error reading file: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			if (bytes_read != PAGE_SIZE) {
+				printf("Error reading page %d: short read of %zd bytes\n", page_num, bytes_read);
+				exit(EXIT_FAILURE);
+			}
+		}
+		pthread_rwlock_unlock(&pager->io_lock);
+		if (wal_offset != 0 || page_num < num_pages) {
+			stats_add(&pager->stats.pages_read, 1);
+			if (!page_checksum_valid(page)) {
+				printf("Error: page %d is corrupt (checksum mismatch)\n", page_num);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		pthread_mutex_lock(&pager->mutex);
+		victim->loading = false;
+		pthread_cond_broadcast(&pager->loaded);
+		pthread_mutex_unlock(&pager->mutex);
+		return page;
+	}
+
+	stats_add(&pager->stats.page_hits, 1);
+	Frame* frame = &pager->frames[frame_num];
+	frame->pin_count += 1;
+	if (frame->usage_count < FRAME_MAX_USAGE_COUNT) {
+		frame->usage_count += 1;
+	}
+	while (frame->loading) {
+		pthread_cond_wait(&pager->loaded, &pager->mutex);
+	}
+	pthread_mutex_unlock(&pager->mutex);
+
+	return frame_page(pager, frame_num);
+}
+
+static void unpin_page(Pager* pager, uint32_t page_num) {
+	if (pager->use_mmap) {
+		return;
+	}
+	pthread_mutex_lock(&pager->mutex);
+	uint32_t frame_num = pager_lookup_frame(pager, page_num);
+	if (frame_num == INVALID_FRAME_NUM || pager->frames[frame_num].pin_count == 0) {
+		printf("Tried to unpin page %d which is not pinned\n", page_num);
+		exit(EXIT_FAILURE);
+	}
+	pager->frames[frame_num].pin_count -= 1;
+	pthread_mutex_unlock(&pager->mutex);
+}
+
+static PageLatch* page_latch(Pager* pager, uint32_t page_num) {
+	return &pager->latches[page_num & (PAGER_NUM_LATCHES - 1)];
+}
+
+// ページを初めて変更する前に、変更前の内容を版として残す
+// このトランザクションで既に残していれば何もしない
+// 版の一覧を変えるのは書き手だけなので、書き手はラッチせずにたどれる
+static void pager_save_version(Pager* pager, uint32_t page_num, const void* page) {
+	PageLatch* latch = page_latch(pager, page_num);
+	for (PageVersion* version = latch->versions; version != NULL; version = version->next) {
+		if (version->page_num == page_num) {
+			if (version->end_seq == VERSION_PENDING) {
+				return;
+			}
+			break;
+		}
+	}
+
+	PageVersion* version = malloc(sizeof(PageVersion) + PAGE_SIZE);
+	version->page_num = page_num;
+	version->end_seq = VERSION_PENDING;
+	memcpy(version->data, page, PAGE_SIZE);
+	version->next_in_list = pager->pending_versions;
+	pager->pending_versions = version;
+
+	// 読み手がこのページを読み終えるのを待ってから載せる。この後は読み手は版の方を読む
+	pthread_rwlock_wrlock(&latch->lock);
+	version->next = latch->versions;
+	latch->versions = version;
+	pthread_rwlock_unlock(&latch->lock);
+}
+
+// コミットしたトランザクションの版に番号を付け、
+// どのスナップショットからも読まれなくなった版を古いものから解放する
+// 番号は永続化してから pager_commit_finish で見せる。それまでのスナップショットは版の方を読む
+static uint64_t pager_commit_versions(Pager* pager) {
+	uint64_t seq = pager->assigned_seq + 1;
+	pager->assigned_seq = seq;
+	PageVersion* version = pager->pending_versions;
+	while (version != NULL) {
+		PageVersion* next = version->next_in_list;
+		__atomic_store_n(&version->end_seq, seq, __ATOMIC_RELEASE);
+		version->next_in_list = NULL;
+		if (pager->committed_versions_tail == NULL) {
+			pager->committed_versions_head = version;
+		} else {
+			pager->committed_versions_tail->next_in_list = version;
+		}
+		pager->committed_versions_tail = version;
+		version = next;
+	}
+	pager->pending_versions = NULL;
+
+	pthread_mutex_lock(&pager->snapshot_mutex);
+	uint64_t oldest_seq = pager->snapshots_head == NULL ? pager->commit_seq : pager->snapshots_head->seq;
+	pthread_mutex_unlock(&pager->snapshot_mutex);
+
+	while (pager->committed_versions_head != NULL &&
+	       pager->committed_versions_head->end_seq <= oldest_seq) {
+		version = pager->committed_versions_head;
+		pager->committed_versions_head = version->next_in_list;
+		if (pager->committed_versions_head == NULL) {
+			pager->committed_versions_tail = NULL;
+		}
+		pager_free_version(pager, version);
+	}
+	return seq;
+}
+
+static void pager_free_version(Pager* pager, PageVersion* version) {
+	PageLatch* latch = page_latch(pager, version->page_num);
+	pthread_rwlock_wrlock(&latch->lock);
+	PageVersion** link = &latch->versions;
+	while (*link != version) {
+		link = &(*link)->next;
+	}
+	*link = version->next;
+	pthread_rwlock_unlock(&latch->lock);
+	free(version);
+}
+
+// 今コミットされている時点のスナップショットを取る。snapshot_release するまで、その時点の版は残る
+static void snapshot_acquire(Pager* pager, Snapshot* snapshot) {
+	pthread_mutex_lock(&pager->snapshot_mutex);
+	snapshot->seq = pager->commit_seq;
+	snapshot->next = NULL;
+	snapshot->prev = pager->snapshots_tail;
+	if (pager->snapshots_tail == NULL) {
+		pager->snapshots_head = snapshot;
+	} else {
+		pager->snapshots_tail->next = snapshot;
+	}
+	pager->snapshots_tail = snapshot;
+	pthread_mutex_unlock(&pager->snapshot_mutex);
+}
+
+// 要らなくなった版は、次に書き手がコミットした時に解放される
+static void snapshot_release(Pager* pager, Snapshot* snapshot) {
+	pthread_mutex_lock(&pager->snapshot_mutex);
+	if (snapshot->prev == NULL) {
+		pager->snapshots_head = snapshot->next;
+	} else {
+		snapshot->prev->next = snapshot->next;
+	}
+	if (snapshot->next == NULL) {
+		pager->snapshots_tail = snapshot->prev;
+	} else {
+		snapshot->next->prev = snapshot->prev;
+	}
+	pthread_mutex_unlock(&pager->snapshot_mutex);
+}
+
+// スナップショットの時点のページの内容を destination にコピーする
+// スナップショットより後に置き換えられていれば、置き換えられた版のうち最も古いものを読む
+static void snapshot_read_page(Pager* pager, Snapshot* snapshot, uint32_t page_num, void* destination) {
+	PageLatch* latch = page_latch(pager, page_num);
+	pthread_rwlock_rdlock(&latch->lock);
+	PageVersion* found = NULL;
+	for (PageVersion* version = latch->versions; version != NULL; version = version->next) {
+		if (version->page_num != page_num) {
+			continue;
+		}
+		// 版は新しい順に並んでいる
+		if (__atomic_load_n(&version->end_seq, __ATOMIC_ACQUIRE) <= snapshot->seq) {
+			break;
+		}
+		found = version;
+	}
+	if (found != NULL) {
+		memcpy(destination, found->data, PAGE_SIZE);
+	} else {
+		memcpy(destination, get_page(pager, page_num), PAGE_SIZE);
+		unpin_page(pager, page_num);
+	}
+	pthread_rwlock_unlock(&latch->lock);
+}
+
+// これから読むページをカーネルに先読みさせる。読み込みを待たずに戻る
+// 連続したページ番号は1回の要求にまとめる
+static void pager_prefetch(Pager* pager, const uint32_t* page_nums, uint32_t num_page_nums) {
+	if (!pager->use_mmap) {
+		pthread_mutex_lock(&pager->mutex);
+	}
+	uint32_t i = 0;
+	while (i < num_page_nums) {
+		uint32_t page_num = page_nums[i];
+		if (pager->use_mmap) {
+			// マッピング全体は MADV_RANDOM なので、カーネルは自分では先読みしない
+			if (page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)) {
+				madvise(pager->map + (size_t)page_num * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+			}
+			i++;
+			continue;
+		}
+		if (pager_lookup_frame(pager, page_num) != INVALID_FRAME_NUM) {
+			i++;
+			continue;
+		}
+		off_t wal_offset = wal_lookup(pager->wal, page_num);
+		if (wal_offset != 0) {
+			posix_fadvise(pager->wal->file_descriptor, wal_offset, PAGE_SIZE, POSIX_FADV_WILLNEED);
+			i++;
+			continue;
+		}
+
+		if (pager->page_map != NULL) {
+			// 圧縮モードではページの置き場所がページ番号の順に並んでいない
+			i++;
+			continue;
+		}
+
+		uint32_t run = 1;
+		while (i + run < num_page_nums && page_nums[i + run] == page_num + run &&
+		       pager_lookup_frame(pager, page_num + run) == INVALID_FRAME_NUM &&
+		       wal_lookup(pager->wal, page_num + run) == 0) {
+			run++;
+		}
+		posix_fadvise(pager->file_descriptor, (off_t)page_num * PAGE_SIZE, (off_t)run * PAGE_SIZE,
+		              POSIX_FADV_WILLNEED);
+		i += run;
+	}
+	if (!pager->use_mmap) {
+		pthread_mutex_unlock(&pager->mutex);
+	}
+}
+
+// ページを変更する前に呼ぶ。ダーティなフレームだけが書き戻される
+// 読み手のために、このトランザクションで初めて変更するページは変更前の内容を残す
+static void mark_page_dirty(Pager* pager, uint32_t page_num) {
+	void* page;
+	if (pager->use_mmap) {
+		size_t byte = page_num / 8;
+		if (byte >= pager->map_dirty_size) {
+			size_t new_size = (byte + 1) * 2;
+			pager->map_dirty = realloc(pager->map_dirty, new_size);
+			memset(pager->map_dirty + pager->map_dirty_size, 0, new_size - pager->map_dirty_size);
+			pager->map_dirty_size = new_size;
+		}
+		if (!(pager->map_dirty[byte] & (1 << (page_num % 8)))) {
+			pager->map_dirty[byte] |= 1 << (page_num % 8);
+			pager_add_dirty_page(pager, page_num);
+		}
+		page = pager->map + (size_t)page_num * PAGE_SIZE;
+	} else {
+		pthread_mutex_lock(&pager->mutex);
+		uint32_t frame_num = pager_lookup_frame(pager, page_num);
+		if (frame_num == INVALID_FRAME_NUM || pager->frames[frame_num].pin_count == 0) {
+			printf("Tried to dirty page %d which is not pinned\n", page_num);
+			exit(EXIT_FAILURE);
+		}
+		if (!pager->frames[frame_num].dirty) {
+			pager->frames[frame_num].dirty = true;
+			pager_add_dirty_page(pager, page_num);
+		}
+		page = frame_page(pager, frame_num);
+		pthread_mutex_unlock(&pager->mutex);
+	}
+
+	if (!pager->exclusive) {
+		pager_save_version(pager, page_num, page);
+	}
+}
+
+static void pager_add_dirty_page(Pager* pager, uint32_t page_num) {
+	if (pager->num_dirty_pages == pager->dirty_pages_capacity) {
+		pager->dirty_pages_capacity *= 2;
+		pager->dirty_pages = realloc(pager->dirty_pages,
+		                             pager->dirty_pages_capacity * sizeof(uint32_t));
+	}
+	pager->dirty_pages[pager->num_dirty_pages++] = page_num;
+}
+
+// ダーティなフレームをWALに書き出す
+// コミット前に追い出される場合は、未確定のレコードとして書かれる
+static void pager_write_frame(Pager* pager, uint32_t frame_num) {
+	Frame* frame = &pager->frames[frame_num];
+	if (!frame->dirty) {
+		return;
+	}
+
+	wal_append_page(pager->wal, frame->page_num, frame_page(pager, frame_num));
+	frame->dirty = false;
+}
+
+// ページの変更をWALに書き出す
+static void pager_flush(Pager* pager, uint32_t page_num) {
+	if (pager->use_mmap) {
+		size_t byte = page_num / 8;
+		if (byte < pager->map_dirty_size && (pager->map_dirty[byte] & (1 << (page_num % 8)))) {
+			wal_append_page(pager->wal, page_num, pager->map + (size_t)page_num * PAGE_SIZE);
+			pager->map_dirty[byte] &= ~(1 << (page_num % 8));
+			stats_record_flush(pager);
+		}
+		return;
+	}
+
+	// 書いている間もフレームが追い出されないようにピンしておく
+	pthread_mutex_lock(&pager->mutex);
+	uint32_t frame_num = pager_lookup_frame(pager, page_num);
+	if (frame_num == INVALID_FRAME_NUM || !pager->frames[frame_num].dirty) {
+		// 既に追い出されていれば、変更はWALに書かれている
+		pthread_mutex_unlock(&pager->mutex);
+		return;
+	}
+	Frame* frame = &pager->frames[frame_num];
+	frame->dirty = false;
+	frame->pin_count += 1;
+	pthread_mutex_unlock(&pager->mutex);
+
+	wal_append_page(pager->wal, page_num, frame_page(pager, frame_num));
+	stats_record_flush(pager);
+
+	pthread_mutex_lock(&pager->mutex);
+	frame->pin_count -= 1;
+	pthread_mutex_unlock(&pager->mutex);
+}
+
+// トランザクションで変更したページとコミットレコードをWALに追記し、永続化を待つ
+// ページはデータベースファイルではなくWALに順番に書かれる
+static void pager_commit(Pager* pager) {
+	PagerCommit commit;
+	pager_commit_append(pager, &commit);
+	pager_commit_finish(pager, &commit);
+}
+
+// 書き手を1つにするロックを持って呼び、コミットレコードまでをWALに追記する
+// 永続化は pager_commit_finish でロックを放してから待つので、その間に次の書き手が追記できる
+static void pager_commit_append(Pager* pager, PagerCommit* commit) {
+	pager->committed_num_pages = pager->num_pages;
+	commit->wal_position = 0;
+	if (pager->num_dirty_pages == 0) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < pager->num_dirty_pages; i++) {
+		pager_flush(pager, pager->dirty_pages[i]);
+	}
+	commit->wal_position = wal_append_commit(pager->wal, pager->num_pages,
+	                                         pager->dirty_pages, pager->num_dirty_pages);
+	pager->num_dirty_pages = 0;
+	commit->seq = pager_commit_versions(pager);
+}
+
+// コミットが永続化されるのを待ち、それから新しいスナップショットに変更を見せる
+// 同期を待つ間に後の書き手が先に見せていることがあるので、番号は大きい方を残す
+static void pager_commit_finish(Pager* pager, PagerCommit* commit) {
+	if (commit->wal_position == 0) {
+		return;
+	}
+	wal_sync(pager->wal, commit->wal_position);
+	pthread_mutex_lock(&pager->snapshot_mutex);
+	if (commit->seq > pager->commit_seq) {
+		pager->commit_seq = commit->seq;
+	}
+	pthread_mutex_unlock(&pager->snapshot_mutex);
+	commit->wal_position = 0;
+}
+
+// 今のトランザクションの変更を捨てる
+// 変更したページは版に残した変更前の内容に戻し、追い出されてWALに書かれた分はWALごと巻き戻す
+// 読み手は版が外れるまで版の方を読むので、戻している途中の内容は見えない
+// 戻したページは追い出されてもWALに書かれないので、WALを巻き戻してから版を外す
+static void pager_rollback(Pager* pager) {
+	for (PageVersion* version = pager->pending_versions; version != NULL; version = version->next_in_list) {
+		uint32_t page_num = version->page_num;
+		if (pager->use_mmap) {
+			memcpy(pager->map + (size_t)page_num * PAGE_SIZE, version->data, PAGE_SIZE);
+			pager->map_dirty[page_num / 8] &= ~(1 << (page_num % 8));
+		} else {
+			// キャッシュにあればその場で戻す。追い出されていれば、次はWALかファイルから元の内容を読む
+			pthread_mutex_lock(&pager->mutex);
+			uint32_t frame_num = pager_lookup_frame(pager, page_num);
+			if (frame_num != INVALID_FRAME_NUM) {
+				memcpy(frame_page(pager, frame_num), version->data, PAGE_SIZE);
+				pager->frames[frame_num].dirty = false;
+			}
+			pthread_mutex_unlock(&pager->mutex);
+		}
+	}
+	pager->num_dirty_pages = 0;
+	wal_rollback(pager->wal);
+
+	PageVersion* version = pager->pending_versions;
+	while (version != NULL) {
+		PageVersion* next = version->next_in_list;
+		pager_free_version(pager, version);
+		version = next;
+	}
+	pager->pending_versions = NULL;
+	if (pager->num_pages > pager->committed_num_pages) {
+		pager_truncate(pager, pager->committed_num_pages);
+	}
+}
+
+// コミットレコードを追記し、WALが伸びていれば永続化を待ってチェックポイントする
+// 呼び出し側は write_mutex を放してから pager_commit_finish で永続化を待つ
+static void table_commit(Table* table, PagerCommit* commit) {
+	Pager* pager = table->pager;
+	pager_commit_append(pager, commit);
+	if (wal_needs_checkpoint(pager->wal)) {
+		pager_commit_finish(pager, commit);
+		pager_checkpoint(pager);
+	}
+}
+
+// チェックポイントはWALの索引を空にするので、読み込み中のページがあれば待つ
+static void pager_checkpoint(Pager* pager) {
+	pthread_rwlock_wrlock(&pager->io_lock);
+	wal_checkpoint(pager->wal, pager->file_descriptor, pager->page_map);
+
+	if (pager->page_map != NULL) {
+		// 切り詰めたページは置き場所ごと捨てる
+		if (pager->page_map->num_pages > pager->num_pages) {
+			page_map_truncate(pager->page_map, pager->num_pages);
+			page_map_sync(pager->page_map);
+		}
+		pager->file_length = (off_t)pager->page_map->num_pages * PAGE_SIZE;
+		pthread_rwlock_unlock(&pager->io_lock);
+		return;
+	}
+
+	struct stat file_stat;
+	fstat(pager->file_descriptor, &file_stat);
+	off_t db_length = (off_t)pager->num_pages * PAGE_SIZE;
+	if (!pager->use_mmap && file_stat.st_size > db_length) {
+		// 切り詰めたページがチェックポイントで書き戻されていても、ここで捨てる
+		if (ftruncate(pager->file_descriptor, db_length) == -1) {
+			printf("Error truncating db file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		file_stat.st_size = db_length;
+		pager->file_length = db_length;
+	}
+	if (file_stat.st_size > pager->file_length) {
+		pager->file_length = file_stat.st_size;
+	}
+	if (pager->use_mmap) {
+		// ファイルに反映し終えたプライベートなコピーを捨てて、ページキャッシュを共有する
+		madvise(pager->map, (size_t)pager->num_pages * PAGE_SIZE, MADV_DONTNEED);
+	}
+	pthread_rwlock_unlock(&pager->io_lock);
+}
+
+// num_pages 以降のページを捨てる。ファイル自体は次のチェックポイントか終了時に切り詰める
+static void pager_truncate(Pager* pager, uint32_t num_pages) {
+	if (pager->use_mmap) {
+		if (pager->num_pages > num_pages) {
+			madvise(pager->map + (size_t)num_pages * PAGE_SIZE,
+			        (size_t)(pager->num_pages - num_pages) * PAGE_SIZE, MADV_DONTNEED);
+		}
+		for (uint32_t page_num = num_pages; page_num < pager->num_pages; page_num++) {
+			size_t byte = page_num / 8;
+			if (byte < pager->map_dirty_size) {
+				pager->map_dirty[byte] &= ~(1 << (page_num % 8));
+			}
+		}
+		__atomic_store_n(&pager->num_pages, num_pages, __ATOMIC_RELEASE);
+	} else {
+		pthread_mutex_lock(&pager->mutex);
+		for (uint32_t frame_num = 0; frame_num < pager->num_frames; frame_num++) {
+			Frame* frame = &pager->frames[frame_num];
+			if (frame->page_num == INVALID_PAGE_NUM || frame->page_num < num_pages) {
+				continue;
+			}
+			if (frame->pin_count > 0) {
+				printf("Tried to truncate page %d which is pinned\n", frame->page_num);
+				exit(EXIT_FAILURE);
+			}
+			pager_remove_from_bucket(pager, frame_num);
+			frame->page_num = INVALID_PAGE_NUM;
+			frame->dirty = false;
+			frame->usage_count = 0;
+		}
+		pager->num_pages = num_pages;
+		pthread_mutex_unlock(&pager->mutex);
+	}
+}
+
+/* Write-Ahead Log */
+
+// 古い値のまま続くチェックサムを計算する(SQLiteのWALと同じ方式)
+// checksum には直前のレコードのチェックサムを渡し、結果で上書きされる
+static void wal_checksum(const void* data, uint32_t size, uint32_t* checksum) {
+	const uint32_t* words = data;
+	uint32_t s1 = checksum[0];
+	uint32_t s2 = checksum[1];
+	for (uint32_t i = 0; i < size / sizeof(uint32_t); i += 2) {
+		s1 += words[i] + s2;
+		s2 += words[i + 1] + s1;
+	}
+	checksum[0] = s1;
+	checksum[1] = s2;
+}
+
+// CRC32C(Castagnoli)をテーブルで1バイトずつ計算する。CPUの命令が使えない時だけ使う
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (uint32_t bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+		}
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t* data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+// -msse4.2 を付けずにビルドしても、CPUが対応していれば crc32 命令を使う
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data,
+                                                                  size_t size) {
+	uint64_t crc64 = crc;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	for (; i < size; i++) {
+		crc = _mm_crc32_u8(crc, data[i]);
+	}
+	return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* data, size_t size) {
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+	for (; i < size; i++) {
+		crc = __crc32cb(crc, data[i]);
+	}
+	return crc;
+}
+#endif
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t* data, size_t size);
+
+static void crc32c_init(void) {
+	crc32c_update = crc32c_software;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_update = crc32c_hardware;
+	}
+#elif defined(__ARM_FEATURE_CRC32)
+	crc32c_update = crc32c_hardware;
+#endif
+	if (crc32c_update == crc32c_software) {
+		crc32c_init_table();
+	}
+}
+
+// チェックサムの欄を除いたページの CRC32C
+static uint32_t page_checksum(const void* page) {
+	pthread_once(&crc32c_once, crc32c_init);
+	const uint8_t* data = (const uint8_t*)page + PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+	return ~crc32c_update(~0U, data, PAGE_SIZE - PAGE_CHECKSUM_OFFSET - PAGE_CHECKSUM_SIZE);
+}
+
+static void page_stamp_checksum(void* page) {
+	uint32_t checksum = page_checksum(page);
+	memcpy((uint8_t*)page + PAGE_CHECKSUM_OFFSET, &checksum, PAGE_CHECKSUM_SIZE);
+}
+
+// 書かれたことのないページ(全てゼロ)も正しいとみなす
+static bool page_checksum_valid(const void* page) {
+	uint32_t checksum;
+	memcpy(&checksum, (const uint8_t*)page + PAGE_CHECKSUM_OFFSET, PAGE_CHECKSUM_SIZE);
+	if (checksum == page_checksum(page)) {
+		return true;
+	}
+	const uint8_t* bytes = page;
+	for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+		if (bytes[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint32_t wal_index_slot(WalIndex* index, uint32_t page_num) {
+	return (page_num * 2654435761u) & (index->capacity - 1);
+}
+
+static WalIndexEntry* wal_index_find(WalIndex* index, uint32_t page_num) {
+	uint32_t slot = wal_index_slot(index, page_num);
+	while (index->entries[slot].page_num != INVALID_PAGE_NUM) {
+		if (index->entries[slot].page_num == page_num) {
+			return &index->entries[slot];
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	return NULL;
+}
+
+static void wal_index_reset(WalIndex* index, uint32_t capacity) {
+	free(index->entries);
+	index->capacity = capacity;
+	index->count = 0;
+	index->entries = malloc(capacity * sizeof(WalIndexEntry));
+	for (uint32_t i = 0; i < capacity; i++) {
+		index->entries[i].page_num = INVALID_PAGE_NUM;
+	}
+}
+
+// ページの最新レコードの位置を記録する。使用率が半分を超えたら表を広げる
+static WalIndexEntry* wal_index_insert(WalIndex* index, uint32_t page_num) {
+	WalIndexEntry* entry = wal_index_find(index, page_num);
+	if (entry != NULL) {
+		return entry;
+	}
+
+	if ((index->count + 1) * 2 > index->capacity) {
+		WalIndexEntry* old_entries = index->entries;
+		uint32_t old_capacity = index->capacity;
+		index->entries = NULL;
+		wal_index_reset(index, old_capacity * 2);
+		for (uint32_t i = 0; i < old_capacity; i++) {
+			if (old_entries[i].page_num != INVALID_PAGE_NUM) {
+				*wal_index_insert(index, old_entries[i].page_num) = old_entries[i];
+			}
+		}
+		free(old_entries);
+	}
+
+	uint32_t slot = wal_index_slot(index, page_num);
+	while (index->entries[slot].page_num != INVALID_PAGE_NUM) {
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	index->count += 1;
+	entry = &index->entries[slot];
+	entry->page_num = page_num;
+	entry->offset = 0;
+	entry->committed_offset = 0;
+	return entry;
+}
+
+// ページの最新の内容がWALにあればその位置を、なければ0を返す
+// 読み手が他のスレッドの追記と並んで呼ぶので、索引はロックして読む
+static off_t wal_lookup(Wal* wal, uint32_t page_num) {
+	pthread_mutex_lock(&wal->mutex);
+	WalIndexEntry* entry = wal_index_find(&wal->index, page_num);
+	off_t offset = entry == NULL ? 0 : entry->offset;
+	pthread_mutex_unlock(&wal->mutex);
+	return offset;
+}
+
+// ページレコードが WAL_AUTOCHECKPOINT_PAGES を超えたか
+static bool wal_needs_checkpoint(Wal* wal) {
+	pthread_mutex_lock(&wal->mutex);
+	bool full = wal->num_page_records >= WAL_AUTOCHECKPOINT_PAGES;
+	pthread_mutex_unlock(&wal->mutex);
+	return full;
+}
+
+// 新しいソルトでWALヘッダを書き、WALを空にする
+static void wal_reset(Wal* wal) {
+	wal->salt += 1;
+	WalHeader header;
+	header.magic = WAL_MAGIC;
+	header.version = WAL_VERSION;
+	header.page_size = PAGE_SIZE;
+	header.salt = wal->salt;
+	header.checksum[0] = 0;
+	header.checksum[1] = 0;
+	wal_checksum(&header, offsetof(WalHeader, checksum), header.checksum);
+
+	if (ftruncate(wal->file_descriptor, 0) == -1 ||
+	    pwrite(wal->file_descriptor, &header, sizeof(header), 0) != sizeof(header) ||
+	    fdatasync(wal->file_descriptor) == -1) {
+		printf("Error resetting WAL: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	wal->checksum[0] = header.checksum[0];
+	wal->checksum[1] = header.checksum[1];
+	wal->commit_checksum[0] = header.checksum[0];
+	wal->commit_checksum[1] = header.checksum[1];
+	// 前のWALのレコードはチェックポイントで永続化したので、同期を待っている書き手を起こす
+	wal->reset_position += wal->write_offset;
+	wal->synced_position = wal->reset_position + sizeof(header);
+	pthread_cond_broadcast(&wal->synced);
+	wal->write_offset = sizeof(header);
+	wal->commit_offset = sizeof(header);
+	wal->num_page_records = 0;
+	wal_index_reset(&wal->index, WAL_INDEX_INITIAL_CAPACITY);
+}
+
+static void wal_write_record(Wal* wal, WalRecordHeader* header, const void* page) {
+	header->salt = wal->salt;
+	header->checksum[0] = wal->checksum[0];
+	header->checksum[1] = wal->checksum[1];
+	wal_checksum(header, offsetof(WalRecordHeader, checksum), header->checksum);
+	if (page != NULL) {
+		wal_checksum(page, PAGE_SIZE, header->checksum);
+	}
+
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(WalRecordHeader);
+	iov[1].iov_base = (void*)page;
+	iov[1].iov_len = page == NULL ? 0 : PAGE_SIZE;
+	ssize_t expected = iov[0].iov_len + iov[1].iov_len;
+	if (pwritev(wal->file_descriptor, iov, page == NULL ? 1 : 2, wal->write_offset) != expected) {
+		printf("Error writing WAL: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	wal->checksum[0] = header->checksum[0];
+	wal->checksum[1] = header->checksum[1];
+	wal->write_offset += expected;
+}
+
+// ページの内容をWALの末尾に追記する。コミットレコードが書かれるまでは未確定
+// フレームは読み手がコピーしている最中かもしれないので、チェックサムはコピーに付ける
+static void wal_append_page(Wal* wal, uint32_t page_num, const void* page) {
+	pthread_mutex_lock(&wal->mutex);
+	memcpy(wal->page_buffer, page, PAGE_SIZE);
+	page_stamp_checksum(wal->page_buffer);
+	WalRecordHeader header;
+	header.type = WAL_RECORD_PAGE;
+	header.page_num = page_num;
+	header.num_pages = 0;
+	wal_write_record(wal, &header, wal->page_buffer);
+
+	WalIndexEntry* entry = wal_index_insert(&wal->index, page_num);
+	entry->offset = wal->write_offset - PAGE_SIZE;
+	wal->num_page_records += 1;
+	wal->pages_written += 1;
+	pthread_mutex_unlock(&wal->mutex);
+}
+
+// コミットレコードを追記し、それまでのページレコードを確定させる
+// 戻り値はコミットが永続化されたとみなせる位置(wal_sync に渡す通し番号)
+static uint64_t wal_append_commit(Wal* wal, uint32_t num_pages,
+                               uint32_t* page_nums, uint32_t num_page_nums) {
+	pthread_mutex_lock(&wal->mutex);
+	WalRecordHeader header;
+	header.type = WAL_RECORD_COMMIT;
+	header.page_num = 0;
+	header.num_pages = num_pages;
+	wal_write_record(wal, &header, NULL);
+	wal->commit_offset = wal->write_offset;
+	wal->commit_checksum[0] = wal->checksum[0];
+	wal->commit_checksum[1] = wal->checksum[1];
+
+	for (uint32_t i = 0; i < num_page_nums; i++) {
+		WalIndexEntry* entry = wal_index_find(&wal->index, page_nums[i]);
+		if (entry != NULL) {
+			entry->committed_offset = entry->offset;
+		}
+	}
+	wal->commits += 1;
+	uint64_t position = wal->reset_position + wal->commit_offset;
+	pthread_mutex_unlock(&wal->mutex);
+
+	return position;
+}
+
+// 最後のコミットより後のページレコードを捨てる
+// 次のレコードはコミットレコードの直後から上書きし、チェックサムもそこから続ける
+static void wal_rollback(Wal* wal) {
+	pthread_mutex_lock(&wal->mutex);
+	for (uint32_t i = 0; i < wal->index.capacity; i++) {
+		WalIndexEntry* entry = &wal->index.entries[i];
+		if (entry->page_num != INVALID_PAGE_NUM) {
+			entry->offset = entry->committed_offset;
+		}
+	}
+	wal->write_offset = wal->commit_offset;
+	wal->checksum[0] = wal->commit_checksum[0];
+	wal->checksum[1] = wal->commit_checksum[1];
+	pthread_mutex_unlock(&wal->mutex);
+}
+
+// グループコミット
+// 同期中のスレッドがいなければ自分がリーダーになり、その時点までに書かれた全レコードを
+// 1回のfdatasyncでまとめて永続化する。同期中なら終わるのを待ち、足りなければ次のリーダーになる。
+// 書き手は write_mutex を放してから呼ぶので、リーダーの同期中に次の書き手が追記して待てる
+// 同期中にチェックポイントでWALがリセットされても、通し番号なので永続化済みの位置は戻らない
+static void wal_sync(Wal* wal, uint64_t position) {
+	pthread_mutex_lock(&wal->mutex);
+	while (wal->synced_position < position) {
+		if (wal->sync_in_progress) {
+			pthread_cond_wait(&wal->synced, &wal->mutex);
+			continue;
+		}
+
+		wal->sync_in_progress = true;
+		uint64_t target = wal->reset_position + wal->write_offset;
+		pthread_mutex_unlock(&wal->mutex);
+
+		if (fdatasync(wal->file_descriptor) == -1) {
+			printf("Error syncing WAL: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&wal->mutex);
+		if (target > wal->synced_position) {
+			wal->synced_position = target;
+		}
+		wal->syncs += 1;
+		wal->sync_in_progress = false;
+		pthread_cond_broadcast(&wal->synced);
+	}
+	pthread_mutex_unlock(&wal->mutex);
+}
+
+static int compare_wal_entries_by_page(const void* a, const void* b) {
+	uint32_t page_a = (*(WalIndexEntry* const*)a)->page_num;
+	uint32_t page_b = (*(WalIndexEntry* const*)b)->page_num;
+	return (page_a > page_b) - (page_a < page_b);
+}
+
+// 確定済みのページをデータベースファイルに書き戻し、WALを空にする
+// 未確定のレコードが残っていない時(コミット直後)に呼ぶ
+// 一括読み込みのように多くのページが変わった時でも順に書けるよう、ページ番号順に書き戻す
+// 圧縮モードでは page_map の空いている区画に書き、最後にページマップを書き換える
+static void wal_checkpoint(Wal* wal, int db_file_descriptor, PageMap* page_map) {
+	pthread_mutex_lock(&wal->mutex);
+	WalIndexEntry** entries = malloc(wal->index.count * sizeof(WalIndexEntry*));
+	uint32_t num_entries = 0;
+	for (uint32_t i = 0; i < wal->index.capacity; i++) {
+		WalIndexEntry* entry = &wal->index.entries[i];
+		if (entry->page_num != INVALID_PAGE_NUM && entry->committed_offset != 0) {
+			entries[num_entries++] = entry;
+		}
+	}
+	qsort(entries, num_entries, sizeof(WalIndexEntry*), compare_wal_entries_by_page);
+
+	void* page = malloc(PAGE_SIZE);
+	for (uint32_t i = 0; i < num_entries; i++) {
+		WalIndexEntry* entry = entries[i];
+		if (pread(wal->file_descriptor, page, PAGE_SIZE, entry->committed_offset) != PAGE_SIZE) {
+			printf("Error checkpointing page %d: %d\n", entry->page_num, errno);
+			exit(EXIT_FAILURE);
+		}
+		if (page_map != NULL) {
+			page_map_write(page_map, entry->page_num, page);
+		} else if (pwrite(db_file_descriptor, page, PAGE_SIZE, (off_t)entry->page_num * PAGE_SIZE) != PAGE_SIZE) {
+			printf("Error checkpointing page %d: %d\n", entry->page_num, errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	wal->pages_written += num_entries;
+	free(page);
+	free(entries);
+
+	if (page_map != NULL) {
+		// 書いたページを同期してから、それを指すヘッダを書く
+		if (num_entries > 0) {
+			page_map_sync(page_map);
+		}
+	} else if (fdatasync(db_file_descriptor) == -1) {
+		printf("Error syncing db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	wal_reset(wal);
+	pthread_mutex_unlock(&wal->mutex);
+}
+
+// WALを先頭から読み、チェックサムが正しく最後のコミットレコードまでのページを索引に載せる
+static void wal_recover(Wal* wal) {
+	WalHeader header;
+	if (pread(wal->file_descriptor, &header, sizeof(header), 0) != sizeof(header)) {
+		return;
+	}
+	uint32_t checksum[2] = {0, 0};
+	wal_checksum(&header, offsetof(WalHeader, checksum), checksum);
+	if (header.magic != WAL_MAGIC || header.version != WAL_VERSION ||
+	    header.page_size != PAGE_SIZE ||
+	    checksum[0] != header.checksum[0] || checksum[1] != header.checksum[1]) {
+		return;
+	}
+	wal->salt = header.salt;
+
+	off_t offset = sizeof(header);
+	void* page = malloc(PAGE_SIZE);
+	// 最後のコミット以降のページは未確定なので、コミットが見つかるまで保留する
+	uint32_t* pending = malloc(sizeof(uint32_t) * 16);
+	uint32_t num_pending = 0;
+	uint32_t pending_capacity = 16;
+	while (true) {
+		WalRecordHeader record;
+		if (pread(wal->file_descriptor, &record, sizeof(record), offset) != sizeof(record) ||
+		    record.salt != wal->salt) {
+			break;
+		}
+		bool has_page = record.type == WAL_RECORD_PAGE;
+		if (has_page &&
+		    pread(wal->file_descriptor, page, PAGE_SIZE, offset + sizeof(record)) != PAGE_SIZE) {
+			break;
+		}
+		wal_checksum(&record, offsetof(WalRecordHeader, checksum), checksum);
+		if (has_page) {
+			wal_checksum(page, PAGE_SIZE, checksum);
+		}
+		if (checksum[0] != record.checksum[0] || checksum[1] != record.checksum[1]) {
+			break;
+		}
+
+		offset += sizeof(record);
+		if (has_page) {
+			WalIndexEntry* entry = wal_index_insert(&wal->index, record.page_num);
+			entry->offset = offset;
+			offset += PAGE_SIZE;
+			if (num_pending == pending_capacity) {
+				pending_capacity *= 2;
+				pending = realloc(pending, sizeof(uint32_t) * pending_capacity);
+			}
+			pending[num_pending++] = record.page_num;
+			wal->num_page_records += 1;
+		} else if (record.type == WAL_RECORD_COMMIT) {
+			for (uint32_t i = 0; i < num_pending; i++) {
+				WalIndexEntry* entry = wal_index_find(&wal->index, pending[i]);
+				entry->committed_offset = entry->offset;
+			}
+			num_pending = 0;
+		} else {
+			break;
+		}
+	}
+	free(page);
+	free(pending);
+}
+
+// <db>-wal を開き、前回の終了時に残ったコミット済みのページをデータベースファイルへ戻す
+static Wal* wal_open(const char* db_filename, int db_file_descriptor, PageMap* page_map) {
+	Wal* wal = malloc(sizeof(Wal));
+	size_t length = strlen(db_filename) + sizeof(WAL_FILENAME_SUFFIX);
+	wal->filename = malloc(length);
+	snprintf(wal->filename, length, "%s%s", db_filename, WAL_FILENAME_SUFFIX);
+
+	wal->file_descriptor = open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+	if (wal->file_descriptor == -1) {
+		printf("Unable to open WAL file\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&wal->mutex, NULL);
+	pthread_cond_init(&wal->synced, NULL);
+	wal->sync_in_progress = false;
+	wal->reset_position = 0;
+	wal->write_offset = 0;
+	wal->commits = 0;
+	wal->syncs = 0;
+	wal->salt = 0;
+	wal->num_page_records = 0;
+	wal->pages_written = 0;
+	wal->page_buffer = malloc(PAGE_SIZE);
+	wal->index.entries = NULL;
+	wal_index_reset(&wal->index, WAL_INDEX_INITIAL_CAPACITY);
+
+	// 未確定のレコードは捨てられ、コミット済みのページだけがチェックポイントされる
+	wal_recover(wal);
+	wal_checkpoint(wal, db_file_descriptor, page_map);
+
+	return wal;
+}
+
+static void wal_close(Wal* wal, int db_file_descriptor, PageMap* page_map) {
+	wal_checkpoint(wal, db_file_descriptor, page_map);
+	close(wal->file_descriptor);
+	unlink(wal->filename);
+	pthread_mutex_destroy(&wal->mutex);
+	pthread_cond_destroy(&wal->synced);
+	free(wal->index.entries);
+	free(wal->page_buffer);
+	free(wal->filename);
+	free(wal);
+}
+
+// ページマップとそのヘッダの CRC32C
+static uint32_t page_map_checksum(const void* data, size_t size) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_update(~0U, data, size);
+}
+
+// データベースファイルが圧縮したものならページマップを読む
+// 空のファイルは codec が PAGE_CODEC_NONE でなければ、圧縮したファイルとして作る
+// 圧縮していないファイルなら NULL を返す
+static PageMap* page_map_open(int file_descriptor, PageCodec codec) {
+	off_t file_length = lseek(file_descriptor, 0, SEEK_END);
+	PageMapHeader header;
+	memset(&header, 0, sizeof(header));
+	bool found = false;
+	for (uint32_t slot = 0; slot < PAGE_MAP_HEADER_GRANULES; slot++) {
+		PageMapHeader candidate;
+		if (pread(file_descriptor, &candidate, sizeof(candidate), (off_t)slot * PAGE_MAP_GRANULE_SIZE) !=
+		        sizeof(candidate) ||
+		    candidate.magic != PAGE_MAP_MAGIC || candidate.version != PAGE_MAP_VERSION ||
+		    candidate.page_size != PAGE_SIZE ||
+		    candidate.checksum != page_map_checksum(&candidate, offsetof(PageMapHeader, checksum))) {
+			continue;
+		}
+		if (!found || candidate.sequence > header.sequence) {
+			header = candidate;
+			found = true;
+		}
+	}
+	if (!found && (file_length != 0 || codec == PAGE_CODEC_NONE)) {
+		return NULL;
+	}
+
+	PageMap* map = malloc(sizeof(PageMap));
+	map->file_descriptor = file_descriptor;
+	map->codec = codec;
+	map->sequence = 0;
+	map->num_pages = 0;
+	map->extents_capacity = 64;
+	map->extents = calloc(map->extents_capacity, sizeof(PageExtent));
+	map->map_extent = (PageExtent){0, 0};
+	map->used_capacity = 1024;
+	map->used = calloc(map->used_capacity / 8, 1);
+	map->num_granules = 0;
+	map->first_free = 0;
+	map->num_released = 0;
+	map->released_capacity = 64;
+	map->released = malloc(map->released_capacity * sizeof(PageExtent));
+	map->buffer = malloc(PAGE_SIZE);
+	page_map_mark(map, (PageExtent){0, PAGE_MAP_HEADER_GRANULES * PAGE_MAP_GRANULE_SIZE}, true);
+	if (!found) {
+		// 空のページマップを指すヘッダを書いておく
+		page_map_sync(map);
+		return map;
+	}
+
+	if (header.codec != PAGE_CODEC_LZ && header.codec != PAGE_CODEC_NONE) {
+		printf("Unsupported page codec %u.\n", header.codec);
+		exit(EXIT_FAILURE);
+	}
+	map->codec = header.codec;
+	map->sequence = header.sequence;
+	map->num_pages = header.num_pages;
+	if (header.map_size != header.num_pages * sizeof(PageExtent)) {
+		printf("Page map is corrupt.\n");
+		exit(EXIT_FAILURE);
+	}
+	while (map->extents_capacity < map->num_pages) {
+		map->extents_capacity *= 2;
+	}
+	map->extents = realloc(map->extents, map->extents_capacity * sizeof(PageExtent));
+	if (header.map_size > 0 &&
+	    (pread(file_descriptor, map->extents, header.map_size, (off_t)header.map_granule * PAGE_MAP_GRANULE_SIZE) !=
+	         (ssize_t)header.map_size ||
+	     page_map_checksum(map->extents, header.map_size) != header.map_checksum)) {
+		printf("Page map is corrupt.\n");
+		exit(EXIT_FAILURE);
+	}
+	map->map_extent = (PageExtent){header.map_granule, header.map_size};
+	page_map_mark(map, map->map_extent, true);
+	// 使っている区画はページマップから分かる。最後のヘッダより後に書かれた区画は空いているとみなす
+	for (uint32_t page_num = 0; page_num < map->num_pages; page_num++) {
+		if (map->extents[page_num].size > PAGE_SIZE) {
+			printf("Page map is corrupt.\n");
+			exit(EXIT_FAILURE);
+		}
+		page_map_mark(map, map->extents[page_num], true);
+	}
+	return map;
+}
+
+// 最後に使っている区画の後ろを切り詰めて閉じる
+// 置き換えた区画はヘッダを書いた時に空いているので、page_map_sync の後に呼ぶ
+static void page_map_close(PageMap* map) {
+	while (map->num_granules > PAGE_MAP_HEADER_GRANULES && !page_map_granule_used(map, map->num_granules - 1)) {
+		map->num_granules -= 1;
+	}
+	if (ftruncate(map->file_descriptor, (off_t)map->num_granules * PAGE_MAP_GRANULE_SIZE) == -1) {
+		printf("Error truncating db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	free(map->extents);
+	free(map->used);
+	free(map->released);
+	free(map->buffer);
+	free(map);
+}
+
+static int compare_uint64_descending(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x < y) - (x > y);
+}
+
+// チェックポイントは古い置き場所を残したまま書くので、ファイルの途中に空いた区画が散らばる
+// ファイルの後ろにあるページから順に、前の空いた区画へ移す。前に入る場所がなくなったら止める
+// 移した後にヘッダを書くので、途中で落ちても古い置き場所から読める
+static void page_map_compact(PageMap* map) {
+	// 上位32ビットに区画、下位32ビットにページ番号を入れて、後ろの区画から並べる
+	uint64_t* order = malloc(map->num_pages * sizeof(uint64_t));
+	uint32_t num_order = 0;
+	for (uint32_t page_num = 0; page_num < map->num_pages; page_num++) {
+		if (map->extents[page_num].size != 0) {
+			order[num_order++] = (uint64_t)map->extents[page_num].granule << 32 | page_num;
+		}
+	}
+	qsort(order, num_order, sizeof(uint64_t), compare_uint64_descending);
+
+	uint32_t num_moved = 0;
+	for (uint32_t i = 0; i < num_order; i++) {
+		uint32_t page_num = (uint32_t)order[i];
+		PageExtent old_extent = map->extents[page_num];
+		PageExtent new_extent = page_map_allocate(map, old_extent.size);
+		if (new_extent.granule >= old_extent.granule) {
+			page_map_mark(map, new_extent, false);
+			break;
+		}
+		if (pread(map->file_descriptor, map->buffer, old_extent.size,
+		          (off_t)old_extent.granule * PAGE_MAP_GRANULE_SIZE) != (ssize_t)old_extent.size ||
+		    pwrite(map->file_descriptor, map->buffer, old_extent.size,
+		           (off_t)new_extent.granule * PAGE_MAP_GRANULE_SIZE) != (ssize_t)old_extent.size) {
+			printf("Error moving page %d: %d\n", page_num, errno);
+			exit(EXIT_FAILURE);
+		}
+		page_map_release(map, old_extent);
+		map->extents[page_num] = new_extent;
+		num_moved += 1;
+	}
+	free(order);
+	if (num_moved > 0) {
+		page_map_sync(map);
+	}
+}
+
+// ページを page に展開する。書かれていないページはゼロで埋める
+// 読めないか展開できなければ false
+static bool page_map_read(PageMap* map, uint32_t page_num, void* page) {
+	if (page_num >= map->num_pages || map->extents[page_num].size == 0) {
+		memset(page, 0, PAGE_SIZE);
+		return true;
+	}
+	PageExtent extent = map->extents[page_num];
+	off_t offset = (off_t)extent.granule * PAGE_MAP_GRANULE_SIZE;
+	if (extent.size == PAGE_SIZE) {
+		return pread(map->file_descriptor, page, PAGE_SIZE, offset) == PAGE_SIZE;
+	}
+	uint8_t compressed[PAGE_SIZE];
+	return pread(map->file_descriptor, compressed, extent.size, offset) == (ssize_t)extent.size &&
+	       lz_decompress(compressed, extent.size, page, PAGE_SIZE);
+}
+
+// ページを圧縮して空いている区画に書く。小さくならなければそのまま書く
+// 古い置き場所は次のヘッダを書くまで残す
+static void page_map_write(PageMap* map, uint32_t page_num, const void* page) {
+	const void* data = page;
+	uint32_t size = PAGE_SIZE;
+	if (map->codec == PAGE_CODEC_LZ) {
+		uint32_t compressed_size = lz_compress(page, PAGE_SIZE, map->buffer, PAGE_SIZE - 1);
+		if (compressed_size != 0) {
+			data = map->buffer;
+			size = compressed_size;
+		}
+	}
+
+	if (page_num >= map->num_pages) {
+		uint32_t capacity = map->extents_capacity;
+		while (capacity <= page_num) {
+			capacity *= 2;
+		}
+		if (capacity != map->extents_capacity) {
+			map->extents = realloc(map->extents, capacity * sizeof(PageExtent));
+			map->extents_capacity = capacity;
+		}
+		memset(map->extents + map->num_pages, 0, (page_num + 1 - map->num_pages) * sizeof(PageExtent));
+		map->num_pages = page_num + 1;
+	}
+	page_map_release(map, map->extents[page_num]);
+	PageExtent extent = page_map_allocate(map, size);
+	if (pwrite(map->file_descriptor, data, size, (off_t)extent.granule * PAGE_MAP_GRANULE_SIZE) != (ssize_t)size) {
+		printf("Error checkpointing page %d: %d\n", page_num, errno);
+		exit(EXIT_FAILURE);
+	}
+	map->extents[page_num] = extent;
+}
+
+// num_pages 以降のページを捨てる。区画は次のヘッダを書いた後に空く
+static void page_map_truncate(PageMap* map, uint32_t num_pages) {
+	for (uint32_t page_num = num_pages; page_num < map->num_pages; page_num++) {
+		page_map_release(map, map->extents[page_num]);
+	}
+	if (num_pages < map->num_pages) {
+		map->num_pages = num_pages;
+	}
+}
+
+// 書いたページを同期し、ページマップを空いている区画に書いてから、それを指すヘッダを書く
+// ヘッダを書く前に落ちても、古いヘッダが指すページマップとページはどれも上書きされていない
+static void page_map_sync(PageMap* map) {
+	page_map_release(map, map->map_extent);
+	uint32_t map_size = map->num_pages * sizeof(PageExtent);
+	PageExtent map_extent = {0, 0};
+	if (map_size > 0) {
+		map_extent = page_map_allocate(map, map_size);
+		if (pwrite(map->file_descriptor, map->extents, map_size,
+		           (off_t)map_extent.granule * PAGE_MAP_GRANULE_SIZE) != (ssize_t)map_size) {
+			printf("Error writing page map: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (fdatasync(map->file_descriptor) == -1) {
+		printf("Error syncing db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	PageMapHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = PAGE_MAP_MAGIC;
+	header.version = PAGE_MAP_VERSION;
+	header.page_size = PAGE_SIZE;
+	header.codec = map->codec;
+	header.num_pages = map->num_pages;
+	header.sequence = map->sequence + 1;
+	header.map_granule = map_extent.granule;
+	header.map_size = map_size;
+	header.map_checksum = page_map_checksum(map->extents, map_size);
+	header.checksum = page_map_checksum(&header, offsetof(PageMapHeader, checksum));
+	// 今のヘッダとは別の区画に書くので、書いている途中で落ちても今のヘッダは残る
+	off_t offset = (off_t)(header.sequence % PAGE_MAP_HEADER_GRANULES) * PAGE_MAP_GRANULE_SIZE;
+	if (pwrite(map->file_descriptor, &header, sizeof(header), offset) != sizeof(header) ||
+	    fdatasync(map->file_descriptor) == -1) {
+		printf("Error writing page map header: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	map->sequence = header.sequence;
+	map->map_extent = map_extent;
+
+	for (uint32_t i = 0; i < map->num_released; i++) {
+		page_map_mark(map, map->released[i], false);
+	}
+	map->num_released = 0;
+}
+
+static bool page_map_granule_used(PageMap* map, uint32_t granule) {
+	return granule < map->num_granules && (map->used[granule / 8] & (1 << (granule % 8)));
+}
+
+// 置き場所の区画を使用中か空きにする。ファイルの終わりより後ろなら伸ばす
+static void page_map_mark(PageMap* map, PageExtent extent, bool used) {
+	uint32_t count = (extent.size + PAGE_MAP_GRANULE_SIZE - 1) / PAGE_MAP_GRANULE_SIZE;
+	uint32_t end = extent.granule + count;
+	if (end > map->used_capacity) {
+		uint32_t capacity = map->used_capacity;
+		while (capacity < end) {
+			capacity *= 2;
+		}
+		map->used = realloc(map->used, capacity / 8);
+		memset(map->used + map->used_capacity / 8, 0, (capacity - map->used_capacity) / 8);
+		map->used_capacity = capacity;
+	}
+	if (used && end > map->num_granules) {
+		map->num_granules = end;
+	}
+	for (uint32_t granule = extent.granule; granule < end; granule++) {
+		if (used) {
+			map->used[granule / 8] |= 1 << (granule % 8);
+		} else {
+			map->used[granule / 8] &= ~(1 << (granule % 8));
+		}
+	}
+	if (!used && extent.granule < map->first_free) {
+		map->first_free = extent.granule;
+	}
+	while (page_map_granule_used(map, map->first_free)) {
+		map->first_free += 1;
+	}
+}
+
+// size バイトが入る連続した空き区画を前から探す。なければファイルの終わりに置く
+static PageExtent page_map_allocate(PageMap* map, uint32_t size) {
+	uint32_t count = (size + PAGE_MAP_GRANULE_SIZE - 1) / PAGE_MAP_GRANULE_SIZE;
+	uint32_t run = 0;
+	uint32_t granule = map->first_free;
+	for (; granule < map->num_granules && run < count; granule++) {
+		run = page_map_granule_used(map, granule) ? 0 : run + 1;
+	}
+	// 見つからなければ、末尾の空き区画から続けて伸ばす
+	PageExtent extent = {granule - run, size};
+	page_map_mark(map, extent, true);
+	return extent;
+}
+
+// 置き換えた置き場所を、次のヘッダを書いた後に空くように覚えておく
+static void page_map_release(PageMap* map, PageExtent extent) {
+	if (extent.size == 0) {
+		return;
+	}
+	if (map->num_released == map->released_capacity) {
+		map->released_capacity *= 2;
+		map->released = realloc(map->released, map->released_capacity * sizeof(PageExtent));
+	}
+	map->released[map->num_released++] = extent;
+}
+
+static uint32_t lz_hash(const uint8_t* p) {
+	uint32_t sequence;
+	memcpy(&sequence, p, sizeof(sequence));
+	return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// 15以上の長さの残りを、255 の並びと最後の1バイトで書く
+static uint8_t* lz_write_length(uint8_t* p, uint32_t length) {
+	for (; length >= 255; length -= 255) {
+		*p++ = 255;
+	}
+	*p++ = length;
+	return p;
+}
+
+// LZ4 のブロック形式で圧縮する。capacity に収まらなければ0を返す
+// 各シーケンスは トークン(リテラル長4ビット, 一致長-4 の4ビット)、リテラル、2バイトの距離
+// 最後のシーケンスはリテラルだけ
+static uint32_t lz_compress(const uint8_t* source, uint32_t source_size, uint8_t* destination,
+                            uint32_t capacity) {
+	uint16_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const uint8_t* end = source + source_size;
+	const uint8_t* match_start_limit = source_size > LZ_MATCH_LIMIT ? end - LZ_MATCH_LIMIT : source;
+	const uint8_t* match_end_limit = end - LZ_LAST_LITERALS;
+	const uint8_t* anchor = source;
+	const uint8_t* p = source + 1;
+	uint8_t* output = destination;
+	uint8_t* output_end = destination + capacity;
+
+	while (p < match_start_limit) {
+		uint32_t hash = lz_hash(p);
+		const uint8_t* candidate = source + table[hash];
+		table[hash] = p - source;
+		if (candidate >= p || p - candidate > LZ_MAX_OFFSET || memcmp(candidate, p, LZ_MIN_MATCH) != 0) {
+			// 一致が見つからない間は、だんだん飛ばして探す
+			p += 1 + ((p - anchor) >> 6);
+			continue;
+		}
+		while (p > anchor && candidate > source && p[-1] == candidate[-1]) {
+			p--;
+			candidate--;
+		}
+		const uint8_t* match_end = p + LZ_MIN_MATCH;
+		const uint8_t* c = candidate + LZ_MIN_MATCH;
+		while (match_end < match_end_limit && *match_end == *c) {
+			match_end++;
+			c++;
+		}
+
+		uint32_t literal_length = p - anchor;
+		uint32_t match_length = match_end - p - LZ_MIN_MATCH;
+		if (output + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > output_end) {
+			return 0;
+		}
+		uint8_t* token = output++;
+		*token = (literal_length < 15 ? literal_length : 15) << 4;
+		if (literal_length >= 15) {
+			output = lz_write_length(output, literal_length - 15);
+		}
+		memcpy(output, anchor, literal_length);
+		output += literal_length;
+		uint16_t offset = p - candidate;
+		*output++ = offset & 0xFF;
+		*output++ = offset >> 8;
+		*token |= match_length < 15 ? match_length : 15;
+		if (match_length >= 15) {
+			output = lz_write_length(output, match_length - 15);
+		}
+		p = match_end;
+		anchor = p;
+	}
+
+	uint32_t literal_length = end - anchor;
+	if (output + 1 + literal_length / 255 + 1 + literal_length > output_end) {
+		return 0;
+	}
+	*output++ = (literal_length < 15 ? literal_length : 15) << 4;
+	if (literal_length >= 15) {
+		output = lz_write_length(output, literal_length - 15);
+	}
+	memcpy(output, anchor, literal_length);
+	output += literal_length;
+	return output - destination;
+}
+
+// 長さの続き(255 の並びと最後の1バイト)を読んで length に足す
+static bool lz_read_length(const uint8_t** p, const uint8_t* end, uint32_t* length) {
+	uint8_t byte;
+	do {
+		if (*p >= end) {
+			return false;
+		}
+		byte = *(*p)++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// 壊れたデータでも destination の外には書かない。ちょうど destination_size バイトにならなければ false
+static bool lz_decompress(const uint8_t* source, uint32_t source_size, uint8_t* destination,
+                          uint32_t destination_size) {
+	const uint8_t* p = source;
+	const uint8_t* end = source + source_size;
+	uint8_t* output = destination;
+	uint8_t* output_end = destination + destination_size;
+	while (p < end) {
+		uint8_t token = *p++;
+		uint32_t literal_length = token >> 4;
+		if (literal_length == 15 && !lz_read_length(&p, end, &literal_length)) {
+			return false;
+		}
+		if (literal_length > (uint32_t)(end - p) || literal_length > (uint32_t)(output_end - output)) {
+			return false;
+		}
+		memcpy(output, p, literal_length);
+		p += literal_length;
+		output += literal_length;
+		if (p == end) {
+			break;
+		}
+
+		if (end - p < 2) {
+			return false;
+		}
+		uint32_t offset = p[0] | (p[1] << 8);
+		p += 2;
+		uint32_t match_length = token & 0xF;
+		if (match_length == 15 && !lz_read_length(&p, end, &match_length)) {
+			return false;
+		}
+		match_length += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (uint32_t)(output - destination) ||
+		    match_length > (uint32_t)(output_end - output)) {
+			return false;
+		}
+		// 距離が一致長より短ければ、今書いたバイトを繰り返す
+		const uint8_t* match = output - offset;
+		for (uint32_t i = 0; i < match_length; i++) {
+			output[i] = match[i];
+		}
+		output += match_length;
+	}
+	return output == output_end;
+}
+
+static Cursor* table_start(Table* table, Snapshot* snapshot) {
+	Cursor* cursor = snapshot_find(table, snapshot, 0);
+	cursor->end_of_table = (*leaf_node_num_cells(cursor->node) == 0);
+	return cursor;
+}
+
+// リーフノードのセルの位置を返す
+//
+static uint32_t* leaf_node_num_cells(void* node) {
+	return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+// leaf nodeのセルの位置を返す
+//
+static uint16_t* leaf_node_cell_pointer(void* node, uint32_t cell_num) {
+	return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_POINTER_SIZE;
+}
+
+static uint16_t* leaf_node_cell_content(void* node) {
+	return node + LEAF_NODE_CELL_CONTENT_OFFSET;
+}
+
+static uint16_t* leaf_node_fragmented_bytes(void* node) {
+	return node + LEAF_NODE_FRAGMENTED_BYTES_OFFSET;
+}
+
+static void* leaf_node_cell(void* node, uint32_t cell_num) {
+	return node + *leaf_node_cell_pointer(node, cell_num);
+}
+
+// leaf nodeのkeyを返す
+//
+static uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+	return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET;
+}
+
+// leaf nodeのkeyのvalueを返す
+// 値はシリアライズされた行で、キー(id)から始まる
+//
+static void* leaf_node_value(void* node, uint32_t cell_num) {
+	return leaf_node_cell(node, cell_num);
+}
+
+// セルがページ内で占めるバイト数(セルポインタを除く)
+// 索引のノードも同じ形でセルを置くので、ノードの種類で大きさの求め方を変える
+static uint32_t leaf_node_cell_size(void* node, uint32_t cell_num) {
+	void* cell = leaf_node_cell(node, cell_num);
+	uint32_t size = get_node_type(node) == NODE_LEAF ? row_serialized_size(cell) : index_cell_size(node, cell);
+	return (size + LEAF_NODE_CELL_ALIGNMENT - 1) & ~(LEAF_NODE_CELL_ALIGNMENT - 1);
+}
+
+// 断片化した分も含めた空き容量
+static uint32_t leaf_node_free_space(void* node) {
+	uint32_t pointers_end = LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_CELL_POINTER_SIZE;
+	return *leaf_node_cell_content(node) - pointers_end + *leaf_node_fragmented_bytes(node);
+}
+
+// セルをページの末尾に詰め直し、断片化した隙間をなくす
+static void leaf_node_defragment(void* node) {
+	uint32_t original[PAGE_SIZE / sizeof(uint32_t)];
+	memcpy(original, node, PAGE_SIZE);
+
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t content = PAGE_SIZE;
+	if (get_node_type(node) != NODE_LEAF) {
+		// 索引のノードではプレフィックスの手前まで
+		content = index_node_cells_end(index_node_prefix_length(node));
+	}
+	for (uint32_t i = 0; i < num_cells; i++) {
+		uint32_t size = leaf_node_cell_size(original, i);
+		content -= size;
+		memcpy(node + content, leaf_node_cell(original, i), size);
+		*leaf_node_cell_pointer(node, i) = content;
+	}
+	*leaf_node_cell_content(node) = content;
+	*leaf_node_fragmented_bytes(node) = 0;
+}
+
+// 行をセルの形にシリアライズし、セルの大きさを返す
+static uint32_t leaf_cell_from_row(Row* row, void* cell) {
+	uint32_t size = serialize_row(row, cell);
+	uint32_t aligned_size = (size + LEAF_NODE_CELL_ALIGNMENT - 1) & ~(LEAF_NODE_CELL_ALIGNMENT - 1);
+	memset(cell + size, 0, aligned_size - size);
+	return aligned_size;
+}
+
+// cell_num の位置にセルを置く。呼び出し側で leaf_node_free_space を確かめておくこと
+// 連続した空きが足りなければ、先に断片化を解消する
+static void leaf_node_put_cell(void* node, uint32_t cell_num, const void* cell, uint32_t cell_size) {
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t pointers_end = LEAF_NODE_HEADER_SIZE + (num_cells + 1) * LEAF_NODE_CELL_POINTER_SIZE;
+	if (*leaf_node_cell_content(node) < pointers_end + cell_size) {
+		leaf_node_defragment(node);
+	}
+
+	uint32_t content = *leaf_node_cell_content(node) - cell_size;
+	memcpy(node + content, cell, cell_size);
+	*leaf_node_cell_content(node) = content;
+
+	memmove(leaf_node_cell_pointer(node, cell_num + 1), leaf_node_cell_pointer(node, cell_num),
+	        (num_cells - cell_num) * LEAF_NODE_CELL_POINTER_SIZE);
+	*leaf_node_cell_pointer(node, cell_num) = content;
+	*leaf_node_num_cells(node) = num_cells + 1;
+}
+
+// cell_num のセルを外す。空いた領域は断片として数え、次に詰め直す時に回収する
+static void leaf_node_remove_cell(void* node, uint32_t cell_num) {
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t offset = *leaf_node_cell_pointer(node, cell_num);
+	uint32_t size = leaf_node_cell_size(node, cell_num);
+	memmove(leaf_node_cell_pointer(node, cell_num), leaf_node_cell_pointer(node, cell_num + 1),
+	        (num_cells - cell_num - 1) * LEAF_NODE_CELL_POINTER_SIZE);
+	*leaf_node_num_cells(node) = num_cells - 1;
+	if (offset == *leaf_node_cell_content(node)) {
+		*leaf_node_cell_content(node) = offset + size;
+	} else {
+		*leaf_node_fragmented_bytes(node) += size;
+	}
+}
+
+// 大きさ cell_size のセルを分割せずに置けるか
+static bool leaf_node_fits(void* node, uint32_t cell_size) {
+	return leaf_node_free_space(node) >= cell_size + LEAF_NODE_CELL_POINTER_SIZE;
+}
+
+// セルとセルポインタが使っているバイト数
+static uint32_t leaf_node_used_space(void* node) {
+	return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+}
+
+static void initialize_leaf_node(void* node) {
+	set_node_type(node, NODE_LEAF);
+	set_node_root(node, false);
+	*leaf_node_num_cells(node) = 0;
+	*leaf_node_next_leaf(node) = 0;
+	*leaf_node_cell_content(node) = PAGE_SIZE;
+	*leaf_node_fragmented_bytes(node) = 0;
+}
+
+static void initialize_internal_node(void* node) {
+	set_node_type(node, NODE_INTERNAL);
+	set_node_root(node, false);
+	*internal_node_num_keys(node) = 0;
+}
+
+// キーと値のペアをリーフノードに挿入するための関数を作成します。
+// ペアを挿入する位置を表すために、引数にカーソルをとる
+//
+static void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
+	Pager* pager = cursor->table->pager;
+	void* node = get_page(pager, cursor->page_num);
+
+	uint32_t cell[LEAF_NODE_MAX_CELL_SIZE / sizeof(uint32_t)];
+	uint32_t cell_size = leaf_cell_from_row(value, cell);
+	if (!leaf_node_fits(node, cell_size)) {
+		// Node full
+		unpin_page(pager, cursor->page_num);
+		leaf_node_split_and_insert(cursor, key, value);
+		return;
+	}
+
+	mark_page_dirty(pager, cursor->page_num);
+	leaf_node_put_cell(node, cursor->cell_num, cell, cell_size);
+	unpin_page(pager, cursor->page_num);
+}
+
+void db_print_constants(void) {
+  printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  printf("LEAF_NODE_CELL_POINTER_SIZE: %d\n", LEAF_NODE_CELL_POINTER_SIZE);
+  printf("LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+}
+
+static const char* statement_type_names[DB_STATS_NUM_STATEMENT_TYPES] = {
+	"insert", "select", "update", "delete", "begin", "commit", "rollback", "create_index"};
+
+// ホットパスで数えるので、他のスレッドと取り合うのはカウンタのキャッシュラインだけにする
+static void stats_add(uint64_t* counter, uint64_t value) {
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void stats_record_latency(DbLatency* latency, uint64_t ns) {
+	uint32_t bucket = 63 - __builtin_clzll(ns | 1);
+	if (bucket >= DB_STATS_LATENCY_BUCKETS) {
+		bucket = DB_STATS_LATENCY_BUCKETS - 1;
+	}
+	stats_add(&latency->count, 1);
+	stats_add(&latency->total_ns, ns);
+	stats_add(&latency->buckets[bucket], 1);
+}
+
+static void stats_record_find(Pager* pager, uint32_t depth, uint32_t nodes_visited) {
+	stats_add(&pager->stats.finds, 1);
+	stats_add(&pager->stats.find_nodes_visited, nodes_visited);
+	stats_add(&pager->stats.find_depths[depth < DB_STATS_MAX_DEPTH ? depth : DB_STATS_MAX_DEPTH], 1);
+}
+
+// pager_flush はページを1つのレコード(ヘッダと本体)として pwritev 1回で書く
+static void stats_record_flush(Pager* pager) {
+	stats_add(&pager->stats.flushes, 1);
+	stats_add(&pager->stats.flush_bytes, sizeof(WalRecordHeader) + PAGE_SIZE);
+	stats_add(&pager->stats.flush_syscalls, 1);
+}
+
+void db_stats(Table* table, DbStats* stats) {
+	// DbStats は uint64_t だけを並べた構造体
+	const uint64_t* counters = (const uint64_t*)&table->pager->stats;
+	uint64_t* destination = (uint64_t*)stats;
+	for (size_t i = 0; i < sizeof(DbStats) / sizeof(uint64_t); i++) {
+		destination[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	}
+	Wal* wal = table->pager->wal;
+	pthread_mutex_lock(&wal->mutex);
+	stats->pages_written = wal->pages_written;
+	stats->commits = wal->commits;
+	stats->wal_syncs = wal->syncs;
+	pthread_mutex_unlock(&wal->mutex);
+}
+
+// 分布から q の割合の位置を含むバケットの上限を返す
+static uint64_t latency_percentile(const DbLatency* latency, double q) {
+	uint64_t rank = (uint64_t)(q * latency->count + 0.999999);
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < DB_STATS_LATENCY_BUCKETS; i++) {
+		seen += latency->buckets[i];
+		if (seen >= rank && seen > 0) {
+			return (uint64_t)2 << i;
+		}
+	}
+	return 0;
+}
+
+void db_print_stats(Table* table, bool json) {
+	DbStats stats;
+	db_stats(table, &stats);
+	if (!json) {
+		printf("pages: %lu hits, %lu misses, %lu read, %lu written\n", stats.page_hits, stats.page_misses,
+		       stats.pages_read, stats.pages_written);
+		printf("flush: %lu pages, %lu bytes, %lu syscalls\n", stats.flushes, stats.flush_bytes,
+		       stats.flush_syscalls);
+		printf("commit: %lu commits, %lu syncs\n", stats.commits, stats.wal_syncs);
+		printf("find: %lu searches, %lu nodes visited, depth", stats.finds, stats.find_nodes_visited);
+		for (uint32_t i = 0; i <= DB_STATS_MAX_DEPTH; i++) {
+			if (stats.find_depths[i] > 0) {
+				printf(" %u: %lu", i, stats.find_depths[i]);
+			}
+		}
+		printf("\n");
+		printf("splits: %lu leaf, %lu internal inserts, %lu internal\n", stats.leaf_splits,
+		       stats.internal_inserts, stats.internal_splits);
+		for (uint32_t i = 0; i < DB_STATS_NUM_STATEMENT_TYPES; i++) {
+			DbLatency* latency = &stats.statements[i];
+			if (latency->count > 0) {
+				printf("%s: %lu in %lu us, p50 < %lu ns, p99 < %lu ns\n", statement_type_names[i],
+				       latency->count, latency->total_ns / 1000, latency_percentile(latency, 0.50),
+				       latency_percentile(latency, 0.99));
+			}
+		}
+		return;
+	}
+
+	printf("{\"page_hits\": %lu, \"page_misses\": %lu, \"pages_read\": %lu, \"pages_written\": %lu, "
+	       "\"flushes\": %lu, \"flush_bytes\": %lu, \"flush_syscalls\": %lu, \"commits\": %lu, \"wal_syncs\": %lu, "
+	       "\"finds\": %lu, \"find_nodes_visited\": %lu, \"find_depths\": [",
+	       stats.page_hits, stats.page_misses, stats.pages_read, stats.pages_written, stats.flushes,
+	       stats.flush_bytes, stats.flush_syscalls, stats.commits, stats.wal_syncs, stats.finds,
+	       stats.find_nodes_visited);
+	for (uint32_t i = 0; i <= DB_STATS_MAX_DEPTH; i++) {
+		printf("%s%lu", i == 0 ? "" : ", ", stats.find_depths[i]);
+	}
+	printf("], \"leaf_splits\": %lu, \"internal_inserts\": %lu, \"internal_splits\": %lu, \"statements\": {",
+	       stats.leaf_splits, stats.internal_inserts, stats.internal_splits);
+	for (uint32_t i = 0; i < DB_STATS_NUM_STATEMENT_TYPES; i++) {
+		DbLatency* latency = &stats.statements[i];
+		printf("%s\"%s\": {\"count\": %lu, \"total_ns\": %lu, \"p50_ns\": %lu, \"p99_ns\": %lu, \"buckets\": [",
+		       i == 0 ? "" : ", ", statement_type_names[i], latency->count, latency->total_ns,
+		       latency_percentile(latency, 0.50), latency_percentile(latency, 0.99));
+		for (uint32_t j = 0; j < DB_STATS_LATENCY_BUCKETS; j++) {
+			printf("%s%lu", j == 0 ? "" : ", ", latency->buckets[j]);
+		}
+		printf("]}");
+	}
+	printf("}}\n");
+}
+
+// 読み手と同じようにスナップショットを読むので、書き手を止めずに調べられる
+// 木を調べた後、ファイルの全てのページのチェックサムを確かめる
+bool db_check(Table* table, uint32_t* num_errors) {
+	if (table_owns_transaction(table, NULL)) {
+		return false;
+	}
+	Pager* pager = table->pager;
+	Check check;
+	memset(&check, 0, sizeof(check));
+	check.table = table;
+	pthread_mutex_init(&check.mutex, NULL);
+	pthread_rwlock_rdlock(&table->tree_latch);
+	snapshot_acquire(pager, &check.snapshot);
+
+	uint32_t header[PAGE_SIZE / sizeof(uint32_t)];
+	snapshot_read_page(pager, &check.snapshot, DB_HEADER_PAGE_NUM, header);
+	check.num_pages = *db_header_page_count(header);
+	uint32_t root_page_num = *db_header_root_page(header);
+	if (check.num_pages > pager->num_pages) {
+		check_error(&check, "header: page count %u is larger than the file (%u pages)", check.num_pages,
+		            pager->num_pages);
+		check.num_pages = pager->num_pages;
+	}
+	check.seen = calloc((check.num_pages + 7) / 8, 1);
+	check.seen[0] = 1;
+	pthread_rwlock_rdlock(&pager->io_lock);
+	check.file_pages = pager->file_length / PAGE_SIZE;
+	pthread_rwlock_unlock(&pager->io_lock);
+
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t num_threads = num_cpus < 1 ? 1 : num_cpus > CHECK_MAX_THREADS ? CHECK_MAX_THREADS : num_cpus;
+
+	// 壊れたページは get_page で読むと終了してしまうので、先にファイルを確かめて、あれば木はたどらない
+	check_run(&check, num_threads, check_pages_worker);
+	if (check.num_errors == 0) {
+		check_tree(&check, root_page_num, num_threads);
+	}
+
+	snapshot_release(pager, &check.snapshot);
+	pthread_rwlock_unlock(&table->tree_latch);
+
+	printf("checked %u pages and %lu rows with %u threads: ", check.num_pages, check.num_rows, num_threads);
+	if (check.num_errors == 0) {
+		printf("ok\n");
+	} else {
+		printf("%u errors\n", check.num_errors);
+	}
+	*num_errors = check.num_errors;
+	free(check.items);
+	free(check.seen);
+	pthread_mutex_destroy(&check.mutex);
+	return true;
+}
+
+// 木をたどって調べ、最後に空きページのリストを調べる
+static void check_tree(Check* check, uint32_t root_page_num, uint32_t num_threads) {
+	// 根から1段ずつ展開して、スレッドに配る部分木をキーの順に並べる
+	uint32_t capacity = 1;
+	check->items = calloc(capacity, sizeof(CheckItem));
+	check->num_items = 1;
+	check->items[0].node.page_num = root_page_num;
+	check->items[0].node.parent_page_num = 0;
+	check->items[0].node.depth = 1;
+	uint32_t node[PAGE_SIZE / sizeof(uint32_t)];
+	CheckNode children[INTERNAL_NODE_MAX_CELLS + 1];
+	bool expanded = true;
+	while (expanded && check->num_items < num_threads * CHECK_ITEMS_PER_THREAD) {
+		expanded = false;
+		CheckItem* next = NULL;
+		uint32_t num_next = 0;
+		for (uint32_t i = 0; i < check->num_items; i++) {
+			CheckNode* position = &check->items[i].node;
+			uint32_t num_children = 0;
+			bool internal = false;
+			if (position->page_num < check->num_pages) {
+				check_read_node(check, position->page_num, node);
+				internal = get_node_type(node) == NODE_INTERNAL;
+			}
+			if (internal) {
+				if (check_mark(check, position->page_num, position->parent_page_num) &&
+				    check_node_header(check, position, node)) {
+					num_children = check_internal(check, position, node, children);
+				}
+				expanded = true;
+			}
+			if (next == NULL || num_next + num_children + 1 > capacity) {
+				capacity = (num_next + num_children + 1) * 2;
+				next = realloc(next, capacity * sizeof(CheckItem));
+			}
+			if (!internal) {
+				next[num_next++] = check->items[i];
+			}
+			for (uint32_t j = 0; j < num_children; j++) {
+				memset(&next[num_next], 0, sizeof(CheckItem));
+				next[num_next++].node = children[j];
+			}
+		}
+		free(check->items);
+		check->items = next;
+		check->num_items = num_next;
+	}
+	for (uint32_t i = 0; i < check->num_items; i++) {
+		check->items[i].first_leaf = INVALID_PAGE_NUM;
+	}
+
+	check_run(check, num_threads, check_tree_worker);
+
+	// 部分木の最後の葉は、次の部分木の最初の葉を指していなければならない
+	uint32_t previous_leaf = INVALID_PAGE_NUM;
+	uint32_t expected_leaf = INVALID_PAGE_NUM;
+	for (uint32_t i = 0; i < check->num_items; i++) {
+		CheckItem* item = &check->items[i];
+		check->num_rows += item->num_rows;
+		if (item->first_leaf == INVALID_PAGE_NUM) {
+			continue;
+		}
+		if (previous_leaf != INVALID_PAGE_NUM && expected_leaf != item->first_leaf) {
+			check_error(check, "page %u: next leaf is %u, expected %u", previous_leaf, expected_leaf,
+			            item->first_leaf);
+		}
+		previous_leaf = item->last_leaf;
+		expected_leaf = item->last_next_leaf;
+	}
+	if (previous_leaf != INVALID_PAGE_NUM && expected_leaf != 0) {
+		check_error(check, "page %u: the last leaf points to page %u", previous_leaf, expected_leaf);
+	}
+	check_indexes(check);
+	check_freelist(check);
+}
+
+// 索引は1つのスレッドでたどる。エントリごとに行の木を引き、同じ値の行があるか確かめる
+static void check_indexes(Check* check) {
+	uint32_t header[PAGE_SIZE / sizeof(uint32_t)];
+	snapshot_read_page(check->table->pager, &check->snapshot, DB_HEADER_PAGE_NUM, header);
+	for (IndexColumn column = 0; column < INDEX_NUM_COLUMNS; column++) {
+		uint32_t root_page_num = *db_header_index_root(header, column);
+		if (root_page_num == 0 || !check_mark(check, root_page_num, DB_HEADER_PAGE_NUM)) {
+			continue;
+		}
+		CheckIndex index;
+		memset(&index, 0, sizeof(index));
+		index.column = column;
+		index.last_leaf = INVALID_PAGE_NUM;
+		CheckNode root = {root_page_num, DB_HEADER_PAGE_NUM, 1, false, 0, false, 0};
+		check_index_visit(check, &index, &root, NULL, NULL);
+		if (index.last_leaf != INVALID_PAGE_NUM && index.last_next_leaf != 0) {
+			check_error(check, "page %u: the last index leaf points to page %u", index.last_leaf,
+			            index.last_next_leaf);
+		}
+		if (index.num_entries != check->num_rows) {
+			check_error(check, "index on %s: %lu entries for %lu rows", column == INDEX_USERNAME ? "username" : "email",
+			            index.num_entries, check->num_rows);
+		}
+	}
+}
+
+// 索引のノードを調べる。キーは全て low 以上 high 未満でなければならない(NULL は制限なし)
+static void check_index_visit(Check* check, CheckIndex* index, const CheckNode* position, const IndexKey* low,
+                              const IndexKey* high) {
+	uint32_t page_num = position->page_num;
+	uint8_t* node = malloc(PAGE_SIZE + 2 * VARINT_MAX_SIZE);
+	memset(node + PAGE_SIZE, 0, 2 * VARINT_MAX_SIZE);
+	check_read_node(check, page_num, node);
+	NodeType type = get_node_type(node);
+	if (type != NODE_INDEX_LEAF && type != NODE_INDEX_INTERNAL) {
+		check_error(check, "page %u: node type %u in an index", page_num, type);
+		free(node);
+		return;
+	}
+	bool root = position->depth == 1;
+	if (is_node_root(node) != root) {
+		check_error(check, "page %u: root flag is %d", page_num, is_node_root(node));
+	}
+	if (!root && *node_parent(node) != position->parent_page_num) {
+		check_error(check, "page %u: parent pointer is %u, expected %u", page_num, *node_parent(node),
+		            position->parent_page_num);
+	}
+
+	uint32_t prefix_length = index_node_prefix_length(node);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t cells_start = LEAF_NODE_HEADER_SIZE + num_cells * LEAF_NODE_CELL_POINTER_SIZE;
+	if (prefix_length > INDEX_MAX_KEY_SIZE || cells_start > index_node_cells_end(prefix_length)) {
+		check_error(check, "page %u: %u cells and a %u byte prefix do not fit in an index node", page_num,
+		            num_cells, prefix_length);
+		free(node);
+		return;
+	}
+	uint32_t cells_end = index_node_cells_end(prefix_length);
+	for (uint32_t i = 0; i < num_cells; i++) {
+		// 残りの長さを読む前に、セルがセル領域の中から始まるか確かめる
+		uint32_t pointer = *leaf_node_cell_pointer(node, i);
+		uint32_t suffix_length = 0;
+		if (pointer >= cells_start && pointer < cells_end) {
+			index_cell_suffix(node + pointer, &suffix_length);
+		}
+		if (pointer < cells_start || pointer >= cells_end || suffix_length > INDEX_MAX_KEY_SIZE - prefix_length ||
+		    pointer + index_cell_size(node, node + pointer) > cells_end) {
+			check_error(check, "page %u: cell %u at offset %u is outside the cell area", page_num, i, pointer);
+			free(node);
+			return;
+		}
+	}
+
+	uint8_t buffer[INDEX_MAX_KEY_SIZE];
+	IndexKey key;
+	for (uint32_t i = 0; i < num_cells; i++) {
+		index_cell_key(node, i, buffer, &key);
+		if ((low != NULL && index_key_compare(&key, low) < 0) || (high != NULL && index_key_compare(&key, high) >= 0)) {
+			check_error(check, "page %u: index key %u is outside the range of its parent", page_num, i);
+		}
+	}
+
+	if (type == NODE_INDEX_LEAF) {
+		if (index->leaf_depth == 0) {
+			index->leaf_depth = position->depth;
+		} else if (index->leaf_depth != position->depth) {
+			check_error(check, "page %u: leaf at depth %u, other leaves are at depth %u", page_num, position->depth,
+			            index->leaf_depth);
+		}
+		if (index->last_leaf != INVALID_PAGE_NUM && index->last_next_leaf != page_num) {
+			check_error(check, "page %u: next leaf is %u, expected %u", index->last_leaf, index->last_next_leaf,
+			            page_num);
+		}
+		index->last_leaf = page_num;
+		index->last_next_leaf = *leaf_node_next_leaf(node);
+		for (uint32_t i = 0; i < num_cells; i++) {
+			index_cell_key(node, i, buffer, &key);
+			check_index_entry(check, index, page_num, &key);
+		}
+		free(node);
+		return;
+	}
+
+	// 子の範囲はこのノードのキーで区切る。キーはノードのコピーの中に作っておく
+	uint8_t* keys = malloc((size_t)num_cells * INDEX_MAX_KEY_SIZE);
+	IndexKey* separators = malloc(num_cells * sizeof(IndexKey));
+	for (uint32_t i = 0; i < num_cells; i++) {
+		index_cell_key(node, i, keys + (size_t)i * INDEX_MAX_KEY_SIZE, &separators[i]);
+		if (i > 0 && index_key_compare(&separators[i], &separators[i - 1]) <= 0) {
+			check_error(check, "page %u: index key %u is not greater than the previous key", page_num, i);
+		}
+	}
+	for (uint32_t i = 0; i <= num_cells; i++) {
+		CheckNode child = {index_node_child(node, i), page_num, position->depth + 1, false, 0, false, 0};
+		if (check_mark(check, child.page_num, page_num)) {
+			check_index_visit(check, index, &child, i > 0 ? &separators[i - 1] : low,
+			                  i < num_cells ? &separators[i] : high);
+		}
+	}
+	free(separators);
+	free(keys);
+	free(node);
+}
+
+// エントリが直前のエントリより後にあり、同じ値の行があるか確かめる
+static void check_index_entry(Check* check, CheckIndex* index, uint32_t page_num, const IndexKey* key) {
+	if (index->has_last && index_key_compare(key, &index->last) <= 0) {
+		check_error(check, "page %u: index key is not greater than the previous key", page_num);
+	}
+	index->has_last = true;
+	memcpy(index->last_data, key->data, key->length);
+	index->last.data = index->last_data;
+	index->last.length = key->length;
+	index->num_entries += 1;
+
+	uint32_t value_length = key->length - INDEX_KEY_SUFFIX_SIZE;
+	if (key->length < INDEX_KEY_SUFFIX_SIZE || key->data[value_length] != 0) {
+		check_error(check, "page %u: index key of %u bytes is not a value and an id", page_num, key->length);
+		return;
+	}
+	uint32_t id = index_key_id(key);
+	Cursor* cursor = snapshot_find(check->table, &check->snapshot, id);
+	bool found = cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+	             *leaf_node_key(cursor->node, cursor->cell_num) == id;
+	if (!found) {
+		check_error(check, "page %u: index entry for row %u, which does not exist", page_num, id);
+	} else {
+		RowView view;
+		row_view_from_cell(cursor_value(cursor), &view);
+		uint32_t length;
+		const char* value = row_view_column(&view, index->column, &length);
+		if (length != value_length || memcmp(value, key->data, length) != 0) {
+			check_error(check, "page %u: index entry for row %u does not match the row", page_num, id);
+		}
+	}
+	cursor_close(cursor);
+}
+
+static void check_error(Check* check, const char* format, ...) {
+	pthread_mutex_lock(&check->mutex);
+	if (check->num_errors < CHECK_MAX_REPORTED_ERRORS) {
+		va_list arguments;
+		va_start(arguments, format);
+		printf("Error: ");
+		vprintf(format, arguments);
+		printf("\n");
+		va_end(arguments);
+	}
+	check->num_errors += 1;
+	pthread_mutex_unlock(&check->mutex);
+}
+
+// ページを見つけたことを記録する。範囲外か、既に見つけていたページなら false
+static bool check_mark(Check* check, uint32_t page_num, uint32_t from_page_num) {
+	if (page_num == DB_HEADER_PAGE_NUM || page_num >= check->num_pages) {
+		check_error(check, "page %u: refers to page %u outside the database", from_page_num, page_num);
+		return false;
+	}
+	uint8_t bit = 1 << (page_num % 8);
+	if (__atomic_fetch_or(&check->seen[page_num / 8], bit, __ATOMIC_RELAXED) & bit) {
+		check_error(check, "page %u: refers to page %u, which is already in use", from_page_num, page_num);
+		return false;
+	}
+	return true;
+}
+
+static void check_read_node(Check* check, uint32_t page_num, void* node) {
+	snapshot_read_page(check->table->pager, &check->snapshot, page_num, node);
+}
+
+static bool check_node_header(Check* check, const CheckNode* position, void* node) {
+	uint8_t type = *((uint8_t*)node + NODE_TYPE_OFFSET);
+	if (type != NODE_INTERNAL && type != NODE_LEAF) {
+		check_error(check, "page %u: unknown node type %u", position->page_num, type);
+		return false;
+	}
+	bool root = position->depth == 1;
+	if (is_node_root(node) != root) {
+		check_error(check, "page %u: root flag is %d", position->page_num, is_node_root(node));
+	}
+	if (!root && *node_parent(node) != position->parent_page_num) {
+		check_error(check, "page %u: parent pointer is %u, expected %u", position->page_num, *node_parent(node),
+		            position->parent_page_num);
+	}
+	return true;
+}
+
+static bool check_key_in_range(const CheckNode* position, uint32_t key) {
+	return (!position->has_low || key > position->low) && (!position->has_high || key <= position->high);
+}
+
+static void check_leaf(Check* check, const CheckNode* position, void* node, CheckItem* item) {
+	uint32_t page_num = position->page_num;
+	uint32_t expected_depth = 0;
+	if (!__atomic_compare_exchange_n(&check->leaf_depth, &expected_depth, position->depth, false,
+	                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED) &&
+	    expected_depth != position->depth) {
+		check_error(check, "page %u: leaf at depth %u, other leaves are at depth %u", page_num, position->depth,
+		            expected_depth);
+	}
+
+	if (item->first_leaf == INVALID_PAGE_NUM) {
+		item->first_leaf = page_num;
+	} else if (item->last_next_leaf != page_num) {
+		check_error(check, "page %u: next leaf is %u, expected %u", item->last_leaf, item->last_next_leaf,
+		            page_num);
+	}
+	item->last_leaf = page_num;
+	item->last_next_leaf = *leaf_node_next_leaf(node);
+
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t cells_start = LEAF_NODE_HEADER_SIZE + num_cells * LEAF_NODE_CELL_POINTER_SIZE;
+	if (cells_start > PAGE_SIZE) {
+		check_error(check, "page %u: %u cells do not fit in a leaf", page_num, num_cells);
+		return;
+	}
+	item->num_rows += num_cells;
+	for (uint32_t i = 0; i < num_cells; i++) {
+		uint32_t pointer = *leaf_node_cell_pointer(node, i);
+		if (pointer < cells_start || pointer + LEAF_NODE_KEY_SIZE > PAGE_SIZE ||
+		    pointer + leaf_node_cell_size(node, i) > PAGE_SIZE) {
+			check_error(check, "page %u: cell %u at offset %u is outside the cell area", page_num, i, pointer);
+			return;
+		}
+		uint32_t key = *leaf_node_key(node, i);
+		if (i > 0 && key <= *leaf_node_key(node, i - 1)) {
+			check_error(check, "page %u: key %u is not greater than the previous key", page_num, key);
+		}
+		if (!check_key_in_range(position, key)) {
+			check_error(check, "page %u: key %u is outside the range of its parent", page_num, key);
+		}
+	}
+}
+
+// 内部ノードのキーを確かめ、子とその範囲を children に並べる。子の数を返す
+static uint32_t check_internal(Check* check, const CheckNode* position, void* node, CheckNode* children) {
+	uint32_t page_num = position->page_num;
+	uint32_t num_keys = *internal_node_num_keys(node);
+	if (num_keys == 0 || num_keys > INTERNAL_NODE_MAX_CELLS) {
+		check_error(check, "page %u: internal node with %u keys", page_num, num_keys);
+		return 0;
+	}
+	for (uint32_t i = 0; i <= num_keys; i++) {
+		CheckNode* child = &children[i];
+		*child = *position;
+		child->page_num = *internal_node_child(node, i);
+		child->parent_page_num = page_num;
+		child->depth = position->depth + 1;
+		if (i > 0) {
+			child->has_low = true;
+			child->low = *internal_node_key(node, i - 1);
+		}
+		if (i < num_keys) {
+			uint32_t key = *internal_node_key(node, i);
+			if (i > 0 && key <= child->low) {
+				check_error(check, "page %u: key %u is not greater than the previous key", page_num, key);
+			}
+			if (!check_key_in_range(position, key)) {
+				check_error(check, "page %u: key %u is outside the range of its parent", page_num, key);
+			}
+			child->has_high = true;
+			child->high = key;
+		}
+	}
+	return num_keys + 1;
+}
+
+// 深さ優先でキーの順に調べる。ノードはスタックにコピーする
+// 壊れたセルの大きさを読む時にページの外を読まないよう、ページの後ろはゼロで埋めておく
+static void check_visit(Check* check, const CheckNode* position, CheckItem* item) {
+	uint32_t node[(PAGE_SIZE + 2 * VARINT_MAX_SIZE) / sizeof(uint32_t) + 1];
+	memset((uint8_t*)node + PAGE_SIZE, 0, sizeof(node) - PAGE_SIZE);
+	check_read_node(check, position->page_num, node);
+	if (!check_node_header(check, position, node)) {
+		return;
+	}
+	if (get_node_type(node) == NODE_LEAF) {
+		check_leaf(check, position, node, item);
+		return;
+	}
+	CheckNode* children = malloc((INTERNAL_NODE_MAX_CELLS + 1) * sizeof(CheckNode));
+	uint32_t num_children = check_internal(check, position, node, children);
+	for (uint32_t i = 0; i < num_children; i++) {
+		if (check_mark(check, children[i].page_num, position->page_num)) {
+			check_visit(check, &children[i], item);
+		}
+	}
+	free(children);
+}
+
+static void check_run(Check* check, uint32_t num_threads, void* (*worker)(void*)) {
+	pthread_t threads[CHECK_MAX_THREADS];
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, worker, check);
+	}
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+// 部分木を1つずつ取って調べる
+static void* check_tree_worker(void* argument) {
+	Check* check = argument;
+	while (true) {
+		uint32_t i = __atomic_fetch_add(&check->next_item, 1, __ATOMIC_RELAXED);
+		if (i >= check->num_items) {
+			break;
+		}
+		CheckItem* item = &check->items[i];
+		if (check_mark(check, item->node.page_num, item->node.parent_page_num)) {
+			check_visit(check, &item->node, item);
+		}
+	}
+	return NULL;
+}
+
+// ファイルのページを CHECK_READ_PAGES ずつ取って、チェックサムを確かめる
+static void* check_pages_worker(void* argument) {
+	Check* check = argument;
+	Pager* pager = check->table->pager;
+	uint8_t* pages = malloc((size_t)CHECK_READ_PAGES * PAGE_SIZE);
+	while (true) {
+		uint32_t first = __atomic_fetch_add(&check->next_file_page, CHECK_READ_PAGES, __ATOMIC_RELAXED);
+		if (first >= check->file_pages) {
+			break;
+		}
+		uint32_t count = check->file_pages - first < CHECK_READ_PAGES ? check->file_pages - first : CHECK_READ_PAGES;
+		// チェックポイントが書き戻している途中のページを読まないようにする
+		pthread_rwlock_rdlock(&pager->io_lock);
+		ssize_t bytes_read = 0;
+		if (pager->page_map != NULL) {
+			bytes_read = (ssize_t)count * PAGE_SIZE;
+			for (uint32_t i = 0; i < count; i++) {
+				if (!page_map_read(pager->page_map, first + i, pages + (size_t)i * PAGE_SIZE)) {
+					check_error(check, "page %u: bad compressed extent", first + i);
+					memset(pages + (size_t)i * PAGE_SIZE, 0, PAGE_SIZE);
+				}
+			}
+		} else {
+			bytes_read = pread(pager->file_descriptor, pages, (size_t)count * PAGE_SIZE, (off_t)first * PAGE_SIZE);
+		}
+		pthread_rwlock_unlock(&pager->io_lock);
+		if (bytes_read != (ssize_t)count * PAGE_SIZE) {
+			check_error(check, "pages %u-%u: short read of %zd bytes", first, first + count - 1, bytes_read);
+			continue;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			if (!page_checksum_valid(pages + (size_t)i * PAGE_SIZE)) {
+				check_error(check, "page %u: checksum mismatch", first + i);
+			}
+		}
+	}
+	free(pages);
+	return NULL;
+}
+
+// 空きページのリストをたどり、木にも空きページのリストにもないページがないか確かめる
+static void check_freelist(Check* check) {
+	uint32_t header[PAGE_SIZE / sizeof(uint32_t)];
+	snapshot_read_page(check->table->pager, &check->snapshot, DB_HEADER_PAGE_NUM, header);
+	uint32_t free_count = 0;
+	uint32_t from_page_num = DB_HEADER_PAGE_NUM;
+	uint32_t trunk[PAGE_SIZE / sizeof(uint32_t)];
+	for (uint32_t trunk_page_num = *db_header_freelist_head(header); trunk_page_num != 0;
+	     trunk_page_num = *freelist_trunk_next(trunk)) {
+		if (!check_mark(check, trunk_page_num, from_page_num)) {
+			break;
+		}
+		free_count += 1;
+		snapshot_read_page(check->table->pager, &check->snapshot, trunk_page_num, trunk);
+		uint32_t num_leaves = *freelist_trunk_num_leaves(trunk);
+		if (num_leaves > FREELIST_TRUNK_MAX_LEAVES) {
+			check_error(check, "page %u: free list trunk with %u pages", trunk_page_num, num_leaves);
+			break;
+		}
+		for (uint32_t i = 0; i < num_leaves; i++) {
+			if (check_mark(check, *freelist_trunk_leaf(trunk, i), trunk_page_num)) {
+				free_count += 1;
+			}
+		}
+		from_page_num = trunk_page_num;
+	}
+	if (free_count != *db_header_freelist_count(header)) {
+		check_error(check, "header: free page count is %u, found %u", *db_header_freelist_count(header),
+		            free_count);
+	}
+
+	uint32_t num_lost = 0;
+	uint32_t first_lost = 0;
+	for (uint32_t page_num = 1; page_num < check->num_pages; page_num++) {
+		if (!(check->seen[page_num / 8] & (1 << (page_num % 8)))) {
+			if (num_lost == 0) {
+				first_lost = page_num;
+			}
+			num_lost += 1;
+		}
+	}
+	if (num_lost > 0) {
+		check_error(check, "%u pages are neither in the tree nor free (the first is page %u)", num_lost,
+		            first_lost);
+	}
+}
+
+// キーの位置を返す
+// キーが存在しない場合、キーが挿入されるべき位置を返す
+// 書き手が使う。返すカーソルは葉をピンしている
+static Cursor* table_find(Table* table, uint32_t key) {
+	uint32_t root_page_num = table->root_page_num;
+	void* root_node = get_page(table->pager, root_page_num);
+	NodeType root_type = get_node_type(root_node);
+	unpin_page(table->pager, root_page_num);
+
+	if (root_type == NODE_LEAF) {
+		stats_record_find(table->pager, 1, 2);
+		return leaf_node_find(table, root_page_num, key);
+	} else {
+		return internal_node_find(table, root_page_num, key, 1);
+	}
+}
+
+// 読み手が使う table_find。根からスナップショットの時点の内容をたどり、葉のコピーを持ったカーソルを返す
+// 書き手が途中まで分割した木を見ることはない
+static Cursor* snapshot_find(Table* table, Snapshot* snapshot, uint32_t key) {
+	Cursor* cursor = malloc(sizeof(Cursor));
+	cursor->table = table;
+	cursor->snapshot = snapshot;
+	cursor->owns_snapshot = false;
+	// 葉と、先読みに使う親のコピー
+	cursor->node = malloc(PAGE_SIZE * 2);
+	cursor->prefetch_node = cursor->node + PAGE_SIZE;
+	cursor->prefetch_parent = INVALID_PAGE_NUM;
+	cursor->prefetch_end = 0;
+	cursor->prefetch_window = PAGER_READAHEAD_MIN_WINDOW;
+	cursor->prefetch_expected = INVALID_PAGE_NUM;
+
+	void* node = cursor->node;
+	uint32_t page_num = table->root_page_num;
+	uint32_t depth = 1;
+	snapshot_read_page(table->pager, snapshot, page_num, node);
+	while (get_node_type(node) == NODE_INTERNAL) {
+		page_num = *internal_node_child(node, internal_node_find_child(node, key));
+		snapshot_read_page(table->pager, snapshot, page_num, node);
+		depth += 1;
+	}
+	stats_record_find(table->pager, depth, depth);
+	cursor->page_num = page_num;
+	cursor->cell_num = leaf_node_find_cell(node, key);
+	return cursor;
+}
+
+// key 以上の最初の行を指すカーソルを返す。そのような行がなければ end_of_table
+static Cursor* table_seek(Table* table, Snapshot* snapshot, uint32_t key) {
+	Cursor* cursor = snapshot_find(table, snapshot, key);
+	cursor->end_of_table = false;
+
+	uint32_t num_cells = *leaf_node_num_cells(cursor->node);
+	if (cursor->cell_num >= num_cells) {
+		// 葉の全てのキーより大きい。最後のセルから1つ進めて次の葉に移る
+		if (num_cells == 0) {
+			cursor->end_of_table = true;
+		} else {
+			cursor->cell_num = num_cells - 1;
+			cursor_advance(cursor);
+		}
+	}
+	return cursor;
+}
+
+// 右端の葉の最大キーより大きいキーなら、その葉の末尾を指すカーソルを返す
+// 追記でなければ NULL を返すので、table_find で根からたどる
+static Cursor* table_find_append(Table* table, uint32_t key) {
+	uint32_t page_num = table->rightmost_leaf_page_num;
+	if (page_num == INVALID_PAGE_NUM) {
+		return NULL;
+	}
+	void* node = get_page(table->pager, page_num);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	if (get_node_type(node) != NODE_LEAF || *leaf_node_next_leaf(node) != 0 ||
+	    num_cells == 0 || key <= *leaf_node_key(node, num_cells - 1)) {
+		unpin_page(table->pager, page_num);
+		return NULL;
+	}
+
+	Cursor* cursor = malloc(sizeof(Cursor));
+	cursor->table = table;
+	cursor->page_num = page_num;
+	cursor->node = node;
+	cursor->snapshot = NULL;
+	cursor->owns_snapshot = false;
+	cursor->cell_num = num_cells;
+	cursor->end_of_table = true;
+	return cursor;
+}
+
+// 二分探索でleaf nodeを探索
+// 返すカーソルはリーフのピンを保持する。cursor_close で解放すること
+static Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
+	void* node = get_page(table->pager, page_num);
+
+	Cursor* cursor = malloc(sizeof(Cursor));
+	cursor->table = table;
+	cursor->page_num = page_num;
+	cursor->node = node;
+	cursor->snapshot = NULL;
+	cursor->owns_snapshot = false;
+	cursor->cell_num = leaf_node_find_cell(node, key);
+	return cursor;
+}
+
+// キーのセルの位置を返す。キーがなければ挿入されるべき位置
+static uint32_t leaf_node_find_cell(void* node, uint32_t key) {
+	uint32_t num_cells = *leaf_node_num_cells(node);
+
+	// Binary search
+	// キーの位置か新しいキーを挿入するために移動させる必要がある別のキーの位置or最後のキーの1つ前の位置
+	uint32_t min_index = 0;
+	uint32_t one_past_max_index = num_cells;
+	while (one_past_max_index != min_index) {
+		uint32_t index = (min_index + one_past_max_index) / 2;
+		uint32_t key_at_index = *leaf_node_key(node, index);
+		if (key == key_at_index) {
+			return index;
+		}
+		if (key < key_at_index) {
+			one_past_max_index = index;
+		} else {
+			min_index = index + 1;
+		}
+	}
+
+	return min_index;
+}
+
+static NodeType get_node_type(void* node) {
+	uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+	return (NodeType)value;
+}
+
+static void set_node_type(void* node, NodeType type) {
+	uint8_t value = type;
+	*((uint8_t*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+static void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+	// 新しいノードを作成し、セルの半分を移動
+	// 2つのノードのうち1つに新しい値を挿入
+	// 親を更新するか、新しい親を作成
+	Pager* pager = cursor->table->pager;
+	stats_add(&pager->stats.leaf_splits, 1);
+	void* old_node = get_page(pager, cursor->page_num);
+	uint32_t old_max = get_node_max_key(pager, old_node);
+	uint32_t new_page_num = get_unused_page_num(pager);
+	void* new_node = get_page(pager, new_page_num);
+	mark_page_dirty(pager, cursor->page_num);
+	mark_page_dirty(pager, new_page_num);
+	initialize_leaf_node(new_node);
+	*node_parent(new_node) = *node_parent(old_node);
+
+	// 既存のセルと新しいセルを、キー順にセルの大きさとともに並べる
+	uint32_t num_cells = *leaf_node_num_cells(old_node);
+	uint32_t total = num_cells + 1;
+	uint32_t new_cell[LEAF_NODE_MAX_CELL_SIZE / sizeof(uint32_t)];
+	uint32_t new_cell_size = leaf_cell_from_row(value, new_cell);
+	uint32_t original[PAGE_SIZE / sizeof(uint32_t)];
+	memcpy(original, old_node, PAGE_SIZE);
+	uint32_t total_bytes = 0;
+	for (uint32_t i = 0; i < num_cells; i++) {
+		total_bytes += leaf_node_cell_size(original, i) + LEAF_NODE_CELL_POINTER_SIZE;
+	}
+	total_bytes += new_cell_size + LEAF_NODE_CELL_POINTER_SIZE;
+
+	// 右端の葉の末尾への追記(昇順の挿入)では、古いノードを満杯のまま残し
+	// 新しいキーだけを新しいノードに置く。そうでなければバイト数で均等に分割する
+	uint32_t left_split_count = 0;
+	if (*leaf_node_next_leaf(original) == 0) {
+		if (cursor->cell_num == num_cells) {
+			left_split_count = num_cells;
+		}
+		cursor->table->rightmost_leaf_page_num = new_page_num;
+	}
+	if (left_split_count == 0) {
+		uint32_t left_bytes = 0;
+		while (left_split_count < total - 1 && left_bytes * 2 < total_bytes) {
+			uint32_t i = left_split_count;
+			uint32_t size = i == cursor->cell_num ? new_cell_size
+			              : leaf_node_cell_size(original, i < cursor->cell_num ? i : i - 1);
+			left_bytes += size + LEAF_NODE_CELL_POINTER_SIZE;
+			left_split_count += 1;
+		}
+	}
+
+	// リーフノードを分割するたびに、兄弟ポインターを更新
+	*leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(original);
+
+	// 古いノードを空にしてから、左右のノードにキー順にセルを詰め直す
+	initialize_leaf_node(old_node);
+	set_node_root(old_node, is_node_root(original));
+	*node_parent(old_node) = *node_parent(original);
+	*leaf_node_next_leaf(old_node) = new_page_num;
+	for (uint32_t i = 0; i < total; i++) {
+		void* destination_node = i < left_split_count ? old_node : new_node;
+		uint32_t index_within_node = i < left_split_count ? i : i - left_split_count;
+		if (i == cursor->cell_num) {
+			leaf_node_put_cell(destination_node, index_within_node, new_cell, new_cell_size);
+		} else {
+			uint32_t old_index = i < cursor->cell_num ? i : i - 1;
+			leaf_node_put_cell(destination_node, index_within_node, leaf_node_cell(original, old_index),
+			                   leaf_node_cell_size(original, old_index));
+		}
+	}
+	
+	// ノードの親を更新
+	// 元のノードがルートであった場合、そのノードには親がない。
+	// この場合、新しいルート・ノードを作成して、親として機能させる
+	bool was_root = is_node_root(old_node);
+	uint32_t parent_page_num = *node_parent(old_node);
+	uint32_t new_max = get_node_max_key(pager, old_node);
+	unpin_page(pager, cursor->page_num);
+	unpin_page(pager, new_page_num);
+
+	if (was_root) {
+	  return create_new_root(cursor->table, new_page_num);
+	} else {
+		void* parent = get_page(pager, parent_page_num);
+		mark_page_dirty(pager, parent_page_num);
+		update_internal_node_key(parent, old_max, new_max);
+		unpin_page(pager, parent_page_num);
+
+		internal_node_insert(cursor->table, parent_page_num, new_page_num);
+		return;
+	}
+}
+
+// 空きページがあればそれを、なければファイルの末尾の次のページを返す
+// 最初のトランクページに葉ページが残っていればその1つを、なければトランクページ自体を使う
+static uint32_t get_unused_page_num(Pager* pager) {
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+	uint32_t trunk_page_num = *db_header_freelist_head(header);
+	if (trunk_page_num == 0) {
+		uint32_t page_num = pager->num_pages;
+		*db_header_page_count(header) = page_num + 1;
+		unpin_page(pager, DB_HEADER_PAGE_NUM);
+		return page_num;
+	}
+
+	void* trunk = get_page(pager, trunk_page_num);
+	uint32_t num_leaves = *freelist_trunk_num_leaves(trunk);
+	uint32_t page_num;
+	if (num_leaves > 0) {
+		mark_page_dirty(pager, trunk_page_num);
+		page_num = *freelist_trunk_leaf(trunk, num_leaves - 1);
+		*freelist_trunk_num_leaves(trunk) = num_leaves - 1;
+	} else {
+		page_num = trunk_page_num;
+		*db_header_freelist_head(header) = *freelist_trunk_next(trunk);
+	}
+	*db_header_freelist_count(header) -= 1;
+	unpin_page(pager, trunk_page_num);
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+	return page_num;
+}
+
+// 使われなくなったページを空きページのリストに加える
+// 最初のトランクページに空きがなければ、このページを新しいトランクページにする
+static void pager_free_page(Pager* pager, uint32_t page_num) {
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+	uint32_t trunk_page_num = *db_header_freelist_head(header);
+	if (trunk_page_num != 0) {
+		void* trunk = get_page(pager, trunk_page_num);
+		uint32_t num_leaves = *freelist_trunk_num_leaves(trunk);
+		if (num_leaves < FREELIST_TRUNK_MAX_LEAVES) {
+			mark_page_dirty(pager, trunk_page_num);
+			*freelist_trunk_leaf(trunk, num_leaves) = page_num;
+			*freelist_trunk_num_leaves(trunk) = num_leaves + 1;
+			*db_header_freelist_count(header) += 1;
+			unpin_page(pager, trunk_page_num);
+			unpin_page(pager, DB_HEADER_PAGE_NUM);
+			return;
+		}
+		unpin_page(pager, trunk_page_num);
+	}
+
+	void* page = get_page(pager, page_num);
+	mark_page_dirty(pager, page_num);
+	memset(page, 0, PAGE_SIZE);
+	*freelist_trunk_next(page) = trunk_page_num;
+	*db_header_freelist_head(header) = page_num;
+	*db_header_freelist_count(header) += 1;
+	unpin_page(pager, page_num);
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+}
+
+// 空きページのリストから特定のページを取り除く。リストになければ false
+// トランクページを取り除く時は、そのトランクページの葉ページの1つを代わりのトランクページにする
+static bool freelist_remove(Pager* pager, uint32_t page_num) {
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	uint32_t previous_page_num = DB_HEADER_PAGE_NUM;
+	uint32_t trunk_page_num = *db_header_freelist_head(header);
+	bool found = false;
+	while (trunk_page_num != 0 && !found) {
+		void* trunk = get_page(pager, trunk_page_num);
+		uint32_t num_leaves = *freelist_trunk_num_leaves(trunk);
+		uint32_t next_page_num = *freelist_trunk_next(trunk);
+		if (trunk_page_num == page_num) {
+			uint32_t replacement = next_page_num;
+			if (num_leaves > 0) {
+				replacement = *freelist_trunk_leaf(trunk, num_leaves - 1);
+				void* new_trunk = get_page(pager, replacement);
+				mark_page_dirty(pager, replacement);
+				memcpy(new_trunk, trunk, PAGE_SIZE);
+				*freelist_trunk_num_leaves(new_trunk) = num_leaves - 1;
+				unpin_page(pager, replacement);
+			}
+			void* previous = get_page(pager, previous_page_num);
+			mark_page_dirty(pager, previous_page_num);
+			if (previous_page_num == DB_HEADER_PAGE_NUM) {
+				*db_header_freelist_head(previous) = replacement;
+			} else {
+				*freelist_trunk_next(previous) = replacement;
+			}
+			unpin_page(pager, previous_page_num);
+			found = true;
+		} else {
+			for (uint32_t i = 0; i < num_leaves; i++) {
+				if (*freelist_trunk_leaf(trunk, i) == page_num) {
+					mark_page_dirty(pager, trunk_page_num);
+					*freelist_trunk_leaf(trunk, i) = *freelist_trunk_leaf(trunk, num_leaves - 1);
+					*freelist_trunk_num_leaves(trunk) = num_leaves - 1;
+					found = true;
+					break;
+				}
+			}
+		}
+		unpin_page(pager, trunk_page_num);
+		previous_page_num = trunk_page_num;
+		trunk_page_num = next_page_num;
+	}
+	if (found) {
+		mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+		*db_header_freelist_count(header) -= 1;
+	}
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+	return found;
+}
+
+static uint32_t* db_header_magic(void* header) {
+	return header + DB_HEADER_MAGIC_OFFSET;
+}
+
+static uint32_t* db_header_version(void* header) {
+	return header + DB_HEADER_VERSION_OFFSET;
+}
+
+static uint32_t* db_header_root_page(void* header) {
+	return header + DB_HEADER_ROOT_PAGE_OFFSET;
+}
+
+static uint32_t* db_header_freelist_head(void* header) {
+	return header + DB_HEADER_FREELIST_HEAD_OFFSET;
+}
+
+static uint32_t* db_header_freelist_count(void* header) {
+	return header + DB_HEADER_FREELIST_COUNT_OFFSET;
+}
+
+static uint32_t* db_header_page_count(void* header) {
+	return header + DB_HEADER_PAGE_COUNT_OFFSET;
+}
+
+static uint32_t* db_header_index_root(void* header, IndexColumn column) {
+	return header + DB_HEADER_INDEX_ROOTS_OFFSET + column * sizeof(uint32_t);
+}
+
+static uint32_t* freelist_trunk_next(void* page) {
+	return page + FREELIST_TRUNK_NEXT_OFFSET;
+}
+
+static uint32_t* freelist_trunk_num_leaves(void* page) {
+	return page + FREELIST_TRUNK_NUM_LEAVES_OFFSET;
+}
+
+static uint32_t* freelist_trunk_leaf(void* page, uint32_t leaf_num) {
+	return page + FREELIST_TRUNK_HEADER_SIZE + leaf_num * sizeof(uint32_t);
+}
+
+// ルートの分割を処理する。
+// 古いルートは新しいページにコピーされ、左の子になる。
+// 右の子のアドレスが渡される。
+// 新しいルート・ノードが含まれるようにルート・ページを再初期化する。
+// 新しいルート・ノードが2つの子を指す。
+// 古いルートが内部ノードの場合は、その子の親ポインタを左の子に付け替える。
+//
+static void create_new_root(Table* table, uint32_t right_child_page_num) {
+	Pager* pager = table->pager;
+	void* root = get_page(pager, table->root_page_num);
+	void* right_child = get_page(pager, right_child_page_num);
+	uint32_t left_child_page_num = get_unused_page_num(pager);
+	void* left_child = get_page(pager, left_child_page_num);
+	mark_page_dirty(pager, table->root_page_num);
+	mark_page_dirty(pager, right_child_page_num);
+	mark_page_dirty(pager, left_child_page_num);
+
+	// 左の子のデータをrootにコピー
+	memcpy(left_child, root, PAGE_SIZE);
+	set_node_root(left_child, false);
+	if (get_node_type(left_child) == NODE_INTERNAL) {
+		uint32_t num_keys = *internal_node_num_keys(left_child);
+		for (uint32_t i = 0; i <= num_keys; i++) {
+			uint32_t child_page_num = *internal_node_child(left_child, i);
+			void* child = get_page(pager, child_page_num);
+			mark_page_dirty(pager, child_page_num);
+			*node_parent(child) = left_child_page_num;
+			unpin_page(pager, child_page_num);
+		}
+	}
+
+	// ルートページを新しい内部ノードとして初期化し、2つの子ノードを作成
+	initialize_internal_node(root);
+	set_node_root(root, true);
+	*internal_node_num_keys(root) = 1;
+	*internal_node_child(root, 0) = left_child_page_num;
+	uint32_t left_child_max_key = get_node_max_key(pager, left_child);
+	*internal_node_key(root, 0) = left_child_max_key;
+	*internal_node_right_child(root) = right_child_page_num;
+	*node_parent(left_child) = table->root_page_num;
+	*node_parent(right_child) = table->root_page_num;
+
+	unpin_page(pager, table->root_page_num);
+	unpin_page(pager, right_child_page_num);
+	unpin_page(pager, left_child_page_num);
+}
+
+static uint32_t* internal_node_num_keys(void* node) {
+	return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+static uint32_t* internal_node_right_child(void* node) {
+	return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+#ifndef INTERNAL_NODE_SEPARATE_KEYS
+static uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
+	return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+#endif
+
+static uint32_t* internal_node_child(void* node, uint32_t child_num) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+	if (child_num > num_keys) {
+		printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+		exit(EXIT_FAILURE);
+	} else if (child_num == num_keys) {
+		return internal_node_right_child(node);
+	} else {
+#ifdef INTERNAL_NODE_SEPARATE_KEYS
+		return node + INTERNAL_NODE_CHILDREN_OFFSET + child_num * INTERNAL_NODE_CHILD_SIZE;
+#else
+		return internal_node_cell(node, child_num);
+#endif
+	}
+}
+
+static uint32_t* internal_node_key(void* node, uint32_t key_num) {
+#ifdef INTERNAL_NODE_SEPARATE_KEYS
+	return node + INTERNAL_NODE_KEYS_OFFSET + key_num * INTERNAL_NODE_KEY_SIZE;
+#else
+	return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+#endif
+}
+
+// 内部ノードの場合、最大キーは右の子の部分木の最大キー
+// 葉ノードでは、最大インデックスのキー
+//
+static uint32_t get_node_max_key(Pager* pager, void* node) {
+	if (get_node_type(node) == NODE_LEAF) {
+		return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+	}
+	uint32_t right_child_page_num = *internal_node_right_child(node);
+	void* right_child = get_page(pager, right_child_page_num);
+	uint32_t max_key = get_node_max_key(pager, right_child);
+	unpin_page(pager, right_child_page_num);
+	return max_key;
+}
+
+static bool is_node_root(void* node) {
+	uint8_t value = *((uint8_t*)(node + IS_ROOT_OFFSET));
+	return (bool)value;
+}
+
+static void set_node_root(void* node, bool is_root) {
+	uint8_t value = is_root;
+	*((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+static void indent(uint32_t level) {
+	for (uint32_t i = 0; i < level; i++) {
+		printf("  ");
+	}
+}
+
+static void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys, child;
+
+  switch (get_node_type(node)) {
+    case (NODE_LEAF):
+      num_keys = *leaf_node_num_cells(node);
+      indent(indentation_level);
+      printf("- leaf (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        indent(indentation_level + 1);
+        printf("- %d\n", *leaf_node_key(node, i));
+      }
+      break;
+    case (NODE_INTERNAL):
+      num_keys = *internal_node_num_keys(node);
+      indent(indentation_level);
+      printf("- internal (size %d)\n", num_keys);
+      for (uint32_t i = 0; i < num_keys; i++) {
+        child = *internal_node_child(node, i);
+        print_tree(pager, child, indentation_level + 1);
+
+        indent(indentation_level + 1);
+        printf("- key %d\n", *internal_node_key(node, i));
+      }
+      child = *internal_node_right_child(node);
+      print_tree(pager, child, indentation_level + 1);
+      break;
+    default:
+      // 索引のノードは主の木にはない
+      break;
+  }
+  unpin_page(pager, page_num);
+}
+
+// keys[0], keys[INTERNAL_NODE_KEY_STRIDE], ... のうち key より小さいキーの数を数える
+// AVX2なら8レーン、SSE2なら4レーンずつまとめて比較し、余りはスカラーで数える
+static uint32_t count_keys_less_than(const uint32_t* keys, uint32_t num_keys, uint32_t key) {
+	const uint32_t stride = INTERNAL_NODE_KEY_STRIDE;
+	uint32_t count = 0;
+	uint32_t i = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+	// 交互レイアウトでは最後のキーの後ろの子まで読むので、1つ手前で止める
+	uint32_t vector_limit = (stride == 1 || num_keys == 0) ? num_keys : num_keys - 1;
+#endif
+#if defined(__AVX2__)
+	// 符号なし比較を符号付き比較で行うため、最上位ビットを反転させる
+	const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+	const __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+	const uint32_t keys_per_vector = 8 / stride;
+	const int lane_mask = stride == 1 ? 0xFF : 0x55;
+	for (; i + keys_per_vector <= vector_limit; i += keys_per_vector) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(keys + i * stride));
+		__m256i less = _mm256_cmpgt_epi32(target, _mm256_xor_si256(v, bias));
+		count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)) & lane_mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	const __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+	const uint32_t keys_per_vector = 4 / stride;
+	const int lane_mask = stride == 1 ? 0xF : 0x5;
+	for (; i + keys_per_vector <= vector_limit; i += keys_per_vector) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(keys + i * stride));
+		__m128i less = _mm_cmpgt_epi32(target, _mm_xor_si128(v, bias));
+		count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)) & lane_mask);
+	}
+#endif
+
+	for (; i < num_keys; i++) {
+		count += keys[i * stride] < key;
+	}
+	return count;
+}
+
+// key 以上の最初のキーの位置(子の番号)を返す
+// 分岐のない二分探索で候補を KEY_SEARCH_LINEAR_THRESHOLD 個まで絞り、残りはまとめて比較する
+static uint32_t internal_node_find_child(void* node, uint32_t key) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+	const uint32_t* keys = internal_node_key(node, 0);
+	const uint32_t stride = INTERNAL_NODE_KEY_STRIDE;
+
+	// 答えは常に [base, base + n] の範囲にある
+	uint32_t base = 0;
+	uint32_t n = num_keys;
+	while (n > KEY_SEARCH_LINEAR_THRESHOLD) {
+		uint32_t half = n / 2;
+		base = (keys[(base + half - 1) * stride] < key) ? base + half : base;
+		n -= half;
+	}
+
+	return base + count_keys_less_than(keys + base * stride, n, key);
+}
+
+// depth は根から page_num までのノード数
+static Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key, uint32_t depth) {
+  void* node = get_page(table->pager, page_num);
+
+  uint32_t child_index = internal_node_find_child(node, key);
+  uint32_t child_num = *internal_node_child(node, child_index);
+  unpin_page(table->pager, page_num);
+  void* child = get_page(table->pager, child_num);
+  NodeType child_type = get_node_type(child);
+  unpin_page(table->pager, child_num);
+  switch (child_type) {
+    case NODE_LEAF:
+      // table_find で根を、各段でノードと子を、leaf_node_find で葉を読む
+      stats_record_find(table->pager, depth + 1, 2 * (depth + 1));
+      return leaf_node_find(table, child_num, key);
+    default:
+      return internal_node_find(table, child_num, key, depth + 1);
+  }
+}
+
+static uint32_t* leaf_node_next_leaf(void* node) {
+	return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+static uint32_t* node_parent(void* node) {
+	return node + PARENT_POINTER_OFFSET;
+}
+
+// 右の子の最大キーは親に保存されていないので、更新するキーはない
+static void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
+	uint32_t old_child_index = internal_node_find_child(node, old_key);
+	if (old_child_index < *internal_node_num_keys(node)) {
+		*internal_node_key(node, old_child_index) = new_key;
+	}
+}
+
+static void internal_node_insert(Table* table, uint32_t parent_page_num,
+                          uint32_t child_page_num) {
+  /*
+  Add a new child/key pair to parent that corresponds to child
+  */
+
+  Pager* pager = table->pager;
+  stats_add(&pager->stats.internal_inserts, 1);
+  void* parent = get_page(pager, parent_page_num);
+  uint32_t original_num_keys = *internal_node_num_keys(parent);
+
+  if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+    unpin_page(pager, parent_page_num);
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
+  }
+
+  void* child = get_page(pager, child_page_num);
+  mark_page_dirty(pager, parent_page_num);
+  uint32_t child_max_key = get_node_max_key(pager, child);
+  uint32_t index = internal_node_find_child(parent, child_max_key);
+
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
+  uint32_t right_child_page_num = *internal_node_right_child(parent);
+  void* right_child = get_page(pager, right_child_page_num);
+  uint32_t right_child_max_key = get_node_max_key(pager, right_child);
+
+  if (child_max_key > right_child_max_key) {
+    /* Replace right child */
+    *internal_node_child(parent, original_num_keys) = right_child_page_num;
+    *internal_node_key(parent, original_num_keys) = right_child_max_key;
+    *internal_node_right_child(parent) = child_page_num;
+  } else {
+    /* Make room for the new cell */
+    for (uint32_t i = original_num_keys; i > index; i--) {
+      *internal_node_child(parent, i) = *internal_node_child(parent, i - 1);
+      *internal_node_key(parent, i) = *internal_node_key(parent, i - 1);
+    }
+    *internal_node_child(parent, index) = child_page_num;
+    *internal_node_key(parent, index) = child_max_key;
+  }
+
+  unpin_page(pager, parent_page_num);
+  unpin_page(pager, child_page_num);
+  unpin_page(pager, right_child_page_num);
+}
+
+// 満杯の内部ノードを分割して子を挿入する
+// 既存の子と新しい子をキー順に並べ、前半を古いノード、後半を新しいノードに分配する。
+// 分割したノードがルートなら新しいルートを作り、そうでなければ親に新しいノードを挿入する。
+// 親も満杯なら同じ処理が再帰的にルートまで伝播する。
+//
+static void internal_node_split_and_insert(Table* table, uint32_t parent_page_num,
+                                           uint32_t child_page_num) {
+	Pager* pager = table->pager;
+	stats_add(&pager->stats.internal_splits, 1);
+	void* old_node = get_page(pager, parent_page_num);
+	void* child = get_page(pager, child_page_num);
+	uint32_t child_max_key = get_node_max_key(pager, child);
+	unpin_page(pager, child_page_num);
+
+	// 右の子も含めた全ての子を(子, 最大キー)の組として並べる
+	uint32_t old_num_keys = *internal_node_num_keys(old_node);
+	uint32_t total = old_num_keys + 2;
+	uint32_t children[total];
+	uint32_t keys[total];
+	uint32_t count = 0;
+	bool inserted = false;
+	for (uint32_t i = 0; i <= old_num_keys; i++) {
+		uint32_t page_num = *internal_node_child(old_node, i);
+		uint32_t key;
+		if (i < old_num_keys) {
+			key = *internal_node_key(old_node, i);
+		} else {
+			void* right_child = get_page(pager, page_num);
+			key = get_node_max_key(pager, right_child);
+			unpin_page(pager, page_num);
+		}
+		if (!inserted && child_max_key < key) {
+			children[count] = child_page_num;
+			keys[count++] = child_max_key;
+			inserted = true;
+		}
+		children[count] = page_num;
+		keys[count++] = key;
+	}
+	if (!inserted) {
+		children[count] = child_page_num;
+		keys[count++] = child_max_key;
+	}
+	// 親の中で古いノードを指しているキーは、分割前の最大キー
+	uint32_t old_max = keys[total - 1];
+
+	// 木の右端に子が追加された場合は、葉と同じく古いノードを満杯のまま残す
+	uint32_t left_count = total / 2;
+	if (!inserted && internal_node_is_rightmost(pager, parent_page_num)) {
+		left_count = total - 1;
+	}
+	uint32_t new_page_num = get_unused_page_num(pager);
+	void* new_node = get_page(pager, new_page_num);
+	mark_page_dirty(pager, parent_page_num);
+	mark_page_dirty(pager, new_page_num);
+	initialize_internal_node(new_node);
+
+	// 前半を古いノードに書き戻す
+	*internal_node_num_keys(old_node) = left_count - 1;
+	for (uint32_t i = 0; i < left_count - 1; i++) {
+		*internal_node_child(old_node, i) = children[i];
+		*internal_node_key(old_node, i) = keys[i];
+	}
+	*internal_node_right_child(old_node) = children[left_count - 1];
+
+	// 後半を新しいノードに移動する
+	*internal_node_num_keys(new_node) = total - left_count - 1;
+	for (uint32_t i = left_count; i < total; i++) {
+		if (i < total - 1) {
+			*internal_node_child(new_node, i - left_count) = children[i];
+			*internal_node_key(new_node, i - left_count) = keys[i];
+		} else {
+			*internal_node_right_child(new_node) = children[i];
+		}
+	}
+
+	// 移動した子と新しく挿入した子の親ポインタを更新
+	for (uint32_t i = 0; i < total; i++) {
+		if (i < left_count && children[i] != child_page_num) {
+			continue;
+		}
+		void* moved = get_page(pager, children[i]);
+		mark_page_dirty(pager, children[i]);
+		*node_parent(moved) = i < left_count ? parent_page_num : new_page_num;
+		unpin_page(pager, children[i]);
+	}
+
+	bool was_root = is_node_root(old_node);
+	uint32_t grandparent_page_num = *node_parent(old_node);
+	*node_parent(new_node) = grandparent_page_num;
+	uint32_t new_max = keys[left_count - 1];
+	unpin_page(pager, parent_page_num);
+	unpin_page(pager, new_page_num);
+
+	if (was_root) {
+		create_new_root(table, new_page_num);
+	} else {
+		void* grandparent = get_page(pager, grandparent_page_num);
+		mark_page_dirty(pager, grandparent_page_num);
+		update_internal_node_key(grandparent, old_max, new_max);
+		unpin_page(pager, grandparent_page_num);
+
+		internal_node_insert(table, grandparent_page_num, new_page_num);
+	}
+}
+
+// 子のページ番号から、親の中での位置を探す
+// 空になった葉はキーで探せないので、子のページ番号を順に比べる
+static uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+	for (uint32_t i = 0; i <= num_keys; i++) {
+		if (*internal_node_child(node, i) == child_page_num) {
+			return i;
+		}
+	}
+	printf("Page %d is not a child of its parent.\n", child_page_num);
+	exit(EXIT_FAILURE);
+}
+
+// cell_num 番目の (子, キー) を外し、後ろのセルを詰める。右の子はそのまま残る
+static void internal_node_remove_cell(void* node, uint32_t cell_num) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+	for (uint32_t i = cell_num; i + 1 < num_keys; i++) {
+		*internal_node_child(node, i) = *internal_node_child(node, i + 1);
+		*internal_node_key(node, i) = *internal_node_key(node, i + 1);
+	}
+	*internal_node_num_keys(node) = num_keys - 1;
+}
+
+// ノードの最大キーが new_max に変わった時、祖先の中でこのノードの部分木を指しているキーを直す
+// 右の子の最大キーは親に保存されていないので、右の子でない所まで上にたどる
+static void update_ancestor_max_key(Pager* pager, uint32_t page_num, uint32_t new_max) {
+	while (true) {
+		void* node = get_page(pager, page_num);
+		bool root = is_node_root(node);
+		uint32_t parent_page_num = *node_parent(node);
+		unpin_page(pager, page_num);
+		if (root) {
+			return;
+		}
+
+		void* parent = get_page(pager, parent_page_num);
+		uint32_t index = internal_node_child_index(parent, page_num);
+		if (index < *internal_node_num_keys(parent)) {
+			mark_page_dirty(pager, parent_page_num);
+			*internal_node_key(parent, index) = new_max;
+			unpin_page(pager, parent_page_num);
+			return;
+		}
+		unpin_page(pager, parent_page_num);
+		page_num = parent_page_num;
+	}
+}
+
+static bool node_is_underflowing(void* node) {
+	if (get_node_type(node) == NODE_LEAF) {
+		return leaf_node_used_space(node) < LEAF_NODE_MIN_USED_SPACE;
+	}
+	return *internal_node_num_keys(node) < INTERNAL_NODE_MIN_KEYS;
+}
+
+// 隣り合う2つの葉のセルをキー順に並べ直す
+// merge なら全てを左の葉に入れ、そうでなければバイト数でおよそ半分ずつに分ける
+static void leaf_node_redistribute(void* left, void* right, bool merge) {
+	uint32_t original_left[PAGE_SIZE / sizeof(uint32_t)];
+	uint32_t original_right[PAGE_SIZE / sizeof(uint32_t)];
+	memcpy(original_left, left, PAGE_SIZE);
+	memcpy(original_right, right, PAGE_SIZE);
+
+	uint32_t left_cells = *leaf_node_num_cells(original_left);
+	uint32_t total = left_cells + *leaf_node_num_cells(original_right);
+	uint32_t total_bytes = leaf_node_used_space(original_left) + leaf_node_used_space(original_right);
+	uint32_t left_count = total;
+	if (!merge) {
+		uint32_t left_bytes = 0;
+		left_count = 0;
+		while (left_count < total - 1 && left_bytes * 2 < total_bytes) {
+			void* source = left_count < left_cells ? (void*)original_left : (void*)original_right;
+			uint32_t index = left_count < left_cells ? left_count : left_count - left_cells;
+			left_bytes += leaf_node_cell_size(source, index) + LEAF_NODE_CELL_POINTER_SIZE;
+			left_count += 1;
+		}
+	}
+
+	initialize_leaf_node(left);
+	*node_parent(left) = *node_parent(original_left);
+	*leaf_node_next_leaf(left) = merge ? *leaf_node_next_leaf(original_right)
+	                                   : *leaf_node_next_leaf(original_left);
+	initialize_leaf_node(right);
+	*node_parent(right) = *node_parent(original_right);
+	*leaf_node_next_leaf(right) = *leaf_node_next_leaf(original_right);
+	for (uint32_t i = 0; i < total; i++) {
+		void* source = i < left_cells ? (void*)original_left : (void*)original_right;
+		uint32_t index = i < left_cells ? i : i - left_cells;
+		void* destination_node = i < left_count ? left : right;
+		leaf_node_put_cell(destination_node, i < left_count ? i : i - left_count,
+		                   leaf_node_cell(source, index), leaf_node_cell_size(source, index));
+	}
+}
+
+// 隣り合う2つの内部ノードの子を並べ直す。separator は親の中で左のノードを指しているキー
+// merge なら全てを左のノードに入れ、そうでなければ子の数で半分ずつに分ける
+// 移った子の親ポインタを付け替え、左のノードの新しい最大キーを返す
+static uint32_t internal_node_redistribute(Pager* pager, uint32_t left_page_num, void* left,
+                                           uint32_t right_page_num, void* right,
+                                           uint32_t separator, bool merge) {
+	// 右の子も含めた全ての子を(子, 最大キー)の組として並べる
+	// 左のノードの右の子の最大キーは separator、右のノードの右の子のキーは使わない
+	uint32_t left_num_keys = *internal_node_num_keys(left);
+	uint32_t right_num_keys = *internal_node_num_keys(right);
+	uint32_t total = left_num_keys + right_num_keys + 2;
+	uint32_t children[total];
+	uint32_t keys[total];
+	uint32_t count = 0;
+	for (uint32_t i = 0; i <= left_num_keys; i++) {
+		children[count] = *internal_node_child(left, i);
+		keys[count++] = i < left_num_keys ? *internal_node_key(left, i) : separator;
+	}
+	for (uint32_t i = 0; i <= right_num_keys; i++) {
+		children[count] = *internal_node_child(right, i);
+		keys[count++] = i < right_num_keys ? *internal_node_key(right, i) : 0;
+	}
+
+	uint32_t left_count = merge ? total : total / 2;
+	*internal_node_num_keys(left) = left_count - 1;
+	for (uint32_t i = 0; i < left_count - 1; i++) {
+		*internal_node_child(left, i) = children[i];
+		*internal_node_key(left, i) = keys[i];
+	}
+	*internal_node_right_child(left) = children[left_count - 1];
+	if (!merge) {
+		*internal_node_num_keys(right) = total - left_count - 1;
+		for (uint32_t i = left_count; i < total - 1; i++) {
+			*internal_node_child(right, i - left_count) = children[i];
+			*internal_node_key(right, i - left_count) = keys[i];
+		}
+		*internal_node_right_child(right) = children[total - 1];
+	}
+
+	for (uint32_t i = 0; i < total; i++) {
+		bool was_left = i <= left_num_keys;
+		bool is_left = i < left_count;
+		if (was_left == is_left) {
+			continue;
+		}
+		void* moved = get_page(pager, children[i]);
+		mark_page_dirty(pager, children[i]);
+		*node_parent(moved) = is_left ? left_page_num : right_page_num;
+		unpin_page(pager, children[i]);
+	}
+	return keys[left_count - 1];
+}
+
+// 親の left_index 番目の子と次の子を1つにまとめるか、2つのノードにセルを分け直す
+// 1つのページに収まればまとめて右のノードを解放し、親から外して true を返す
+static bool btree_merge_or_redistribute(Table* table, uint32_t parent_page_num, uint32_t left_index) {
+	Pager* pager = table->pager;
+	void* parent = get_page(pager, parent_page_num);
+	uint32_t left_page_num = *internal_node_child(parent, left_index);
+	uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+	void* left = get_page(pager, left_page_num);
+	void* right = get_page(pager, right_page_num);
+	mark_page_dirty(pager, parent_page_num);
+	mark_page_dirty(pager, left_page_num);
+	mark_page_dirty(pager, right_page_num);
+
+	bool is_leaf = get_node_type(left) == NODE_LEAF;
+	bool merge;
+	uint32_t left_max;
+	// 空になった葉の最大キーは親に残っている古いキーなので、まとめた後に直す
+	bool right_was_empty = false;
+	if (is_leaf) {
+		merge = leaf_node_used_space(left) + leaf_node_used_space(right) <= LEAF_NODE_SPACE_FOR_CELLS;
+		right_was_empty = *leaf_node_num_cells(right) == 0;
+		leaf_node_redistribute(left, right, merge);
+		left_max = *leaf_node_key(left, *leaf_node_num_cells(left) - 1);
+	} else {
+		merge = *internal_node_num_keys(left) + *internal_node_num_keys(right) + 1 <= INTERNAL_NODE_MAX_CELLS;
+		left_max = internal_node_redistribute(pager, left_page_num, left, right_page_num, right,
+		                                      *internal_node_key(parent, left_index), merge);
+	}
+	unpin_page(pager, left_page_num);
+	unpin_page(pager, right_page_num);
+
+	if (!merge) {
+		*internal_node_key(parent, left_index) = left_max;
+		unpin_page(pager, parent_page_num);
+		return false;
+	}
+
+	// 左のノードが右のノードの位置(とそのキー)を引き継ぐ
+	internal_node_remove_cell(parent, left_index);
+	*internal_node_child(parent, left_index) = left_page_num;
+	bool left_is_right_child = left_index == *internal_node_num_keys(parent);
+	if (right_was_empty && !left_is_right_child) {
+		*internal_node_key(parent, left_index) = left_max;
+	}
+	unpin_page(pager, parent_page_num);
+	if (right_was_empty && left_is_right_child) {
+		update_ancestor_max_key(pager, parent_page_num, left_max);
+	}
+
+	pager_free_page(pager, right_page_num);
+	// 右端の葉が解放されたかもしれないので、次の table_find で覚え直す
+	table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+	return true;
+}
+
+// ルートが子を1つしか持たない時、その子をルートページに移して木を1段低くする
+static void btree_collapse_root(Table* table) {
+	Pager* pager = table->pager;
+	void* root = get_page(pager, table->root_page_num);
+	uint32_t child_page_num = *internal_node_right_child(root);
+	unpin_page(pager, table->root_page_num);
+
+	// 子のページは install_root が空ける
+	install_root(table, child_page_num);
+	table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+}
+
+// 削除で小さくなったノードを兄弟とまとめるか、兄弟とセルを分け直す
+// まとめると親の子が1つ減るので、親についても同じことを繰り返す
+static void btree_rebalance(Table* table, uint32_t page_num) {
+	Pager* pager = table->pager;
+	while (true) {
+		void* node = get_page(pager, page_num);
+		bool root = is_node_root(node);
+		bool underflow = node_is_underflowing(node);
+		bool single_child = get_node_type(node) == NODE_INTERNAL && *internal_node_num_keys(node) == 0;
+		uint32_t parent_page_num = *node_parent(node);
+		unpin_page(pager, page_num);
+		if (root) {
+			if (!single_child) {
+				return;
+			}
+			btree_collapse_root(table);
+			continue;
+		}
+		if (!underflow) {
+			return;
+		}
+
+		void* parent = get_page(pager, parent_page_num);
+		uint32_t num_keys = *internal_node_num_keys(parent);
+		bool parent_is_root = is_node_root(parent);
+		uint32_t index = internal_node_child_index(parent, page_num);
+		unpin_page(pager, parent_page_num);
+		if (num_keys == 0) {
+			// 兄弟がいない。親がルートならこのノードをルートにする
+			// そうでなければ先に親を親の兄弟とまとめるか分け直して、兄弟を作る
+			if (parent_is_root) {
+				btree_collapse_root(table);
+				page_num = table->root_page_num;
+			} else {
+				btree_rebalance(table, parent_page_num);
+			}
+			continue;
+		}
+
+		// 左の兄弟があれば左と、なければ右の兄弟と組にする
+		uint32_t left_index = index == 0 ? 0 : index - 1;
+		if (!btree_merge_or_redistribute(table, parent_page_num, left_index)) {
+			return;
+		}
+		page_num = parent_page_num;
+	}
+}
+
+/* Vacuum */
+
+// 葉の連結リストで1つ前の葉を返す。先頭の葉なら INVALID_PAGE_NUM
+// 左の兄弟がある祖先まで上り、その兄弟の部分木の右端まで下りる
+static uint32_t leaf_node_prev_leaf(Pager* pager, uint32_t page_num) {
+	while (true) {
+		void* node = get_page(pager, page_num);
+		bool root = is_node_root(node);
+		uint32_t parent_page_num = *node_parent(node);
+		unpin_page(pager, page_num);
+		if (root) {
+			return INVALID_PAGE_NUM;
+		}
+
+		void* parent = get_page(pager, parent_page_num);
+		uint32_t index = internal_node_child_index(parent, page_num);
+		uint32_t sibling_page_num = index > 0 ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+		unpin_page(pager, parent_page_num);
+		if (sibling_page_num != INVALID_PAGE_NUM) {
+			while (true) {
+				void* sibling = get_page(pager, sibling_page_num);
+				NodeType type = get_node_type(sibling);
+				uint32_t right_child_page_num = type == NODE_INTERNAL ? *internal_node_right_child(sibling) : 0;
+				unpin_page(pager, sibling_page_num);
+				if (type == NODE_LEAF) {
+					return sibling_page_num;
+				}
+				sibling_page_num = right_child_page_num;
+			}
+		}
+		page_num = parent_page_num;
+	}
+}
+
+// ノードを空いている to ページに移し、親の子ポインタ、子の親ポインタ、前の葉の兄弟ポインタを付け替える
+// from ページは空きページのリストには戻さないので、呼び出し側で切り詰めるか解放する
+static void btree_relocate_page(Table* table, uint32_t from_page_num, uint32_t to_page_num) {
+	Pager* pager = table->pager;
+	void* node = get_page(pager, from_page_num);
+	void* destination = get_page(pager, to_page_num);
+	mark_page_dirty(pager, to_page_num);
+	memcpy(destination, node, PAGE_SIZE);
+	unpin_page(pager, from_page_num);
+
+	if (get_node_type(destination) == NODE_LEAF) {
+		uint32_t prev_page_num = leaf_node_prev_leaf(pager, from_page_num);
+		if (prev_page_num != INVALID_PAGE_NUM) {
+			void* prev = get_page(pager, prev_page_num);
+			mark_page_dirty(pager, prev_page_num);
+			*leaf_node_next_leaf(prev) = to_page_num;
+			unpin_page(pager, prev_page_num);
+		}
+		if (table->rightmost_leaf_page_num == from_page_num) {
+			table->rightmost_leaf_page_num = to_page_num;
+		}
+	} else {
+		uint32_t num_keys = *internal_node_num_keys(destination);
+		for (uint32_t i = 0; i <= num_keys; i++) {
+			uint32_t child_page_num = *internal_node_child(destination, i);
+			void* child = get_page(pager, child_page_num);
+			mark_page_dirty(pager, child_page_num);
+			*node_parent(child) = to_page_num;
+			unpin_page(pager, child_page_num);
+		}
+	}
+
+	uint32_t parent_page_num = *node_parent(destination);
+	unpin_page(pager, to_page_num);
+	void* parent = get_page(pager, parent_page_num);
+	mark_page_dirty(pager, parent_page_num);
+	*internal_node_child(parent, internal_node_child_index(parent, from_page_num)) = to_page_num;
+	unpin_page(pager, parent_page_num);
+}
+
+// 末尾のページを最大 max_pages ページまで空きページに移して、ファイルを短くする
+// 1回の呼び出しが1つのトランザクションなので、呼び出しの合間に他の文を実行できる
+// 残っている空きページの数を返す
+static uint32_t table_vacuum_step(Table* table, uint32_t max_pages) {
+	Pager* pager = table->pager;
+	uint32_t free_count = 0;
+	for (uint32_t i = 0; i < max_pages; i++) {
+		void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+		free_count = *db_header_freelist_count(header);
+		unpin_page(pager, DB_HEADER_PAGE_NUM);
+		uint32_t last_page_num = pager->num_pages - 1;
+		if (free_count == 0 || last_page_num == table->root_page_num) {
+			break;
+		}
+
+		// 末尾のページが空いていればリストから外すだけ。使われていれば手前の空きページに移す
+		if (!freelist_remove(pager, last_page_num)) {
+			void* node = get_page(pager, last_page_num);
+			NodeType type = get_node_type(node);
+			unpin_page(pager, last_page_num);
+			if (type == NODE_INDEX_LEAF || type == NODE_INDEX_INTERNAL) {
+				index_relocate_page(table, last_page_num, get_unused_page_num(pager));
+			} else {
+				btree_relocate_page(table, last_page_num, get_unused_page_num(pager));
+			}
+		}
+		pager_truncate(pager, last_page_num);
+		header = get_page(pager, DB_HEADER_PAGE_NUM);
+		mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+		*db_header_page_count(header) = last_page_num;
+		free_count = *db_header_freelist_count(header);
+		unpin_page(pager, DB_HEADER_PAGE_NUM);
+	}
+	pager_commit(pager);
+	return free_count;
+}
+
+static void vacuum_remap_node(void* node, const uint32_t* new_page_nums) {
+	if (!is_node_root(node)) {
+		*node_parent(node) = new_page_nums[*node_parent(node)];
+	}
+	if (get_node_type(node) == NODE_LEAF) {
+		uint32_t next_page_num = *leaf_node_next_leaf(node);
+		*leaf_node_next_leaf(node) = next_page_num == 0 ? 0 : new_page_nums[next_page_num];
+	} else {
+		uint32_t num_keys = *internal_node_num_keys(node);
+		for (uint32_t i = 0; i <= num_keys; i++) {
+			*internal_node_child(node, i) = new_page_nums[*internal_node_child(node, i)];
+		}
+	}
+}
+
+// 木をページ1から詰めて並べ直す。ルート、内部ノード(幅優先)、葉(キー順)の順に置くので、
+// 葉を順にたどる走査はファイルを先頭から順に読むことになる
+// 空きページは全て後ろに集まるので、空きページのリストを空にしてファイルを切り詰める
+// 全体を1つのトランザクションで書き換えるので、途中で落ちても元の木が残る
+static void table_vacuum(Table* table) {
+	Pager* pager = table->pager;
+	uint32_t num_pages = pager->num_pages;
+	// new_page_nums[今のページ] = 移動先、old_page_nums[移動先] = 今のページ
+	uint32_t* new_page_nums = malloc(num_pages * sizeof(uint32_t));
+	uint32_t* old_page_nums = malloc(num_pages * sizeof(uint32_t));
+	for (uint32_t i = 0; i < num_pages; i++) {
+		new_page_nums[i] = INVALID_PAGE_NUM;
+	}
+	new_page_nums[DB_HEADER_PAGE_NUM] = DB_HEADER_PAGE_NUM;
+	old_page_nums[DB_HEADER_PAGE_NUM] = DB_HEADER_PAGE_NUM;
+	uint32_t count = DB_HEADER_PAGE_NUM + 1;
+
+	// 内部ノードを幅優先で並べる。葉はどれも同じ深さにあるので、最初の子が葉なら子は全て葉
+	uint32_t* queue = malloc(num_pages * sizeof(uint32_t));
+	uint32_t queue_head = 0;
+	uint32_t queue_tail = 0;
+	queue[queue_tail++] = table->root_page_num;
+	uint32_t first_leaf_page_num = table->root_page_num;
+	while (queue_head < queue_tail) {
+		uint32_t page_num = queue[queue_head++];
+		new_page_nums[page_num] = count;
+		old_page_nums[count++] = page_num;
+		void* node = get_page(pager, page_num);
+		if (get_node_type(node) == NODE_INTERNAL) {
+			uint32_t num_keys = *internal_node_num_keys(node);
+			uint32_t first_child_page_num = *internal_node_child(node, 0);
+			void* first_child = get_page(pager, first_child_page_num);
+			bool children_are_leaves = get_node_type(first_child) == NODE_LEAF;
+			unpin_page(pager, first_child_page_num);
+			if (first_leaf_page_num == table->root_page_num) {
+				// 幅優先で最初に葉の親になるのは一番左の親なので、その最初の子が先頭の葉
+				first_leaf_page_num = children_are_leaves ? first_child_page_num : table->root_page_num;
+			}
+			if (!children_are_leaves) {
+				for (uint32_t i = 0; i <= num_keys; i++) {
+					queue[queue_tail++] = *internal_node_child(node, i);
+				}
+			}
+		}
+		unpin_page(pager, page_num);
+	}
+	free(queue);
+
+	// 葉は兄弟ポインタをたどってキー順に並べる
+	if (first_leaf_page_num != table->root_page_num) {
+		uint32_t page_num = first_leaf_page_num;
+		while (page_num != 0) {
+			new_page_nums[page_num] = count;
+			old_page_nums[count++] = page_num;
+			void* node = get_page(pager, page_num);
+			uint32_t next_page_num = *leaf_node_next_leaf(node);
+			unpin_page(pager, page_num);
+			page_num = next_page_num;
+		}
+	}
+	uint32_t tree_pages = count;
+	// 空きページは後ろの位置に順に割り当てる。中身は使わない
+	for (uint32_t page_num = 0; page_num < num_pages; page_num++) {
+		if (new_page_nums[page_num] == INVALID_PAGE_NUM) {
+			new_page_nums[page_num] = count;
+			old_page_nums[count++] = page_num;
+		}
+	}
+
+	// 置換を巡回ごとに適用する。巡回の先頭のページだけ退避しておき、
+	// 移動先に入るべきページを順に読んで書き込んでいく
+	bool* done = calloc(num_pages, sizeof(bool));
+	uint32_t saved[PAGE_SIZE / sizeof(uint32_t)];
+	uint32_t moving[PAGE_SIZE / sizeof(uint32_t)];
+	for (uint32_t start = DB_HEADER_PAGE_NUM + 1; start < tree_pages; start++) {
+		if (done[start]) {
+			continue;
+		}
+		void* page = get_page(pager, start);
+		memcpy(saved, page, PAGE_SIZE);
+		unpin_page(pager, start);
+
+		uint32_t position = start;
+		while (true) {
+			done[position] = true;
+			uint32_t source = old_page_nums[position];
+			if (position < tree_pages) {
+				if (source == start) {
+					memcpy(moving, saved, PAGE_SIZE);
+				} else {
+					page = get_page(pager, source);
+					memcpy(moving, page, PAGE_SIZE);
+					unpin_page(pager, source);
+				}
+				vacuum_remap_node(moving, new_page_nums);
+				page = get_page(pager, position);
+				mark_page_dirty(pager, position);
+				memcpy(page, moving, PAGE_SIZE);
+				unpin_page(pager, position);
+			}
+			if (source == start) {
+				break;
+			}
+			position = source;
+		}
+	}
+	free(done);
+	free(new_page_nums);
+	free(old_page_nums);
+
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+	*db_header_freelist_head(header) = 0;
+	*db_header_freelist_count(header) = 0;
+	*db_header_page_count(header) = tree_pages;
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+	pager_truncate(pager, tree_pages);
+	table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+
+	pager_commit(pager);
+	// WALに書いた新しい配置をすぐにファイルへ戻して、ファイルを切り詰める
+	pager_checkpoint(pager);
+}
+
+/* Secondary Index */
+
+// create index on username | email
+// 索引の根を作ってからテーブルの全ての行を入れる。既にあれば何もしない
+static ExecuteResult execute_create_index(Statement* statement, Table* table) {
+	Pager* pager = table->pager;
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	bool exists = *db_header_index_root(header, statement->value_column) != 0;
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+	if (exists) {
+		return EXECUTE_INDEX_EXISTS;
+	}
+	index_create(table, statement->value_column);
+	return EXECUTE_SUCCESS;
+}
+
+// 値と id を、memcmp の順が (値, id) の順になるバイト列にする。キーの長さを返す
+static uint32_t index_key_encode(const char* value, uint32_t length, uint32_t id, uint8_t* destination) {
+	memcpy(destination, value, length);
+	destination[length] = 0;
+	destination[length + 1] = id >> 24;
+	destination[length + 2] = id >> 16;
+	destination[length + 3] = id >> 8;
+	destination[length + 4] = id;
+	return length + INDEX_KEY_SUFFIX_SIZE;
+}
+
+static uint32_t index_key_id(const IndexKey* key) {
+	const uint8_t* p = key->data + key->length - INDEX_ID_SIZE;
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// バイト列として比べる。一方が他方の先頭と同じなら短い方が前
+static int index_key_compare(const IndexKey* a, const IndexKey* b) {
+	uint32_t length = a->length < b->length ? a->length : b->length;
+	int result = memcmp(a->data, b->data, length);
+	if (result != 0) {
+		return result;
+	}
+	return (a->length > b->length) - (a->length < b->length);
+}
+
+static void index_key_from_row(Row* row, IndexColumn column, uint8_t* buffer, IndexKey* key) {
+	const char* value = column == INDEX_USERNAME ? row->username : row->email;
+	key->data = buffer;
+	key->length = index_key_encode(value, strlen(value), row->id, buffer);
+}
+
+static uint32_t index_common_prefix_length(const IndexKey* a, const IndexKey* b) {
+	uint32_t length = a->length < b->length ? a->length : b->length;
+	uint32_t i = 0;
+	while (i < length && a->data[i] == b->data[i]) {
+		i++;
+	}
+	return i;
+}
+
+static uint32_t index_node_prefix_length(void* node) {
+	uint16_t length;
+	memcpy(&length, (uint8_t*)node + INDEX_NODE_PREFIX_LENGTH_OFFSET, INDEX_NODE_PREFIX_LENGTH_SIZE);
+	return length;
+}
+
+static uint8_t* index_node_prefix(void* node) {
+	return (uint8_t*)node + INDEX_NODE_PREFIX_LENGTH_OFFSET - index_node_prefix_length(node);
+}
+
+// セル領域の終わり。その後ろにプレフィックスと長さを置く
+static uint32_t index_node_cells_end(uint32_t prefix_length) {
+	uint32_t size = prefix_length + INDEX_NODE_PREFIX_LENGTH_SIZE;
+	return PAGE_SIZE - ((size + LEAF_NODE_CELL_ALIGNMENT - 1) & ~(LEAF_NODE_CELL_ALIGNMENT - 1));
+}
+
+// セルに残したキーの後半
+static const uint8_t* index_cell_suffix(const void* cell, uint32_t* length) {
+	return (const uint8_t*)cell + varint_decode(cell, length);
+}
+
+// プレフィックスとセルの残りをつないでキーを buffer に作る
+static void index_cell_key(void* node, uint32_t cell_num, uint8_t* buffer, IndexKey* key) {
+	uint32_t prefix_length = index_node_prefix_length(node);
+	uint32_t suffix_length;
+	const uint8_t* suffix = index_cell_suffix(leaf_node_cell(node, cell_num), &suffix_length);
+	memcpy(buffer, index_node_prefix(node), prefix_length);
+	memcpy(buffer + prefix_length, suffix, suffix_length);
+	key->data = buffer;
+	key->length = prefix_length + suffix_length;
+}
+
+// セルのバイト数(4バイト単位に切り上げる前)
+static uint32_t index_cell_size(void* node, const void* cell) {
+	uint32_t length;
+	uint32_t size = varint_decode(cell, &length) + length;
+	return get_node_type(node) == NODE_INDEX_INTERNAL ? size + INDEX_CHILD_SIZE : size;
+}
+
+// キーの prefix_length バイト目からをセルの形に書き、セルの大きさを返す
+// child_page_num が 0 なら葉のセル。ページ0はヘッダなので、子になることはない
+static uint32_t index_cell_from_key(const IndexKey* key, uint32_t prefix_length, uint32_t child_page_num,
+                                    void* cell) {
+	uint8_t* p = cell;
+	uint32_t suffix_length = key->length - prefix_length;
+	uint32_t size = varint_encode(suffix_length, p);
+	memcpy(p + size, key->data + prefix_length, suffix_length);
+	size += suffix_length;
+	if (child_page_num != 0) {
+		memcpy(p + size, &child_page_num, INDEX_CHILD_SIZE);
+		size += INDEX_CHILD_SIZE;
+	}
+	uint32_t aligned_size = (size + LEAF_NODE_CELL_ALIGNMENT - 1) & ~(LEAF_NODE_CELL_ALIGNMENT - 1);
+	memset(p + size, 0, aligned_size - size);
+	return aligned_size;
+}
+
+// 内部ノードの child_num 番目の子。セルの数と同じ番号は右端の子
+static uint32_t index_node_child(void* node, uint32_t child_num) {
+	if (child_num == *leaf_node_num_cells(node)) {
+		return *leaf_node_next_leaf(node);
+	}
+	uint32_t length;
+	const uint8_t* suffix = index_cell_suffix(leaf_node_cell(node, child_num), &length);
+	uint32_t page_num;
+	memcpy(&page_num, suffix + length, INDEX_CHILD_SIZE);
+	return page_num;
+}
+
+static void index_node_set_child(void* node, uint32_t child_num, uint32_t page_num) {
+	if (child_num == *leaf_node_num_cells(node)) {
+		*leaf_node_next_leaf(node) = page_num;
+		return;
+	}
+	uint32_t length;
+	const uint8_t* suffix = index_cell_suffix(leaf_node_cell(node, child_num), &length);
+	memcpy((uint8_t*)suffix + length, &page_num, INDEX_CHILD_SIZE);
+}
+
+static uint32_t index_node_child_index(void* node, uint32_t child_page_num) {
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	for (uint32_t i = 0; i < num_cells; i++) {
+		if (index_node_child(node, i) == child_page_num) {
+			return i;
+		}
+	}
+	return num_cells;
+}
+
+// key より小さいキーの数(upper なら key 以下のキーの数)
+// 葉では key 以上の最初のセルの位置になり、内部ノードに upper で使うと key がある子の番号になる
+// key をプレフィックスと一度だけ比べ、残りはセルに置いたバイト列のまま比べる
+static uint32_t index_node_find_cell(void* node, const IndexKey* key, bool upper) {
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t prefix_length = index_node_prefix_length(node);
+	uint32_t length = key->length < prefix_length ? key->length : prefix_length;
+	int result = memcmp(key->data, index_node_prefix(node), length);
+	if (result < 0 || (result == 0 && key->length < prefix_length)) {
+		return 0;
+	}
+	if (result > 0) {
+		return num_cells;
+	}
+
+	IndexKey rest = {key->data + prefix_length, key->length - prefix_length};
+	uint32_t min_index = 0;
+	uint32_t one_past_max_index = num_cells;
+	while (one_past_max_index != min_index) {
+		uint32_t index = (min_index + one_past_max_index) / 2;
+		IndexKey suffix;
+		suffix.data = index_cell_suffix(leaf_node_cell(node, index), &suffix.length);
+		int compared = index_key_compare(&suffix, &rest);
+		if (upper ? compared <= 0 : compared < 0) {
+			min_index = index + 1;
+		} else {
+			one_past_max_index = index;
+		}
+	}
+	return min_index;
+}
+
+// 空のノードにする。prefix が NULL ならプレフィックスは空
+static void initialize_index_node(void* node, NodeType type, const IndexKey* prefix) {
+	initialize_leaf_node(node);
+	set_node_type(node, type);
+	uint16_t prefix_length = prefix == NULL ? 0 : prefix->length;
+	uint32_t cells_end = index_node_cells_end(prefix_length);
+	memset((uint8_t*)node + cells_end, 0, PAGE_SIZE - cells_end);
+	memcpy((uint8_t*)node + INDEX_NODE_PREFIX_LENGTH_OFFSET, &prefix_length, INDEX_NODE_PREFIX_LENGTH_SIZE);
+	if (prefix_length > 0) {
+		memcpy(index_node_prefix(node), prefix->data, prefix_length);
+	}
+	*leaf_node_cell_content(node) = cells_end;
+}
+
+// entries を1つのノードに書いた時のバイト数(ヘッダを含む)
+static uint32_t index_node_size(NodeType type, const IndexEntry* entries, uint32_t count) {
+	uint32_t prefix_length = count == 0 ? 0 : index_common_prefix_length(&entries[0].key, &entries[count - 1].key);
+	uint32_t size = LEAF_NODE_HEADER_SIZE + (PAGE_SIZE - index_node_cells_end(prefix_length));
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t suffix_length = entries[i].key.length - prefix_length;
+		uint8_t varint[VARINT_MAX_SIZE];
+		uint32_t cell_size = varint_encode(suffix_length, varint) + suffix_length +
+		                     (type == NODE_INDEX_INTERNAL ? INDEX_CHILD_SIZE : 0);
+		size += ((cell_size + LEAF_NODE_CELL_ALIGNMENT - 1) & ~(LEAF_NODE_CELL_ALIGNMENT - 1)) +
+		        LEAF_NODE_CELL_POINTER_SIZE;
+	}
+	return size;
+}
+
+// キーの順に並んだ entries でノードを書き直す。プレフィックスは最初と最後のキーに共通する部分
+// 根の印、親、兄弟(内部ノードでは右端の子)は呼び出し側で置く
+static void index_node_write(void* node, NodeType type, const IndexEntry* entries, uint32_t count) {
+	IndexKey prefix = {NULL, 0};
+	if (count > 0) {
+		prefix.data = entries[0].key.data;
+		prefix.length = index_common_prefix_length(&entries[0].key, &entries[count - 1].key);
+	}
+	initialize_index_node(node, type, &prefix);
+	uint32_t cell[INDEX_MAX_CELL_SIZE / sizeof(uint32_t)];
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t cell_size = index_cell_from_key(&entries[i].key, prefix.length, entries[i].child_page_num, cell);
+		leaf_node_put_cell(node, i, cell, cell_size);
+	}
+}
+
+// 内部ノードの全ての子の親ポインタを page_num にする
+static void index_node_adopt_children(Pager* pager, void* node, uint32_t page_num) {
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	for (uint32_t i = 0; i <= num_cells; i++) {
+		uint32_t child_page_num = index_node_child(node, i);
+		void* child = get_page(pager, child_page_num);
+		mark_page_dirty(pager, child_page_num);
+		*node_parent(child) = page_num;
+		unpin_page(pager, child_page_num);
+	}
+}
+
+// ノードが索引の右端にあるか。右端の子をたどって、最後の葉に着けば右端
+static bool index_node_is_rightmost(Pager* pager, void* node) {
+	if (get_node_type(node) == NODE_INDEX_LEAF) {
+		return *leaf_node_next_leaf(node) == 0;
+	}
+	uint32_t page_num = *leaf_node_next_leaf(node);
+	while (true) {
+		void* child = get_page(pager, page_num);
+		bool leaf = get_node_type(child) == NODE_INDEX_LEAF;
+		uint32_t next_page_num = *leaf_node_next_leaf(child);
+		unpin_page(pager, page_num);
+		if (leaf) {
+			return next_page_num == 0;
+		}
+		page_num = next_page_num;
+	}
+}
+
+// 書き手が使う。key があるか、入るべき葉のページ番号と、その中の位置を返す
+static uint32_t index_find_leaf(Pager* pager, uint32_t root_page_num, const IndexKey* key, uint32_t* cell_num) {
+	uint32_t page_num = root_page_num;
+	void* node = get_page(pager, page_num);
+	while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+		uint32_t child_page_num = index_node_child(node, index_node_find_cell(node, key, true));
+		unpin_page(pager, page_num);
+		page_num = child_page_num;
+		node = get_page(pager, page_num);
+	}
+	*cell_num = index_node_find_cell(node, key, false);
+	unpin_page(pager, page_num);
+	return page_num;
+}
+
+// 読み手が使う。key 以上の最初のエントリがある葉をスナップショットから node にコピーし、葉の中の位置を返す
+// 位置が葉の終わりなら、そのエントリは次の葉の先頭にある
+static uint32_t index_seek(Pager* pager, Snapshot* snapshot, uint32_t root_page_num, const IndexKey* key,
+                           void* node) {
+	snapshot_read_page(pager, snapshot, root_page_num, node);
+	while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+		uint32_t child_page_num = index_node_child(node, index_node_find_cell(node, key, true));
+		snapshot_read_page(pager, snapshot, child_page_num, node);
+	}
+	return index_node_find_cell(node, key, false);
+}
+
+static void index_insert(Table* table, uint32_t root_page_num, const IndexKey* key) {
+	uint32_t cell_num;
+	uint32_t page_num = index_find_leaf(table->pager, root_page_num, key, &cell_num);
+	index_node_insert(table, page_num, cell_num, key, 0);
+}
+
+// 葉か内部ノードの cell_num の位置にキーを置く。child_page_num が 0 でなければ内部ノードのセル
+// キーがノードのプレフィックスで始まり、空きがあればそのまま置く。そうでなければノードを書き直す
+static void index_node_insert(Table* table, uint32_t page_num, uint32_t cell_num, const IndexKey* key,
+                              uint32_t child_page_num) {
+	Pager* pager = table->pager;
+	void* node = get_page(pager, page_num);
+	uint32_t prefix_length = index_node_prefix_length(node);
+	if (key->length >= prefix_length && memcmp(key->data, index_node_prefix(node), prefix_length) == 0) {
+		uint32_t cell[INDEX_MAX_CELL_SIZE / sizeof(uint32_t)];
+		uint32_t cell_size = index_cell_from_key(key, prefix_length, child_page_num, cell);
+		if (leaf_node_fits(node, cell_size)) {
+			mark_page_dirty(pager, page_num);
+			leaf_node_put_cell(node, cell_num, cell, cell_size);
+			unpin_page(pager, page_num);
+			return;
+		}
+	}
+	unpin_page(pager, page_num);
+	index_node_rewrite(table, page_num, cell_num, key, child_page_num);
+}
+
+// 新しいキーを加えたノードを書き直す。プレフィックスを短くすれば入る時は1つのノードのまま、
+// 入らなければ左右に分け、左の最大のキーより大きく右の最小のキー以下の最も短いキーを親に加える
+// 根はヘッダが指しているので動かさない。根を分割する時は、左右を新しいページに書き、根をその親にする
+static void index_node_rewrite(Table* table, uint32_t page_num, uint32_t cell_num, const IndexKey* key,
+                               uint32_t child_page_num) {
+	Pager* pager = table->pager;
+	void* node = get_page(pager, page_num);
+	mark_page_dirty(pager, page_num);
+	NodeType type = get_node_type(node);
+	bool leaf = type == NODE_INDEX_LEAF;
+	bool root = is_node_root(node);
+	uint32_t parent_page_num = *node_parent(node);
+	uint32_t next_page_num = *leaf_node_next_leaf(node);
+
+	// 既存のキーと新しいキーを並べる。プレフィックスを付けたキーは keys に置く
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint32_t total = num_cells + 1;
+	IndexEntry* entries = malloc(total * sizeof(IndexEntry));
+	uint8_t* keys = malloc((size_t)total * INDEX_MAX_KEY_SIZE);
+	for (uint32_t i = 0; i < total; i++) {
+		uint8_t* buffer = keys + (size_t)i * INDEX_MAX_KEY_SIZE;
+		if (i == cell_num) {
+			memcpy(buffer, key->data, key->length);
+			entries[i].key.data = buffer;
+			entries[i].key.length = key->length;
+			entries[i].child_page_num = child_page_num;
+		} else {
+			uint32_t source = i < cell_num ? i : i - 1;
+			index_cell_key(node, source, buffer, &entries[i].key);
+			entries[i].child_page_num = leaf ? 0 : index_node_child(node, source);
+		}
+	}
+
+	if (index_node_size(type, entries, total) <= PAGE_SIZE) {
+		index_node_write(node, type, entries, total);
+		set_node_root(node, root);
+		*node_parent(node) = parent_page_num;
+		*leaf_node_next_leaf(node) = next_page_num;
+		unpin_page(pager, page_num);
+		free(entries);
+		free(keys);
+		return;
+	}
+
+	// 左のノードに残すキーの数。内部ノードでは最後の1つを親に上げ、その子を左の右端の子にする
+	// 右端への追記(値の順に作る時)では左を満杯のまま残し、そうでなければバイト数で均等に分ける
+	uint32_t left_count;
+	if (cell_num == num_cells && index_node_is_rightmost(pager, node)) {
+		left_count = num_cells;
+	} else {
+		// プレフィックスを除かない大きさで数える。左右どちらもページの半分と1セルほどに収まる
+		uint32_t* sizes = malloc(total * sizeof(uint32_t));
+		uint32_t total_size = 0;
+		for (uint32_t i = 0; i < total; i++) {
+			sizes[i] = index_node_size(type, &entries[i], 1);
+			total_size += sizes[i];
+		}
+		left_count = 1;
+		uint32_t left_size = sizes[0];
+		while (left_count < total - 1 && left_size * 2 < total_size) {
+			left_size += sizes[left_count];
+			left_count += 1;
+		}
+		free(sizes);
+	}
+	if (!leaf && left_count < 2) {
+		left_count = 2;
+	}
+	uint32_t right_start = left_count;
+	uint32_t left_end = leaf ? left_count : left_count - 1;
+
+	// 親に上げるキー。葉では右の最小のキーの、左の最大のキーと違う最初のバイトまで
+	uint8_t separator_data[INDEX_MAX_KEY_SIZE];
+	IndexKey separator = {separator_data, 0};
+	if (leaf) {
+		separator.length = index_common_prefix_length(&entries[left_count - 1].key, &entries[right_start].key) + 1;
+		memcpy(separator_data, entries[right_start].key.data, separator.length);
+	} else {
+		separator.length = entries[left_count - 1].key.length;
+		memcpy(separator_data, entries[left_count - 1].key.data, separator.length);
+	}
+
+	// 空きページがなければファイルの末尾が使われるので、1つずつ取って印を付ける
+	uint32_t left_page_num = root ? get_unused_page_num(pager) : page_num;
+	void* left = root ? get_page(pager, left_page_num) : node;
+	mark_page_dirty(pager, left_page_num);
+	uint32_t right_page_num = get_unused_page_num(pager);
+	void* right = get_page(pager, right_page_num);
+	mark_page_dirty(pager, right_page_num);
+	index_node_write(left, type, entries, left_end);
+	index_node_write(right, type, entries + right_start, total - right_start);
+	*node_parent(left) = root ? page_num : parent_page_num;
+	*node_parent(right) = root ? page_num : parent_page_num;
+	if (leaf) {
+		*leaf_node_next_leaf(left) = right_page_num;
+		*leaf_node_next_leaf(right) = next_page_num;
+	} else {
+		*leaf_node_next_leaf(left) = entries[left_count - 1].child_page_num;
+		*leaf_node_next_leaf(right) = next_page_num;
+		// 新しいキーの子も、根を分けた時の左の子も、親ポインタを付け直す
+		index_node_adopt_children(pager, left, left_page_num);
+		index_node_adopt_children(pager, right, right_page_num);
+	}
+	free(entries);
+	free(keys);
+
+	if (root) {
+		IndexEntry entry = {separator, left_page_num};
+		index_node_write(node, NODE_INDEX_INTERNAL, &entry, 1);
+		set_node_root(node, true);
+		*leaf_node_next_leaf(node) = right_page_num;
+		unpin_page(pager, left_page_num);
+		unpin_page(pager, right_page_num);
+		unpin_page(pager, page_num);
+		return;
+	}
+	unpin_page(pager, right_page_num);
+	unpin_page(pager, page_num);
+
+	// 親で左のノードを指していた位置を右のノードに向け、その前に左のノードを指すキーを置く
+	void* parent = get_page(pager, parent_page_num);
+	mark_page_dirty(pager, parent_page_num);
+	uint32_t child_num = index_node_child_index(parent, page_num);
+	index_node_set_child(parent, child_num, right_page_num);
+	unpin_page(pager, parent_page_num);
+	index_node_insert(table, parent_page_num, child_num, &separator, page_num);
+}
+
+static void index_delete(Table* table, uint32_t root_page_num, const IndexKey* key) {
+	Pager* pager = table->pager;
+	uint32_t cell_num;
+	uint32_t page_num = index_find_leaf(pager, root_page_num, key, &cell_num);
+	void* node = get_page(pager, page_num);
+	if (cell_num < *leaf_node_num_cells(node)) {
+		uint8_t buffer[INDEX_MAX_KEY_SIZE];
+		IndexKey key_at_cell;
+		index_cell_key(node, cell_num, buffer, &key_at_cell);
+		if (index_key_compare(&key_at_cell, key) == 0) {
+			mark_page_dirty(pager, page_num);
+			leaf_node_remove_cell(node, cell_num);
+		}
+	}
+	unpin_page(pager, page_num);
+}
+
+// 行の変更に合わせて全ての索引を直す
+// old_row は変更前の行(挿入なら NULL)、new_row は変更後の行(削除なら NULL)
+static void index_update_row(Table* table, Row* old_row, Row* new_row) {
+	Pager* pager = table->pager;
+	uint32_t root_page_nums[INDEX_NUM_COLUMNS];
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	memcpy(root_page_nums, db_header_index_root(header, 0), DB_HEADER_INDEX_ROOTS_SIZE);
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+
+	for (IndexColumn column = 0; column < INDEX_NUM_COLUMNS; column++) {
+		if (root_page_nums[column] == 0) {
+			continue;
+		}
+		uint8_t old_buffer[INDEX_MAX_KEY_SIZE];
+		uint8_t new_buffer[INDEX_MAX_KEY_SIZE];
+		IndexKey old_key;
+		IndexKey new_key;
+		if (old_row != NULL) {
+			index_key_from_row(old_row, column, old_buffer, &old_key);
+		}
+		if (new_row != NULL) {
+			index_key_from_row(new_row, column, new_buffer, &new_key);
+		}
+		if (old_row != NULL && new_row != NULL && index_key_compare(&old_key, &new_key) == 0) {
+			continue;
+		}
+		if (old_row != NULL) {
+			index_delete(table, root_page_nums[column], &old_key);
+		}
+		if (new_row != NULL) {
+			index_insert(table, root_page_nums[column], &new_key);
+		}
+	}
+}
+
+// 索引の根を作ってヘッダに書き、テーブルの全ての行を入れる
+static void index_create(Table* table, IndexColumn column) {
+	Pager* pager = table->pager;
+	uint32_t root_page_num = get_unused_page_num(pager);
+	void* root = get_page(pager, root_page_num);
+	mark_page_dirty(pager, root_page_num);
+	initialize_index_node(root, NODE_INDEX_LEAF, NULL);
+	set_node_root(root, true);
+	*node_parent(root) = 0;
+	unpin_page(pager, root_page_num);
+
+	void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+	mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+	*db_header_index_root(header, column) = root_page_num;
+	unpin_page(pager, DB_HEADER_PAGE_NUM);
+	index_build(table, column, root_page_num);
+}
+
+static int compare_index_keys(const void* a, const void* b) { return index_key_compare(a, b); }
+
+// 空の索引にテーブルの全ての行を入れる
+// キーの順に並べてから入れるので、どの挿入も右端への追記になり、葉は満杯のまま残る
+static void index_build(Table* table, IndexColumn column, uint32_t root_page_num) {
+	Pager* pager = table->pager;
+	uint32_t capacity = 1024;
+	uint32_t count = 0;
+	IndexKey* keys = malloc(capacity * sizeof(IndexKey));
+	size_t data_capacity = 64 * 1024;
+	size_t data_used = 0;
+	uint8_t* data = malloc(data_capacity);
+
+	Cursor* cursor = table_find(table, 0);
+	uint32_t page_num = cursor->page_num;
+	cursor_close(cursor);
+	while (page_num != 0) {
+		void* node = get_page(pager, page_num);
+		uint32_t num_cells = *leaf_node_num_cells(node);
+		for (uint32_t i = 0; i < num_cells; i++) {
+			RowView view;
+			row_view_from_cell(leaf_node_value(node, i), &view);
+			uint32_t length;
+			const char* value = row_view_column(&view, column, &length);
+			if (count == capacity) {
+				capacity *= 2;
+				keys = realloc(keys, capacity * sizeof(IndexKey));
+			}
+			if (data_used + INDEX_MAX_KEY_SIZE > data_capacity) {
+				data_capacity *= 2;
+				data = realloc(data, data_capacity);
+			}
+			// キーは data の中の位置で覚えておき、読み終えてからポインタにする
+			keys[count].data = (const uint8_t*)(uintptr_t)data_used;
+			keys[count].length = index_key_encode(value, length, view.id, data + data_used);
+			data_used += keys[count].length;
+			count += 1;
+		}
+		uint32_t next_page_num = *leaf_node_next_leaf(node);
+		unpin_page(pager, page_num);
+		page_num = next_page_num;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		keys[i].data = data + (uintptr_t)keys[i].data;
+	}
+	qsort(keys, count, sizeof(IndexKey), compare_index_keys);
+	for (uint32_t i = 0; i < count; i++) {
+		index_insert(table, root_page_num, &keys[i]);
+	}
+	free(keys);
+	free(data);
+}
+
+// 内部ノードの子孫のページを全て空きページにする。page_num 自体は残す
+static void index_free_children(Pager* pager, uint32_t page_num) {
+	void* node = get_page(pager, page_num);
+	if (get_node_type(node) == NODE_INDEX_INTERNAL) {
+		uint32_t num_cells = *leaf_node_num_cells(node);
+		for (uint32_t i = 0; i <= num_cells; i++) {
+			uint32_t child_page_num = index_node_child(node, i);
+			index_free_children(pager, child_page_num);
+			pager_free_page(pager, child_page_num);
+		}
+	}
+	unpin_page(pager, page_num);
+}
+
+// 行を索引を通さずに書き換えた後(.load)、ある索引を全て作り直す
+static void index_rebuild_all(Table* table) {
+	Pager* pager = table->pager;
+	for (IndexColumn column = 0; column < INDEX_NUM_COLUMNS; column++) {
+		void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+		uint32_t root_page_num = *db_header_index_root(header, column);
+		unpin_page(pager, DB_HEADER_PAGE_NUM);
+		if (root_page_num == 0) {
+			continue;
+		}
+		index_free_children(pager, root_page_num);
+		void* root = get_page(pager, root_page_num);
+		mark_page_dirty(pager, root_page_num);
+		initialize_index_node(root, NODE_INDEX_LEAF, NULL);
+		set_node_root(root, true);
+		unpin_page(pager, root_page_num);
+		index_build(table, column, root_page_num);
+	}
+}
+
+// 索引の葉の連結リストで1つ前の葉。先頭の葉なら INVALID_PAGE_NUM
+static uint32_t index_leaf_prev_leaf(Pager* pager, uint32_t page_num) {
+	while (true) {
+		void* node = get_page(pager, page_num);
+		bool root = is_node_root(node);
+		uint32_t parent_page_num = *node_parent(node);
+		unpin_page(pager, page_num);
+		if (root) {
+			return INVALID_PAGE_NUM;
+		}
+
+		void* parent = get_page(pager, parent_page_num);
+		uint32_t child_num = index_node_child_index(parent, page_num);
+		uint32_t sibling_page_num = child_num > 0 ? index_node_child(parent, child_num - 1) : INVALID_PAGE_NUM;
+		unpin_page(pager, parent_page_num);
+		if (sibling_page_num != INVALID_PAGE_NUM) {
+			while (true) {
+				void* sibling = get_page(pager, sibling_page_num);
+				bool leaf = get_node_type(sibling) == NODE_INDEX_LEAF;
+				uint32_t right_child_page_num = *leaf_node_next_leaf(sibling);
+				unpin_page(pager, sibling_page_num);
+				if (leaf) {
+					return sibling_page_num;
+				}
+				sibling_page_num = right_child_page_num;
+			}
+		}
+		page_num = parent_page_num;
+	}
+}
+
+// btree_relocate_page の索引版。根を動かす時はヘッダの根のページ番号を書き換える
+static void index_relocate_page(Table* table, uint32_t from_page_num, uint32_t to_page_num) {
+	Pager* pager = table->pager;
+	uint32_t prev_page_num = INVALID_PAGE_NUM;
+	void* node = get_page(pager, from_page_num);
+	bool leaf = get_node_type(node) == NODE_INDEX_LEAF;
+	unpin_page(pager, from_page_num);
+	if (leaf) {
+		prev_page_num = index_leaf_prev_leaf(pager, from_page_num);
+	}
+
+	node = get_page(pager, from_page_num);
+	void* destination = get_page(pager, to_page_num);
+	mark_page_dirty(pager, to_page_num);
+	memcpy(destination, node, PAGE_SIZE);
+	unpin_page(pager, from_page_num);
+	if (leaf && prev_page_num != INVALID_PAGE_NUM) {
+		void* prev = get_page(pager, prev_page_num);
+		mark_page_dirty(pager, prev_page_num);
+		*leaf_node_next_leaf(prev) = to_page_num;
+		unpin_page(pager, prev_page_num);
+	}
+	if (!leaf) {
+		index_node_adopt_children(pager, destination, to_page_num);
+	}
+
+	bool root = is_node_root(destination);
+	uint32_t parent_page_num = *node_parent(destination);
+	unpin_page(pager, to_page_num);
+	if (root) {
+		void* header = get_page(pager, DB_HEADER_PAGE_NUM);
+		mark_page_dirty(pager, DB_HEADER_PAGE_NUM);
+		for (IndexColumn column = 0; column < INDEX_NUM_COLUMNS; column++) {
+			if (*db_header_index_root(header, column) == from_page_num) {
+				*db_header_index_root(header, column) = to_page_num;
+			}
+		}
+		unpin_page(pager, DB_HEADER_PAGE_NUM);
+	} else {
+		void* parent = get_page(pager, parent_page_num);
+		mark_page_dirty(pager, parent_page_num);
+		index_node_set_child(parent, index_node_child_index(parent, from_page_num), to_page_num);
+		unpin_page(pager, parent_page_num);
+	}
+}
+
+/* Bulk Loader */
+
+static int compare_rows_by_id(const void* a, const void* b) {
+	uint32_t id_a = ((const Row*)a)->id;
+	uint32_t id_b = ((const Row*)b)->id;
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+// 1行を "id username email" として読む。区切りは空白、タブ、カンマ
+static LoadResult load_read_row(FILE* input, char** line, size_t* line_capacity, Row* row) {
+	while (getline(line, line_capacity, input) != -1) {
+		char* id_string = strtok(*line, " \t,\r\n");
+		if (id_string == NULL) {
+			// 空行は読み飛ばす
+			continue;
+		}
+		char* username = strtok(NULL, " \t,\r\n");
+		char* email = strtok(NULL, " \t,\r\n");
+		if (parse_row(id_string, username, email, row) != PREPARE_SUCCESS) {
+			return LOAD_SYNTAX_ERROR;
+		}
+		return LOAD_SUCCESS;
+	}
+	return LOAD_END_OF_INPUT;
+}
+
+// 実行(run)の先頭の行をヒープの比較に使う
+static bool load_run_less(LoadSource* source, uint32_t a, uint32_t b) {
+	return source->runs[a].row.id < source->runs[b].row.id;
+}
+
+static void load_heap_sift_down(LoadSource* source, uint32_t i) {
+	while (true) {
+		uint32_t smallest = i;
+		uint32_t left = i * 2 + 1;
+		uint32_t right = left + 1;
+		if (left < source->heap_size && load_run_less(source, source->heap[left], source->heap[smallest])) {
+			smallest = left;
+		}
+		if (right < source->heap_size && load_run_less(source, source->heap[right], source->heap[smallest])) {
+			smallest = right;
+		}
+		if (smallest == i) {
+			return;
+		}
+		uint32_t tmp = source->heap[i];
+		source->heap[i] = source->heap[smallest];
+		source->heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+// ソート済みの行をバッファから一時ファイルに書き出し、1つの実行にする
+static void load_spill_run(LoadSource* source) {
+	qsort(source->buffer, source->buffer_count, sizeof(Row), compare_rows_by_id);
+	FILE* run_file = tmpfile();
+	if (run_file == NULL ||
+	    fwrite(source->buffer, sizeof(Row), source->buffer_count, run_file) != source->buffer_count) {
+		printf("Error writing sort run: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	rewind(run_file);
+
+	source->runs = realloc(source->runs, (source->num_runs + 1) * sizeof(LoadRun));
+	source->runs[source->num_runs].file = run_file;
+	source->num_runs += 1;
+	source->buffer_count = 0;
+}
+
+// 入力をキー順に読めるように準備する
+// 既にキー順なら入力をそのまま流し、そうでなければ外部マージソートする
+static LoadResult load_source_open(LoadSource* source, const char* filename) {
+	memset(source, 0, sizeof(LoadSource));
+	source->input = fopen(filename, "r");
+	if (source->input == NULL) {
+		return LOAD_FILE_ERROR;
+	}
+
+	// 1回目の走査ではキー順かどうかと構文だけを確かめる
+	Row row;
+	bool sorted = true;
+	bool has_previous = false;
+	uint32_t previous_id = 0;
+	LoadResult result;
+	while ((result = load_read_row(source->input, &source->line, &source->line_capacity, &row)) == LOAD_SUCCESS) {
+		if (has_previous && row.id <= previous_id) {
+			sorted = false;
+		}
+		has_previous = true;
+		previous_id = row.id;
+	}
+	if (result == LOAD_SYNTAX_ERROR) {
+		return LOAD_SYNTAX_ERROR;
+	}
+	rewind(source->input);
+	if (sorted) {
+		return LOAD_SUCCESS;
+	}
+
+	// メモリに収まる分ずつソートして一時ファイルに書き出し、最後にまとめてマージする
+	source->buffer = malloc(LOAD_SORT_BUFFER_ROWS * sizeof(Row));
+	while (load_read_row(source->input, &source->line, &source->line_capacity,
+	                     &source->buffer[source->buffer_count]) == LOAD_SUCCESS) {
+		source->buffer_count += 1;
+		if (source->buffer_count == LOAD_SORT_BUFFER_ROWS) {
+			load_spill_run(source);
+		}
+	}
+	fclose(source->input);
+	source->input = NULL;
+
+	if (source->num_runs == 0) {
+		// 全体がメモリに収まった
+		qsort(source->buffer, source->buffer_count, sizeof(Row), compare_rows_by_id);
+		return LOAD_SUCCESS;
+	}
+	if (source->buffer_count > 0) {
+		load_spill_run(source);
+	}
+	free(source->buffer);
+	source->buffer = NULL;
+
+	source->heap = malloc(source->num_runs * sizeof(uint32_t));
+	for (uint32_t i = 0; i < source->num_runs; i++) {
+		if (fread(&source->runs[i].row, sizeof(Row), 1, source->runs[i].file) == 1) {
+			source->heap[source->heap_size++] = i;
+		}
+	}
+	for (int32_t i = source->heap_size / 2 - 1; i >= 0; i--) {
+		load_heap_sift_down(source, i);
+	}
+	return LOAD_SUCCESS;
+}
+
+// 次の行をキー順に返す。重複したキーを見つけたら LOAD_DUPLICATE_KEY
+static LoadResult load_source_next(LoadSource* source, Row* row) {
+	if (source->input != NULL) {
+		LoadResult result = load_read_row(source->input, &source->line, &source->line_capacity, row);
+		if (result != LOAD_SUCCESS) {
+			return result;
+		}
+	} else if (source->num_runs == 0) {
+		if (source->buffer_pos == source->buffer_count) {
+			return LOAD_END_OF_INPUT;
+		}
+		*row = source->buffer[source->buffer_pos++];
+	} else {
+		if (source->heap_size == 0) {
+			return LOAD_END_OF_INPUT;
+		}
+		LoadRun* run = &source->runs[source->heap[0]];
+		*row = run->row;
+		if (fread(&run->row, sizeof(Row), 1, run->file) != 1) {
+			source->heap[0] = source->heap[--source->heap_size];
+		}
+		load_heap_sift_down(source, 0);
+	}
+
+	if (source->rows_returned > 0 && row->id == source->last_id) {
+		return LOAD_DUPLICATE_KEY;
+	}
+	source->rows_returned += 1;
+	source->last_id = row->id;
+	return LOAD_SUCCESS;
+}
+
+static void load_source_close(LoadSource* source) {
+	if (source->input != NULL) {
+		fclose(source->input);
+	}
+	for (uint32_t i = 0; i < source->num_runs; i++) {
+		fclose(source->runs[i].file);
+	}
+	free(source->runs);
+	free(source->heap);
+	free(source->buffer);
+	free(source->line);
+}
+
+// 作成中の内部ノードを閉じる。最後のセルの子を右の子にする
+static void load_finish_internal_node(Pager* pager, LoadLevel* level) {
+	void* node = get_page(pager, level->page_num);
+	mark_page_dirty(pager, level->page_num);
+	uint32_t last = level->count - 1;
+	uint32_t right_child_page_num = *internal_node_child(node, last);
+	*internal_node_num_keys(node) = last;
+	*internal_node_right_child(node) = right_child_page_num;
+	unpin_page(pager, level->page_num);
+	unpin_page(pager, level->page_num);
+}
+
+// 完成した子ノードを1つ上のレベルの作成中のノードに追加する
+// ノードが満杯なら閉じて、さらに上のレベルに追加する
+static void load_add_child(Pager* pager, LoadLevel* levels, uint32_t level_num,
+                           uint32_t child_page_num, uint32_t child_max_key,
+                           uint32_t internal_node_cells) {
+	if (level_num >= LOAD_MAX_LEVELS) {
+		printf("Bulk load tree is too tall.\n");
+		exit(EXIT_FAILURE);
+	}
+	LoadLevel* level = &levels[level_num];
+	if (level->page_num != INVALID_PAGE_NUM && level->count == internal_node_cells) {
+		load_finish_internal_node(pager, level);
+		load_add_child(pager, levels, level_num + 1, level->page_num, level->max_key,
+		               internal_node_cells);
+		level->page_num = INVALID_PAGE_NUM;
+	}
+
+	if (level->page_num == INVALID_PAGE_NUM) {
+		level->page_num = get_unused_page_num(pager);
+		// 作成中はピンしたままにしておく
+		void* new_node = get_page(pager, level->page_num);
+		mark_page_dirty(pager, level->page_num);
+		initialize_internal_node(new_node);
+		level->count = 0;
+		level->num_nodes += 1;
+	}
+
+	void* node = get_page(pager, level->page_num);
+	mark_page_dirty(pager, level->page_num);
+	*internal_node_num_keys(node) = level->count + 1;
+	*internal_node_child(node, level->count) = child_page_num;
+	*internal_node_key(node, level->count) = child_max_key;
+	level->count += 1;
+	level->max_key = child_max_key;
+	unpin_page(pager, level->page_num);
+
+	void* child = get_page(pager, child_page_num);
+	mark_page_dirty(pager, child_page_num);
+	*node_parent(child) = level->page_num;
+	unpin_page(pager, child_page_num);
+}
+
+// ノードをルートページにコピーしてルートにする
+// 一括読み込みで組み上げた木の最上位のノードと、削除で1段低くなった木の唯一の子に使う
+static void install_root(Table* table, uint32_t top_page_num) {
+	Pager* pager = table->pager;
+	void* top = get_page(pager, top_page_num);
+	void* root = get_page(pager, table->root_page_num);
+	mark_page_dirty(pager, table->root_page_num);
+	memcpy(root, top, PAGE_SIZE);
+	set_node_root(root, true);
+	*node_parent(root) = 0;
+
+	if (get_node_type(root) == NODE_INTERNAL) {
+		uint32_t num_keys = *internal_node_num_keys(root);
+		for (uint32_t i = 0; i <= num_keys; i++) {
+			uint32_t child_page_num = *internal_node_child(root, i);
+			void* child = get_page(pager, child_page_num);
+			mark_page_dirty(pager, child_page_num);
+			*node_parent(child) = table->root_page_num;
+			unpin_page(pager, child_page_num);
+		}
+	}
+	unpin_page(pager, table->root_page_num);
+	unpin_page(pager, top_page_num);
+	// 中身は根に移したので、移した元のページは空く。呼び出し側では空けないこと
+	pager_free_page(pager, top_page_num);
+}
+
+// 組み上げた木のページを全て空きページにする。子を先に空け、page_num は最後に空ける
+static void load_free_tree(Pager* pager, uint32_t page_num) {
+	void* node = get_page(pager, page_num);
+	if (get_node_type(node) == NODE_INTERNAL) {
+		uint32_t num_keys = *internal_node_num_keys(node);
+		for (uint32_t i = 0; i <= num_keys; i++) {
+			load_free_tree(pager, *internal_node_child(node, i));
+		}
+	}
+	unpin_page(pager, page_num);
+	pager_free_page(pager, page_num);
+}
+
+// ソート済みの行からB+木を葉から順に組み上げる
+// 葉は fill_factor まで詰めて next_leaf でつなぎ、同時に各レベルの内部ノードも1パスで作る
+static LoadResult load_build_tree(Table* table, LoadSource* source, double fill_factor,
+                                  uint32_t* num_loaded) {
+	Pager* pager = table->pager;
+	// 葉はセルの領域をこのバイト数まで使う
+	uint32_t leaf_bytes = LEAF_NODE_SPACE_FOR_CELLS * fill_factor;
+	// 内部ノードの子の数。右の子を確定するまでは全員をセルに置くので、セルの数が上限
+	uint32_t internal_node_cells = INTERNAL_NODE_MAX_CELLS * fill_factor;
+	if (internal_node_cells < 2) {
+		internal_node_cells = 2;
+	}
+
+	// levels[0] は葉の1つ上のレベル
+	LoadLevel levels[LOAD_MAX_LEVELS];
+	for (uint32_t i = 0; i < LOAD_MAX_LEVELS; i++) {
+		levels[i].page_num = INVALID_PAGE_NUM;
+		levels[i].count = 0;
+		levels[i].num_nodes = 0;
+	}
+
+	uint32_t leaf_page_num = INVALID_PAGE_NUM;
+	uint32_t leaf_count = 0;
+	uint32_t leaf_used_bytes = 0;
+	uint32_t num_leaves = 0;
+	uint32_t leaf_max_key = 0;
+	void* leaf = NULL;
+	Row row;
+	uint32_t cell[LEAF_NODE_MAX_CELL_SIZE / sizeof(uint32_t)];
+	LoadResult result;
+	while ((result = load_source_next(source, &row)) == LOAD_SUCCESS) {
+		uint32_t cell_size = leaf_cell_from_row(&row, cell);
+		if (leaf_page_num != INVALID_PAGE_NUM && leaf_count > 0 &&
+		    leaf_used_bytes + cell_size + LEAF_NODE_CELL_POINTER_SIZE > leaf_bytes) {
+			// 葉が満杯になったら次の葉につなぎ、親に追加する
+			uint32_t next_page_num = get_unused_page_num(pager);
+			void* next_leaf = get_page(pager, next_page_num);
+			mark_page_dirty(pager, next_page_num);
+			initialize_leaf_node(next_leaf);
+			mark_page_dirty(pager, leaf_page_num);
+			*leaf_node_next_leaf(leaf) = next_page_num;
+			unpin_page(pager, leaf_page_num);
+			load_add_child(pager, levels, 0, leaf_page_num, leaf_max_key, internal_node_cells);
+
+			leaf_page_num = next_page_num;
+			leaf = next_leaf;
+			leaf_count = 0;
+			leaf_used_bytes = 0;
+			num_leaves += 1;
+		}
+		if (leaf_page_num == INVALID_PAGE_NUM) {
+			leaf_page_num = get_unused_page_num(pager);
+			leaf = get_page(pager, leaf_page_num);
+			mark_page_dirty(pager, leaf_page_num);
+			initialize_leaf_node(leaf);
+			num_leaves += 1;
+		}
+
+		// 途中のコミットでダーティでなくなっている場合があるので、毎回印を付ける
+		mark_page_dirty(pager, leaf_page_num);
+		leaf_node_put_cell(leaf, leaf_count, cell, cell_size);
+		leaf_count += 1;
+		leaf_used_bytes += cell_size + LEAF_NODE_CELL_POINTER_SIZE;
+		leaf_max_key = row.id;
+		*num_loaded += 1;
+
+		// 大きな読み込みでもWALが際限なく伸びないように、途中でもコミットする
+		// 新しい木はルートに付け替えるまでどこからも参照されないので、途中の状態が見えることはない
+		if (pager->num_dirty_pages >= WAL_AUTOCHECKPOINT_PAGES) {
+			pager_commit(pager);
+			if (wal_needs_checkpoint(pager->wal)) {
+				pager_checkpoint(pager);
+			}
+		}
+	}
+
+	if (leaf_page_num == INVALID_PAGE_NUM) {
+		return result == LOAD_END_OF_INPUT ? LOAD_SUCCESS : result;
+	}
+
+	// 最後の葉と各レベルの作成中のノードを閉じていき、1つだけ残ったノードをルートにする
+	uint32_t top_page_num = leaf_page_num;
+	unpin_page(pager, leaf_page_num);
+	if (num_leaves > 1) {
+		load_add_child(pager, levels, 0, leaf_page_num, leaf_max_key, internal_node_cells);
+		for (uint32_t i = 0; i < LOAD_MAX_LEVELS; i++) {
+			LoadLevel* level = &levels[i];
+			load_finish_internal_node(pager, level);
+			if (level->num_nodes == 1) {
+				top_page_num = level->page_num;
+				break;
+			}
+			load_add_child(pager, levels, i + 1, level->page_num, level->max_key,
+			               internal_node_cells);
+		}
+	}
+
+	if (result != LOAD_END_OF_INPUT) {
+		// 途中で失敗した場合は、組み上げた木をルートにつながずに空きページに戻す
+		// 途中のコミットで書いたページもあるので、戻さないと木にも空きページのリストにもないページが残る
+		load_free_tree(pager, top_page_num);
+		return result;
+	}
+
+	install_root(table, top_page_num);
+	// 右端の葉がルートに移った場合、覚えているページは使われなくなっている
+	table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+	return LOAD_SUCCESS;
+}
+
+// 既存の行がある場合は、キー順に並べた行を通常の挿入と同じ経路で入れる
+static LoadResult load_insert_rows(Table* table, LoadSource* source, uint32_t* num_loaded) {
+	Row row;
+	LoadResult result;
+	while ((result = load_source_next(source, &row)) == LOAD_SUCCESS) {
+		Cursor* cursor = table_find(table, row.id);
+		bool duplicate = cursor->cell_num < *leaf_node_num_cells(cursor->node) &&
+		                 *leaf_node_key(cursor->node, cursor->cell_num) == row.id;
+		if (duplicate) {
+			cursor_close(cursor);
+			return LOAD_DUPLICATE_KEY;
+		}
+		leaf_node_insert(cursor, row.id, &row);
+		cursor_close(cursor);
+		*num_loaded += 1;
+	}
+	return result == LOAD_END_OF_INPUT ? LOAD_SUCCESS : result;
+}
+
+// ファイルの行をテーブルに一括で読み込む
+// 空のテーブルには木を葉から組み上げ、そうでなければ1行ずつ挿入する
+static LoadResult table_bulk_load(Table* table, const char* filename, double fill_factor,
+                                  uint32_t* num_loaded) {
+	*num_loaded = 0;
+	if (fill_factor <= 0 || fill_factor > 1) {
+		return LOAD_INVALID_FILL_FACTOR;
+	}
+
+	LoadSource source;
+	LoadResult result = load_source_open(&source, filename);
+	if (result == LOAD_SUCCESS) {
+		void* root = get_page(table->pager, table->root_page_num);
+		bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+		unpin_page(table->pager, table->root_page_num);
+
+		if (empty) {
+			result = load_build_tree(table, &source, fill_factor, num_loaded);
+		} else {
+			result = load_insert_rows(table, &source, num_loaded);
+		}
+	}
+	load_source_close(&source);
+	// 行は索引を通さずに入れたので、索引は同じコミットで作り直す
+	if (*num_loaded > 0) {
+		index_rebuild_all(table);
+	}
+	pager_commit(table->pager);
+
+	return result;
+}
+
+// ノードが根から右の子だけをたどって届く位置にあるか
+static bool internal_node_is_rightmost(Pager* pager, uint32_t page_num) {
+	while (true) {
+		void* node = get_page(pager, page_num);
+		bool root = is_node_root(node);
+		uint32_t parent_page_num = *node_parent(node);
+		unpin_page(pager, page_num);
+		if (root) {
+			return true;
+		}
+
+		void* parent = get_page(pager, parent_page_num);
+		uint32_t right_child_page_num = *internal_node_right_child(parent);
+		unpin_page(pager, parent_page_num);
+		if (right_child_page_num != page_num) {
+			return false;
+		}
+		page_num = parent_page_num;
+	}
+}
+
+// SIGINT か SIGTERM を受けたら、サーバはイベントループを抜けてデータベースを閉じる
+static volatile sig_atomic_t server_stopping = 0;
+
+static void server_handle_signal(int signal_number) {
+	(void)signal_number;
+	server_stopping = 1;
+}
+
+// ./db --listen host:port で、標準入力の代わりにソケットから要求を受ける
+// シグナルはイベントを待っている間だけ受け取り、受け取ったら全ての接続を閉じて戻る
+void db_serve(Table* table, const char* address, uint32_t send_buffer_size) {
+	Server server;
+	server_open(&server, address);
+	server.table = table;
+	server.send_buffer_size = send_buffer_size;
+
+	sigset_t stop_signals;
+	sigset_t wait_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	sigdelset(&wait_mask, SIGINT);
+	sigdelset(&wait_mask, SIGTERM);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	while (!server_stopping) {
+		int num_events = epoll_pwait(server.epoll, events, SERVER_MAX_EVENTS, -1, &wait_mask);
+		if (num_events == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("Error waiting for events: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < num_events; i++) {
+			if (events[i].data.ptr == NULL) {
+				server_accept(&server);
+				continue;
+			}
+			Connection* connection = events[i].data.ptr;
+			if ((events[i].events & EPOLLERR) ||
+			    ((events[i].events & (EPOLLIN | EPOLLHUP)) && !connection_read(connection)) ||
+			    !connection_service(&server, connection)) {
+				connection_close(&server, connection);
+			}
+		}
+	}
+	server_close(&server);
+}
+
+// host:port で待ち受ける。port が 0 なら空いているポートを使う
+// 実際に待ち受けたアドレスを表示するので、クライアントはそれを読んで接続する
+static void server_open(Server* server, const char* address) {
+	memset(server, 0, sizeof(Server));
+	char host[INET_ADDRSTRLEN];
+	const char* colon = strrchr(address, ':');
+	char* end = NULL;
+	long port = colon == NULL ? -1 : strtol(colon + 1, &end, 10);
+	struct sockaddr_in socket_address;
+	memset(&socket_address, 0, sizeof(socket_address));
+	socket_address.sin_family = AF_INET;
+	if (port < 0 || port > 65535 || *end != '\0' || colon == address ||
+	    (size_t)(colon - address) >= sizeof(host)) {
+		printf("Invalid address '%s'. Use host:port.\n", address);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+	if (inet_pton(AF_INET, host, &socket_address.sin_addr) != 1) {
+		printf("Invalid address '%s'. Use host:port.\n", address);
+		exit(EXIT_FAILURE);
+	}
+	socket_address.sin_port = htons(port);
+
+	server->listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int reuse = 1;
+	setsockopt(server->listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (server->listen_socket == -1 ||
+	    bind(server->listen_socket, (struct sockaddr*)&socket_address, sizeof(socket_address)) == -1 ||
+	    listen(server->listen_socket, SOMAXCONN) == -1) {
+		printf("Could not listen on '%s': %s\n", address, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	socklen_t address_length = sizeof(socket_address);
+	getsockname(server->listen_socket, (struct sockaddr*)&socket_address, &address_length);
+
+	server->epoll = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+	epoll_ctl(server->epoll, EPOLL_CTL_ADD, server->listen_socket, &event);
+
+	printf("Listening on %s:%d\n", host, ntohs(socket_address.sin_port));
+	fflush(stdout);
+}
+
+static void server_accept(Server* server) {
+	while (true) {
+		int client_socket = accept4(server->listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_socket == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// EAGAIN: 待っている接続はもうない
+			return;
+		}
+		// 応答は溜めてからまとめて送るので、小さな応答を待たせない
+		int no_delay = 1;
+		setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+		if (server->send_buffer_size > 0) {
+			setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, &server->send_buffer_size,
+			           sizeof(server->send_buffer_size));
+		}
+
+		Connection* connection = calloc(1, sizeof(Connection));
+		connection->socket = client_socket;
+		connection->input = malloc(SERVER_INPUT_BUFFER_SIZE);
+		connection->output_capacity = SERVER_ROWS_FRAME_SIZE;
+		connection->output = malloc(connection->output_capacity);
+		connection->sql = malloc(PROTOCOL_MAX_REQUEST_SIZE + 1);
+		connection->events = EPOLLIN;
+		connection->next = server->connections;
+		if (server->connections != NULL) {
+			server->connections->prev = connection;
+		}
+		server->connections = connection;
+		struct epoll_event event = {.events = connection->events, .data.ptr = connection};
+		epoll_ctl(server->epoll, EPOLL_CTL_ADD, client_socket, &event);
+	}
+}
+
+// 終わっていないトランザクションは接続を閉じる時にロールバックされる
+static void server_close(Server* server) {
+	while (server->connections != NULL) {
+		connection_close(server, server->connections);
+	}
+	close(server->listen_socket);
+	close(server->epoll);
+}
+
+// 受け取れるだけ受け取る。接続が壊れていれば false
+static bool connection_read(Connection* connection) {
+	while (connection->input_used < SERVER_INPUT_BUFFER_SIZE && !connection->input_closed) {
+		ssize_t received = recv(connection->socket, connection->input + connection->input_used,
+		                        SERVER_INPUT_BUFFER_SIZE - connection->input_used, 0);
+		if (received > 0) {
+			connection->input_used += received;
+		} else if (received == 0) {
+			connection->input_closed = true;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// 届いている要求を処理して応答を送り、次に待つイベントを決める
+// 接続を閉じるべきなら false
+static bool connection_service(Server* server, Connection* connection) {
+	if (!connection_run(server, connection) || !connection_flush(connection)) {
+		return false;
+	}
+	// 相手が書き込みを閉じ、答える要求も送る応答も残っていない
+	if (connection->input_closed && connection->output_sent == connection->output_used &&
+	    connection->statement == NULL && !connection_has_request(connection)) {
+		return false;
+	}
+	connection_update_events(server, connection);
+	return true;
+}
+
+// 送れていない応答が溜まりすぎるまで、実行中の文を進め、次の要求を処理する
+// 要求が壊れていて接続を閉じるべきなら false
+static bool connection_run(Server* server, Connection* connection) {
+	uint32_t consumed = 0;
+	while (connection->output_used - connection->output_sent < SERVER_OUTPUT_HIGH_WATER) {
+		if (connection->statement != NULL) {
+			if (connection_waits(server, connection)) {
+				break;
+			}
+			connection_stream(server, connection);
+			continue;
+		}
+		uint32_t available = connection->input_used - consumed;
+		if (available < PROTOCOL_FRAME_HEADER_SIZE) {
+			break;
+		}
+		uint32_t length;
+		memcpy(&length, connection->input + consumed, sizeof(length));
+		if (length == 0 || length > PROTOCOL_MAX_REQUEST_SIZE) {
+			return false;
+		}
+		if (available < sizeof(length) + length) {
+			break;
+		}
+		const uint8_t* frame = connection->input + consumed + sizeof(length);
+		if (frame[0] == REQUEST_QUERY) {
+			connection_start_query(server, connection, frame + 1, length - 1);
+		} else {
+			connection_write_done(connection, RESPONSE_STATUS_ERROR, "Error: Unknown request.");
+		}
+		consumed += sizeof(length) + length;
+	}
+	// 残った要求を先頭に詰める
+	memmove(connection->input, connection->input + consumed, connection->input_used - consumed);
+	connection->input_used -= consumed;
+	return true;
+}
+
+// 実行中の文か、今処理できる要求がある
+static bool connection_runnable(Server* server, Connection* connection) {
+	if (connection->statement != NULL) {
+		return !connection_waits(server, connection);
+	}
+	return connection_has_request(connection);
+}
+
+// 他の接続のトランザクションが終わるまで、書き込む文と begin, commit, rollback は待つ
+// 同じスレッドで動くので、待たせないと write_mutex を再帰的に取って他人のトランザクションに混ざる
+// select はコミット済みのスナップショットを読むので待たない
+static bool connection_waits(Server* server, Connection* connection) {
+	return connection->statement->type != STATEMENT_SELECT && server->transaction_owner != NULL &&
+	       server->transaction_owner != connection;
+}
+
+// 要求が1つ全部届いている(壊れた長さも、接続を閉じるために処理する)
+static bool connection_has_request(Connection* connection) {
+	if (connection->input_used < PROTOCOL_FRAME_HEADER_SIZE) {
+		return false;
+	}
+	uint32_t length;
+	memcpy(&length, connection->input, sizeof(length));
+	return length == 0 || length > PROTOCOL_MAX_REQUEST_SIZE ||
+	       connection->input_used >= sizeof(length) + length;
+}
+
+// REQUEST_QUERY の文を準備し、パラメータを bind して実行中の文にする
+// 準備や bind に失敗したら、その場でエラーを返す
+static void connection_start_query(Server* server, Connection* connection, const uint8_t* body,
+                                   uint32_t length) {
+	const uint8_t* end = body + length;
+	if (length < 1) {
+		connection_write_done(connection, RESPONSE_STATUS_ERROR, "Error: Malformed request.");
+		return;
+	}
+	uint32_t num_params = body[0];
+	const uint8_t* params = body + 1;
+	// SQL はパラメータの後ろにある
+	const uint8_t* p = params;
+	for (uint32_t i = 0; i < num_params; i++) {
+		uint32_t size = 0;
+		if (p == end) {
+			p = NULL;
+		} else if (*p == PARAM_INT) {
+			p += 1;
+			size = sizeof(int64_t);
+		} else if (*p == PARAM_TEXT) {
+			p += 1;
+			if (!protocol_read_varint(&p, end, &size)) {
+				p = NULL;
+			}
+		} else {
+			p = NULL;
+		}
+		if (p == NULL || (size_t)(end - p) < size) {
+			connection_write_done(connection, RESPONSE_STATUS_ERROR, "Error: Malformed request.");
+			return;
+		}
+		p += size;
+	}
+	memcpy(connection->sql, p, end - p);
+	connection->sql[end - p] = '\0';
+
+	Statement* statement;
+	PrepareResult prepare_result = statement_cache_prepare(&connection->statement_cache, server->table,
+	                                                       connection->sql, &statement);
+	if (prepare_result != PREPARE_SUCCESS) {
+		connection_write_done(connection, RESPONSE_STATUS_ERROR, prepare_result_message(prepare_result));
+		return;
+	}
+	// キャッシュから返った文には前の要求で bind した値が残っている
+	statement->bound_params = 0;
+	p = params;
+	for (uint32_t i = 1; i <= num_params; i++) {
+		BindResult bind_result;
+		if (*p++ == PARAM_INT) {
+			int64_t value;
+			memcpy(&value, p, sizeof(value));
+			p += sizeof(value);
+			bind_result = statement_bind_int(statement, i, value);
+		} else {
+			uint32_t size;
+			protocol_read_varint(&p, end, &size);
+			char text[COLUMN_EMAIL_SIZE + 1];
+			if (size > COLUMN_EMAIL_SIZE) {
+				bind_result = BIND_STRING_TOO_LONG;
+			} else {
+				memcpy(text, p, size);
+				text[size] = '\0';
+				bind_result = statement_bind_text(statement, i, text);
+			}
+			p += size;
+		}
+		const char* message = NULL;
+		switch (bind_result) {
+			case (BIND_SUCCESS):
+				break;
+			case (BIND_OUT_OF_RANGE):
+				// 番号が文の ? の数を超えたか、値が大きすぎる
+				message = i > statement->num_params ? "Error: Too many parameters."
+				                                    : prepare_result_message(PREPARE_NUMBER_OUT_OF_RANGE);
+				break;
+			case (BIND_TYPE_MISMATCH):
+				message = "Error: Parameter type mismatch.";
+				break;
+			case (BIND_STRING_TOO_LONG):
+				message = prepare_result_message(PREPARE_STRING_TOO_LONG);
+				break;
+			case (BIND_NEGATIVE_ID):
+				message = prepare_result_message(PREPARE_NEGATIVE_ID);
+				break;
+		}
+		if (message != NULL) {
+			connection_write_done(connection, RESPONSE_STATUS_ERROR, message);
+			return;
+		}
+	}
+	statement->session = connection;
+	connection->statement = statement;
+}
+
+// 実行中の文を進め、select の行を RESPONSE_ROWS に詰める
+// 応答が溜まりすぎたらフレームを閉じて戻る。続きは送れてから呼ばれる
+// 文が終わったら RESPONSE_DONE を書き、begin, commit, rollback ならトランザクションの持ち主を変える
+static void connection_stream(Server* server, Connection* connection) {
+	Statement* statement = connection->statement;
+	uint32_t frame = UINT32_MAX;
+	ExecuteResult result;
+	RowView row;
+	while ((result = statement_step(statement)) == EXECUTE_ROW) {
+		statement_row_view(statement, &row);
+		if (frame == UINT32_MAX) {
+			frame = connection_begin_frame(connection, RESPONSE_ROWS);
+		}
+		memcpy(connection_reserve(connection, row.size), row.data, row.size);
+		connection->output_used += row.size;
+		if (connection->output_used - frame >= SERVER_ROWS_FRAME_SIZE) {
+			connection_end_frame(connection, frame);
+			frame = UINT32_MAX;
+			if (connection->output_used - connection->output_sent >= SERVER_OUTPUT_HIGH_WATER) {
+				return;
+			}
+		}
+	}
+	if (frame != UINT32_MAX) {
+		connection_end_frame(connection, frame);
+	}
+	connection->statement = NULL;
+	if (result != EXECUTE_SUCCESS) {
+		connection_write_done(connection, RESPONSE_STATUS_ERROR, execute_result_message(result));
+		return;
+	}
+	connection_write_done(connection, RESPONSE_STATUS_OK, "");
+
+	if (statement->type == STATEMENT_BEGIN) {
+		server->transaction_owner = connection;
+	} else if (statement->type == STATEMENT_COMMIT || statement->type == STATEMENT_ROLLBACK) {
+		// 待たせていた接続を再開する
+		server->transaction_owner = NULL;
+		for (Connection* other = server->connections; other != NULL; other = other->next) {
+			connection_update_events(server, other);
+		}
+	}
+}
+
+// 応答に size バイトを書ける場所を返す。書いた分は output_used に足すこと
+// 書いている途中のフレームは output の先頭からの位置で覚えているので、ここでは詰めずに広げるだけにする
+static uint8_t* connection_reserve(Connection* connection, uint32_t size) {
+	if (connection->output_used + size > connection->output_capacity) {
+		while (connection->output_used + size > connection->output_capacity) {
+			connection->output_capacity *= 2;
+		}
+		connection->output = realloc(connection->output, connection->output_capacity);
+	}
+	return connection->output + connection->output_used;
+}
+
+// フレームの見出しを書き、その位置を返す。長さは connection_end_frame で埋める
+static uint32_t connection_begin_frame(Connection* connection, ResponseType type) {
+	uint8_t* header = connection_reserve(connection, PROTOCOL_FRAME_HEADER_SIZE);
+	header[sizeof(uint32_t)] = type;
+	uint32_t frame = connection->output_used;
+	connection->output_used += PROTOCOL_FRAME_HEADER_SIZE;
+	return frame;
+}
+
+static void connection_end_frame(Connection* connection, uint32_t frame) {
+	uint32_t length = connection->output_used - frame - sizeof(uint32_t);
+	memcpy(connection->output + frame, &length, sizeof(length));
+}
+
+static void connection_write_done(Connection* connection, ResponseStatus status, const char* message) {
+	uint32_t frame = connection_begin_frame(connection, RESPONSE_DONE);
+	uint32_t message_length = strlen(message);
+	uint8_t* body = connection_reserve(connection, 1 + message_length);
+	body[0] = status;
+	memcpy(body + 1, message, message_length);
+	connection->output_used += 1 + message_length;
+	connection_end_frame(connection, frame);
+}
+
+// 送れるだけ送る。接続が壊れていれば false
+// connection_stream はフレームを閉じてから戻るので、ここで送り終えた分を詰めてもフレームの位置は狂わない
+static bool connection_flush(Connection* connection) {
+	while (connection->output_sent < connection->output_used) {
+		ssize_t sent = send(connection->socket, connection->output + connection->output_sent,
+		                    connection->output_used - connection->output_sent, MSG_NOSIGNAL);
+		if (sent >= 0) {
+			connection->output_sent += sent;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			memmove(connection->output, connection->output + connection->output_sent,
+			        connection->output_used - connection->output_sent);
+			connection->output_used -= connection->output_sent;
+			connection->output_sent = 0;
+			return true;
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+	connection->output_sent = 0;
+	connection->output_used = 0;
+	return true;
+}
+
+// 受け取る場所があれば EPOLLIN を、送るものか処理できる要求があれば EPOLLOUT を待つ
+// 処理できる要求があるうちは送れるとすぐに起こされるので、接続を順番に少しずつ処理できる
+static void connection_update_events(Server* server, Connection* connection) {
+	uint32_t events = 0;
+	if (!connection->input_closed && connection->input_used < SERVER_INPUT_BUFFER_SIZE) {
+		events |= EPOLLIN;
+	}
+	if (connection->output_sent < connection->output_used || connection_runnable(server, connection)) {
+		events |= EPOLLOUT;
+	}
+	if (events != connection->events) {
+		connection->events = events;
+		struct epoll_event event = {.events = events, .data.ptr = connection};
+		epoll_ctl(server->epoll, EPOLL_CTL_MOD, connection->socket, &event);
+	}
+}
+
+static void connection_close(Server* server, Connection* connection) {
+	// 実行中の select のスナップショットを手放す
+	statement_cache_clear(&connection->statement_cache);
+	if (server->transaction_owner == connection) {
+		execute_rollback(server->table);
+		server->transaction_owner = NULL;
+		for (Connection* other = server->connections; other != NULL; other = other->next) {
+			if (other != connection) {
+				connection_update_events(server, other);
+			}
+		}
+	}
+	epoll_ctl(server->epoll, EPOLL_CTL_DEL, connection->socket, NULL);
+	close(connection->socket);
+	if (connection->prev != NULL) {
+		connection->prev->next = connection->next;
+	} else {
+		server->connections = connection->next;
+	}
+	if (connection->next != NULL) {
+		connection->next->prev = connection->prev;
+	}
+	free(connection->input);
+	free(connection->output);
+	free(connection->sql);
+	free(connection);
+}
+
+// 要求の中の varint を読む。end を越える場合は false
+static bool protocol_read_varint(const uint8_t** p, const uint8_t* end, uint32_t* value) {
+	*value = 0;
+	for (uint32_t shift = 0; shift < 7 * VARINT_MAX_SIZE && *p < end; shift += 7) {
+		uint8_t byte = *(*p)++;
+		*value |= (uint32_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
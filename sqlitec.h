@@ -0,0 +1,211 @@
+// libsqlitec: id, username, email の行を B+木に持つデータベース
+//
+//   PagerOptions options = {PAGER_DEFAULT_NUM_FRAMES, false, PAGE_CODEC_NONE};
+//   Table* table = db_open("sample.db", &options);
+//   Statement* statement;
+//   prepare_statement(table, "select where id between ? and ?", &statement);
+//   statement_bind_int(statement, 1, 10);
+//   statement_bind_int(statement, 2, 20);
+//   RowView row;
+//   while (statement_step(statement) == EXECUTE_ROW) {
+//   	statement_row_view(statement, &row);
+//   }
+//   statement_finalize(statement);
+//   db_close(table);
+//
+// 1つの Table を複数のスレッドで使える。select は他の文と並行に動き、書き込む文は1つずつ実行する
+// Statement と Cursor は作ったスレッドだけで使う
+#ifndef SQLITEC_H
+#define SQLITEC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// define the column size
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+
+// バッファプールのフレーム数の既定値と下限
+#define PAGER_DEFAULT_NUM_FRAMES 256
+#define PAGER_MIN_NUM_FRAMES 16
+
+/* define the rows layout */
+typedef struct {
+	uint32_t id;
+	char username[COLUMN_USERNAME_SIZE + 1];
+	char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+// ページ上のシリアライズされた行を指すだけの行。ページのピンが外れるまで有効
+typedef struct {
+	uint32_t id;
+	const char* username;
+	uint32_t username_length;
+	const char* email;
+	uint32_t email_length;
+	// シリアライズされた行全体
+	const void* data;
+	uint32_t size;
+} RowView;
+
+// 新しく作るデータベースファイルのページの圧縮方式。既存のファイルは作った時の方式で開く
+typedef enum {
+	// 圧縮せず、ページ番号 * PAGE_SIZE の位置に置く
+	PAGE_CODEC_NONE,
+	// LZ4 と同じ形式で圧縮し、ページマップで置き場所を引く
+	PAGE_CODEC_LZ
+} PageCodec;
+
+typedef struct {
+	uint32_t num_frames;
+	bool use_mmap;
+	PageCodec codec;
+} PagerOptions;
+
+// 文の種類ごとの実行時間の分布。buckets[i] は 2^i ns 以上 2^(i+1) ns 未満の回数
+// select は最初の statement_step から最後の行を返し終えるまでを1回と数える
+#define DB_STATS_LATENCY_BUCKETS 40
+typedef struct {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t buckets[DB_STATS_LATENCY_BUCKETS];
+} DbLatency;
+
+// find_depths[i] は根から葉まで i ノードだった探索の回数。これより深い木は最後に数える
+#define DB_STATS_MAX_DEPTH 16
+// statements の添字の順: insert, select, update, delete, begin, commit, rollback, create index
+#define DB_STATS_NUM_STATEMENT_TYPES 8
+
+// db_open からの累計。どのスレッドからも数えるので、読んだ値は互いに少しずれていることがある
+typedef struct {
+	// バッファプールで見つかったページと見つからなかったページ(--mmap では数えない)
+	uint64_t page_hits;
+	uint64_t page_misses;
+	// WALかファイルから読んだページと、WALに追記するかチェックポイントで書き戻したページ
+	uint64_t pages_read;
+	uint64_t pages_written;
+	// コミットで変更したページをWALに書いた回数、バイト数、システムコールの数
+	uint64_t flushes;
+	uint64_t flush_bytes;
+	uint64_t flush_syscalls;
+	// WALに書いたコミットと、それを永続化した fdatasync の数。同時にコミットした書き手は同期を分け合う
+	uint64_t commits;
+	uint64_t wal_syncs;
+	// 根から葉への探索(書き手と読み手の両方)と、そこで読んだノードの数
+	uint64_t finds;
+	uint64_t find_nodes_visited;
+	uint64_t find_depths[DB_STATS_MAX_DEPTH + 1];
+	// 葉の分割、内部ノードへの子の追加、内部ノードの分割
+	uint64_t leaf_splits;
+	uint64_t internal_inserts;
+	uint64_t internal_splits;
+	DbLatency statements[DB_STATS_NUM_STATEMENT_TYPES];
+} DbStats;
+
+typedef struct Table Table;
+typedef struct Statement Statement;
+typedef struct Cursor Cursor;
+
+typedef enum {
+	PREPARE_SUCCESS,
+	PREPARE_UNRECOGNIZED_STATEMENT,
+	PREPARE_SYNTAX_ERROR,
+	PREPARE_STRING_TOO_LONG,
+	PREPARE_NEGATIVE_ID,
+	// id か limit が UINT32_MAX を超えた
+	PREPARE_NUMBER_OUT_OF_RANGE
+} PrepareResult;
+
+typedef enum {
+	EXECUTE_SUCCESS,
+	// statement_step が1行を返した。行は statement_row で読む
+	EXECUTE_ROW,
+	EXECUTE_TABLE_FULL,
+	EXECUTE_DUPLICATE_KEY,
+	EXECUTE_KEY_NOT_FOUND,
+	EXECUTE_UNBOUND_PARAMETER,
+	// begin の中で begin した
+	EXECUTE_TRANSACTION_ACTIVE,
+	// begin せずに commit か rollback した
+	EXECUTE_NO_TRANSACTION,
+	// create index で、その列の索引が既にある
+	EXECUTE_INDEX_EXISTS
+} ExecuteResult;
+
+typedef enum {
+	BIND_SUCCESS,
+	BIND_OUT_OF_RANGE,
+	BIND_TYPE_MISMATCH,
+	BIND_STRING_TOO_LONG,
+	BIND_NEGATIVE_ID
+} BindResult;
+
+typedef enum {
+	LOAD_SUCCESS,
+	LOAD_END_OF_INPUT,
+	LOAD_FILE_ERROR,
+	LOAD_SYNTAX_ERROR,
+	LOAD_DUPLICATE_KEY,
+	LOAD_INVALID_FILL_FACTOR,
+	// トランザクションの中では読み込めない
+	LOAD_TRANSACTION_ACTIVE
+} LoadResult;
+
+// データベースファイルを開く。WALが残っていれば、コミット済みの変更を戻してから返す
+Table* db_open(const char* filename, PagerOptions* options);
+// 終わっていないトランザクションを捨て、WALをデータベースファイルに戻して閉じる
+void db_close(Table* table);
+
+// SQLを解析して文を作る。文は statement_finalize で解放する
+PrepareResult prepare_statement(Table* table, const char* sql, Statement** statement);
+// テーブルが持つ文のキャッシュから文を得る。返した文は finalize しないこと
+// 次にこの関数を呼ぶまでに使い終えること。db_open したスレッドだけで使う
+PrepareResult table_prepare_cached(Table* table, const char* sql, Statement** statement);
+// i番目(1から数える)の ? に値を与える。次に bind するまで残る
+BindResult statement_bind_int(Statement* statement, uint32_t index, int64_t value);
+BindResult statement_bind_text(Statement* statement, uint32_t index, const char* value);
+// 文を1段階実行する
+// select は1行ごとに EXECUTE_ROW を返し、最後まで読むと EXECUTE_SUCCESS を返す
+// begin の外で変更のある文を実行すると、返る前にコミットされている
+ExecuteResult statement_step(Statement* statement);
+// statement_step が最後に返した行のコピー
+Row* statement_row(Statement* statement);
+// statement_step が最後に返した行を、コピーせずに参照する。次に statement_step を呼ぶまで有効
+void statement_row_view(Statement* statement, RowView* view);
+// 実行中の select を打ち切り、最初から実行できるようにする。bind した値は残る
+void statement_reset(Statement* statement);
+void statement_finalize(Statement* statement);
+// 結果を表すメッセージ(REPL が表示するもの)
+const char* prepare_result_message(PrepareResult result);
+const char* execute_result_message(ExecuteResult result);
+
+// id が start_key 以上の行から、id の順に読むカーソルを開く
+// 開いた時点でコミットされていた内容を読み、cursor_close まで .load と .vacuum を待たせる
+Cursor* table_scan(Table* table, uint32_t start_key);
+bool cursor_at_end(Cursor* cursor);
+// カーソルが指す行を参照する。次に cursor_advance を呼ぶまで有効
+void cursor_row_view(Cursor* cursor, RowView* view);
+void cursor_advance(Cursor* cursor);
+void cursor_close(Cursor* cursor);
+
+// ファイルから行を読み込む(.load)。空のテーブルなら fill_factor まで詰めた木を組み上げる
+LoadResult db_load(Table* table, const char* filename, double fill_factor, uint32_t* num_loaded);
+// ファイルを詰める(.vacuum)。max_pages が 0 なら木全体を書き直し、
+// そうでなければ末尾から最大 max_pages ページだけ動かして、残った空きページの数を free_count に返す
+// トランザクションの中では何もせずに false を返す
+bool db_vacuum(Table* table, uint32_t max_pages, uint32_t* num_pages, uint32_t* free_count);
+// 木の形を表示する(.btree)。トランザクションの中では false を返す
+bool db_print_tree(Table* table);
+void db_print_constants(void);
+// 木と空きページのリスト、ファイルの全てのページのチェックサムを複数のスレッドで調べて表示する(.check)
+// 見つけた問題の数を num_errors に返す。トランザクションの中では何もせずに false を返す
+bool db_check(Table* table, uint32_t* num_errors);
+// 統計を読む
+void db_stats(Table* table, DbStats* stats);
+// 統計を表示する(.stats)。json なら1行の JSON で書く
+void db_print_stats(Table* table, bool json);
+// host:port で待ち受け、protocol.h の形式で要求に答える。SIGINT か SIGTERM で戻る
+// send_buffer_size が 0 でなければ、接続ごとの送信バッファ(SO_SNDBUF)をこの大きさにする
+void db_serve(Table* table, const char* address, uint32_t send_buffer_size);
+
+#endif